@@ -0,0 +1,608 @@
+// OpenCV
+#include <opencv2/opencv.hpp>
+
+// Boost includes
+#include <boost/program_options.hpp>
+
+// General C++ includes
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+//relative files
+#include "ert.h"
+#include "grey.h"
+#include "motion.h"
+#include "warp.h"
+#include "warp_kernel.h"
+
+// namespaces
+using namespace std;
+using namespace cv;
+namespace po = boost::program_options;
+
+// Synthetic footage benchmark. A textured scene is filmed by a virtual
+// camera moving along a known path, so every estimated transform can be
+// compared against the ground truth. Each tool's estimation and rendering
+// stages are timed on the generated frames and the results are written as
+// JSON, to be compared across commits.
+
+struct Scenario
+{
+  string name;
+  string motion;     // translation, rotation or affine
+  double noise;      // sigma of the additive gaussian noise
+  double blur;       // sigma of the gaussian blur, 0 = none
+  int outliers;      // independently moving patches
+};
+
+struct Clip
+{
+  vector<Mat> frames;
+  vector<Mat> poses;  // frame k pixel -> scene pixel (2x3)
+};
+
+struct StageResult
+{
+  StageResult() : ms(0), frames(0), failures(0) {}
+
+  void addError( double e ) { errors.push_back(e); }
+
+  double ms;
+  int frames;
+  int failures;
+  vector<double> errors;
+  vector<int> iterations;
+  vector<double> diffs;  // largest pixel difference to a reference, per frame
+};
+
+Mat to3x3( const Mat &A )
+{
+  Mat A3 = Mat::eye(3, 3, CV_64F);
+  A.copyTo(A3.rowRange(0, 2));
+  return A3;
+}
+
+// Transform taking pixels of frame `from` to pixels of frame `to`.
+Mat relative_pose( const Clip &clip, int from, int to )
+{
+  Mat R = to3x3(clip.poses[to]).inv() * to3x3(clip.poses[from]);
+  return R.rowRange(0, 2).clone();
+}
+
+// Mean displacement between two transforms over the frame corners and centre.
+double transform_error( const Mat &T_est, const Mat &T_gt, Size sz )
+{
+  Point2d pts[5] = { Point2d(0, 0), Point2d(sz.width, 0), Point2d(0, sz.height),
+                     Point2d(sz.width, sz.height), Point2d(sz.width/2.0, sz.height/2.0) };
+  Mat E, G;
+  T_est.convertTo(E, CV_64F);
+  T_gt.convertTo(G, CV_64F);
+  double sum = 0;
+  for ( int i = 0; i < 5; ++i )
+  {
+    double ex = E.at<double>(0,0)*pts[i].x + E.at<double>(0,1)*pts[i].y + E.at<double>(0,2);
+    double ey = E.at<double>(1,0)*pts[i].x + E.at<double>(1,1)*pts[i].y + E.at<double>(1,2);
+    double gx = G.at<double>(0,0)*pts[i].x + G.at<double>(0,1)*pts[i].y + G.at<double>(0,2);
+    double gy = G.at<double>(1,0)*pts[i].x + G.at<double>(1,1)*pts[i].y + G.at<double>(1,2);
+    sum += sqrt((ex-gx)*(ex-gx) + (ey-gy)*(ey-gy));
+  }
+  return sum / 5;
+}
+
+double elapsed_ms( int64 t0 )
+{
+  return 1000.0 * (getTickCount() - t0) / getTickFrequency();
+}
+
+Mat make_scene( Size sz, RNG &rng )
+{
+  Mat noise(sz, CV_8UC3), scene;
+  rng.fill(noise, RNG::UNIFORM, Scalar::all(0), Scalar::all(255));
+  GaussianBlur(noise, scene, Size(0, 0), 3);
+  for ( int i = 0; i < 300; ++i )
+  {
+    Point c(rng.uniform(0, sz.width), rng.uniform(0, sz.height));
+    Scalar colour(rng.uniform(0, 255), rng.uniform(0, 255), rng.uniform(0, 255));
+    if ( i % 2 )
+      circle(scene, c, rng.uniform(4, 40), colour, -1);
+    else
+      rectangle(scene, c, c + Point(rng.uniform(4, 60), rng.uniform(4, 60)), colour, -1);
+  }
+  return scene;
+}
+
+// Camera pose for frame k: where the frame's pixels sit in the scene.
+Mat camera_pose( const string &motion, int k, Size frame, Size scene, RNG &jitter )
+{
+  double t = k;
+  double cx = scene.width / 2.0, cy = scene.height / 2.0;
+  double dx = 40 * sin(t * 0.05) + 0.5 * t + jitter.gaussian(1.0);
+  double dy = 30 * sin(t * 0.037 + 1) + jitter.gaussian(1.0);
+  double angle = 0, sx = 1, sy = 1, shear = 0;
+  if ( motion != "translation" )
+    angle = 0.05 * sin(t * 0.04) + jitter.gaussian(0.002);
+  if ( motion == "affine" )
+  {
+    sx = 1 + 0.03 * sin(t * 0.03);
+    sy = 1 + 0.03 * cos(t * 0.025);
+    shear = 0.02 * sin(t * 0.02);
+  }
+
+  // frame pixel -> centred -> scale/shear -> rotate -> scene position
+  Mat centre = (Mat_<double>(3,3) << 1, 0, -frame.width/2.0, 0, 1, -frame.height/2.0, 0, 0, 1);
+  Mat S = (Mat_<double>(3,3) << sx, shear, 0, 0, sy, 0, 0, 0, 1);
+  Mat R = (Mat_<double>(3,3) << cos(angle), -sin(angle), 0, sin(angle), cos(angle), 0, 0, 0, 1);
+  Mat place = (Mat_<double>(3,3) << 1, 0, cx + dx, 0, 1, cy + dy, 0, 0, 1);
+  Mat P = place * R * S * centre;
+  return P.rowRange(0, 2).clone();
+}
+
+Clip make_clip( const Scenario &sc, Size frame_sz, int num_frames, unsigned seed )
+{
+  RNG rng(seed);
+  Size scene_sz(frame_sz.width * 2, frame_sz.height * 2);
+  Mat scene = make_scene(scene_sz, rng);
+
+  Clip clip;
+  RNG jitter(seed + 1);
+  for ( int k = 0; k < num_frames; ++k )
+  {
+    Mat pose = camera_pose(sc.motion, k, frame_sz, scene_sz, jitter);
+    Mat frame;
+    warpAffine(scene, frame, pose, frame_sz, INTER_LINEAR | WARP_INVERSE_MAP, BORDER_REFLECT);
+
+    // objects moving on their own, which the estimators must reject
+    for ( int o = 0; o < sc.outliers; ++o )
+    {
+      int w = frame_sz.width / 10, h = frame_sz.height / 10;
+      int x = (int)((o * 97 + k * (3 + o)) % max(1, frame_sz.width - w));
+      int y = (int)((o * 53 + k * (2 + o % 3)) % max(1, frame_sz.height - h));
+      Rect src_rect((o * 131) % (scene_sz.width - w), (o * 71) % (scene_sz.height - h), w, h);
+      scene(src_rect).copyTo(frame(Rect(x, y, w, h)));
+    }
+
+    if ( sc.blur > 0 )
+      GaussianBlur(frame, frame, Size(0, 0), sc.blur);
+    if ( sc.noise > 0 )
+    {
+      Mat noise(frame.size(), CV_16SC3);
+      rng.fill(noise, RNG::NORMAL, Scalar::all(0), Scalar::all(sc.noise));
+      Mat noisy;
+      frame.convertTo(noisy, CV_16SC3);
+      noisy += noise;
+      noisy.convertTo(frame, CV_8UC3);
+    }
+
+    clip.frames.push_back(frame);
+    clip.poses.push_back(pose);
+  }
+  return clip;
+}
+
+// stabilize: LK from fixed reference corners, then the Ert RANSAC.
+// Corners are picked automatically in place of the manual selection.
+void bench_stabilize( const Clip &clip, int ransac_max_iters, double ransac_good_ratio,
+                      StageResult &grey_stage, StageResult &track, vector<Mat> &transforms )
+{
+  Mat first_grey, curr_grey;
+  cvtColor(clip.frames[0], first_grey, COLOR_BGR2GRAY);
+  vector<Point2f> first_corners;
+  goodFeaturesToTrack(first_grey, first_corners, 50, 0.01, 30);
+
+  Mat last_T = Mat::eye(2, 3, CV_64F);
+  transforms.assign(1, last_T.clone());
+  for ( size_t k = 1; k < clip.frames.size(); ++k )
+  {
+    int64 t0 = getTickCount();
+    cvtColor(clip.frames[k], curr_grey, COLOR_BGR2GRAY);
+    grey_stage.ms += elapsed_ms(t0);
+    grey_stage.frames++;
+
+    t0 = getTickCount();
+    vector<Point2f> curr_corners, first2, curr2;
+    vector<uchar> status;
+    vector<float> err;
+    calcOpticalFlowPyrLK(first_grey, curr_grey, first_corners, curr_corners, status, err);
+    for ( size_t i = 0; i < status.size(); ++i )
+    {
+      if ( status[i] )
+      {
+        first2.push_back(first_corners[i]);
+        curr2.push_back(curr_corners[i]);
+      }
+    }
+    RansacStats stats;
+    Mat T = estimateRigidTransformRansac(curr2, first2, true, ransac_max_iters, ransac_good_ratio, &stats);
+    track.ms += elapsed_ms(t0);
+    track.frames++;
+    track.iterations.push_back(stats.iterations);
+
+    if ( T.empty() )
+    {
+      track.failures++;
+      T = last_T.clone();
+    }
+    else
+    {
+      track.addError(transform_error(T, relative_pose(clip, (int) k, 0), clip.frames[k].size()));
+    }
+    T.copyTo(last_T);
+    transforms.push_back(T);
+  }
+}
+
+// videostab: features on the previous frame, LK, rigid fit.
+void bench_videostab( const Clip &clip, StageResult &track )
+{
+  Mat prev_grey, cur_grey;
+  cvtColor(clip.frames[0], prev_grey, COLOR_BGR2GRAY);
+  for ( size_t k = 1; k < clip.frames.size(); ++k )
+  {
+    cvtColor(clip.frames[k], cur_grey, COLOR_BGR2GRAY);
+    int64 t0 = getTickCount();
+    vector<Point2f> prev_corner, cur_corner, prev2, cur2;
+    vector<uchar> status;
+    vector<float> err;
+    goodFeaturesToTrack(prev_grey, prev_corner, 200, 0.01, 30);
+    calcOpticalFlowPyrLK(prev_grey, cur_grey, prev_corner, cur_corner, status, err);
+    for ( size_t i = 0; i < status.size(); ++i )
+    {
+      if ( status[i] )
+      {
+        prev2.push_back(prev_corner[i]);
+        cur2.push_back(cur_corner[i]);
+      }
+    }
+    Mat T = estimateRigidTransform(prev2, cur2, false);
+    track.ms += elapsed_ms(t0);
+    track.frames++;
+
+    if ( T.empty() )
+      track.failures++;
+    else
+      track.addError(transform_error(T, relative_pose(clip, (int) k - 1, (int) k), clip.frames[k].size()));
+    cur_grey.copyTo(prev_grey);
+  }
+}
+
+// The phase correlation engine, frame to frame; estimates below the
+// default confidence count as failures (the tools fall back to features).
+void bench_phase( const Clip &clip, bool rotation, StageResult &track )
+{
+  MotionOptions opts;
+  opts.rotation = rotation;
+  PhaseCorrelator phase(opts);
+  Mat grey;
+  for ( size_t k = 0; k < clip.frames.size(); ++k )
+  {
+    cvtColor(clip.frames[k], grey, COLOR_BGR2GRAY);
+    int64 t0 = getTickCount();
+    GlobalMotion gm = phase.track(grey);
+    if ( k == 0 )
+      continue;
+    track.ms += elapsed_ms(t0);
+    track.frames++;
+
+    if ( gm.confidence < opts.min_confidence )
+      track.failures++;
+    else
+      track.addError(transform_error(gm.T, relative_pose(clip, (int) k - 1, (int) k), clip.frames[k].size()));
+  }
+}
+
+// The coarse-to-fine estimator, frame to frame: a 256 pixel coarse level
+// refined on full resolution patches.
+void bench_hierarchical( const Clip &clip, int ransac_max_iters, double ransac_good_ratio, StageResult &track )
+{
+  HierarchicalEstimator hierarchical;
+  Mat grey;
+  for ( size_t k = 0; k < clip.frames.size(); ++k )
+  {
+    cvtColor(clip.frames[k], grey, COLOR_BGR2GRAY);
+    int64 t0 = getTickCount();
+    RansacStats rs;
+    Mat T = hierarchical.track(grey, false, ransac_max_iters, ransac_good_ratio, &rs);
+    if ( k == 0 )
+      continue;
+    track.ms += elapsed_ms(t0);
+    track.frames++;
+    track.iterations.push_back(rs.iterations);
+
+    if ( T.empty() )
+      track.failures++;
+    else
+      track.addError(transform_error(T, relative_pose(clip, (int) k - 1, (int) k), clip.frames[k].size()));
+  }
+}
+
+// The Ert image path: grid points tracked on a 160x120 proxy.
+void bench_ert_image( const Clip &clip, int ransac_max_iters, double ransac_good_ratio, StageResult &track )
+{
+  for ( size_t k = 1; k < clip.frames.size(); ++k )
+  {
+    int64 t0 = getTickCount();
+    RansacStats stats;
+    Mat T = estimateRigidTransformRansac(clip.frames[k-1], clip.frames[k], false,
+                                         ransac_max_iters, ransac_good_ratio, &stats);
+    track.ms += elapsed_ms(t0);
+    track.frames++;
+    track.iterations.push_back(stats.iterations);
+
+    if ( T.empty() )
+      track.failures++;
+    else
+      track.addError(transform_error(T, relative_pose(clip, (int) k - 1, (int) k), clip.frames[k].size()));
+  }
+}
+
+// The Ert proxy image: cvtColor then an area resize, against the fused
+// greyDownscale pass.
+void bench_grey_proxy( const Clip &clip, StageResult &separate, StageResult &fused )
+{
+  Size sz = clip.frames[0].size();
+  double scale = min(max(160.0 / sz.width, 120.0 / sz.height), 1.0);
+  Size proxy_sz = scaledSize(sz, scale);
+  Mat grey, proxy;
+  for ( size_t k = 0; k < clip.frames.size(); ++k )
+  {
+    int64 t0 = getTickCount();
+    cvtColor(clip.frames[k], grey, COLOR_BGR2GRAY);
+    resize(grey, proxy, proxy_sz, 0, 0, INTER_AREA);
+    separate.ms += elapsed_ms(t0);
+    separate.frames++;
+
+    t0 = getTickCount();
+    greyDownscale(clip.frames[k], proxy, proxy_sz);
+    fused.ms += elapsed_ms(t0);
+    fused.frames++;
+  }
+}
+
+// stabilize's output stage: warpAffine, border crop and resize back.
+void bench_render( const Clip &clip, const vector<Mat> &transforms, int hcrop,
+                   WarpEngine &engine, StageResult &legacy, StageResult &striped )
+{
+  Size sz = clip.frames[0].size();
+  int vert_border = hcrop * sz.height / sz.width;
+  Mat C = cropAffine(sz, hcrop, vert_border);
+  Mat out;
+  for ( size_t k = 0; k < clip.frames.size(); ++k )
+  {
+    int64 t0 = getTickCount();
+    Mat warped;
+    warpAffine(clip.frames[k], warped, transforms[k], sz);
+    warped = warped(Range(vert_border, sz.height - vert_border), Range(hcrop, sz.width - hcrop));
+    resize(warped, out, sz);
+    legacy.ms += elapsed_ms(t0);
+    legacy.frames++;
+
+    t0 = getTickCount();
+    Mat T_inv;
+    invertAffineTransform(transforms[k], T_inv);
+    engine.warpAffine(clip.frames[k], out, composeAffine(T_inv, C), sz, INTER_LINEAR | WARP_INVERSE_MAP);
+    striped.ms += elapsed_ms(t0);
+    striped.frames++;
+  }
+}
+
+// The near-identity warp kernel against cv::warpAffine, both on one thread,
+// on the stabilizing warps (with the border crop folded in) of the clip
+// scaled up to kernel_sz, 4K by default. Each kernel frame is compared with
+// the warpAffine one.
+void bench_kernel( const Clip &clip, const vector<Mat> &transforms, int hcrop, Size kernel_sz,
+                   StageResult &legacy, StageResult &kernel )
+{
+  Size sz = clip.frames[0].size();
+  Mat S = Mat::eye(3, 3, CV_64F);
+  S.at<double>(0,0) = (double) kernel_sz.width / sz.width;
+  S.at<double>(1,1) = (double) kernel_sz.height / sz.height;
+  int scaled_hcrop = hcrop * kernel_sz.width / sz.width;
+  Mat C = cropAffine(kernel_sz, scaled_hcrop, scaled_hcrop * kernel_sz.height / kernel_sz.width);
+  Mat frame, expected, out(kernel_sz, clip.frames[0].type()), diff;
+  for ( size_t k = 0; k < clip.frames.size(); ++k )
+  {
+    resize(clip.frames[k], frame, kernel_sz);
+    Mat T = S * to3x3(transforms[k]) * S.inv(), T_inv;
+    invertAffineTransform(T.rowRange(0, 2), T_inv);
+    Mat A = composeAffine(T_inv, C);
+    if ( !nearIdentityWarpable(frame, A) )
+    {
+      kernel.failures++;
+      continue;
+    }
+
+    int64 t0 = getTickCount();
+    warpAffine(frame, expected, A, kernel_sz, INTER_LINEAR | WARP_INVERSE_MAP);
+    legacy.ms += elapsed_ms(t0);
+    legacy.frames++;
+
+    t0 = getTickCount();
+    warpNearIdentity(frame, out, A);
+    kernel.ms += elapsed_ms(t0);
+    kernel.frames++;
+
+    double worst;
+    absdiff(out, expected, diff);
+    minMaxLoc(diff.reshape(1), 0, &worst);
+    kernel.diffs.push_back(worst);
+  }
+}
+
+void write_stage( ostream &out, const string &name, const StageResult &r, bool last )
+{
+  out << "        \"" << name << "\": {";
+  out << "\"frames\": " << r.frames;
+  out << ", \"fps\": " << (r.ms > 0 ? 1000.0 * r.frames / r.ms : 0);
+  out << ", \"ms_per_frame\": " << (r.frames ? r.ms / r.frames : 0);
+  if ( !r.errors.empty() || r.failures )
+  {
+    double sum = 0, worst = 0;
+    for ( size_t i = 0; i < r.errors.size(); ++i )
+    {
+      sum += r.errors[i];
+      worst = max(worst, r.errors[i]);
+    }
+    out << ", \"failures\": " << r.failures;
+    out << ", \"error_mean_px\": " << (r.errors.empty() ? 0 : sum / r.errors.size());
+    out << ", \"error_max_px\": " << worst;
+  }
+  if ( !r.iterations.empty() )
+  {
+    double sum = 0;
+    int worst = 0;
+    for ( size_t i = 0; i < r.iterations.size(); ++i )
+    {
+      sum += r.iterations[i];
+      worst = max(worst, r.iterations[i]);
+    }
+    out << ", \"ransac_iterations_mean\": " << sum / r.iterations.size();
+    out << ", \"ransac_iterations_max\": " << worst;
+  }
+  if ( !r.diffs.empty() )
+    out << ", \"max_diff_to_warpAffine\": " << *max_element(r.diffs.begin(), r.diffs.end());
+  out << "}" << (last ? "" : ",") << endl;
+}
+
+int main( int argc, char **argv ) {
+  int width, height, num_frames, seed, hcrop, warp_threads, ransac_max_iters, kernel_width, kernel_height;
+  float ransac_good_ratio;
+  string output_fn, label, only;
+  try
+  {
+    po::options_description desc("Options");
+    desc.add_options()
+      ("help,h", "Print help messages")
+      ("width,W", po::value<int>(&width)->default_value(1280), "frame width")
+      ("height,H", po::value<int>(&height)->default_value(720), "frame height")
+      ("frames,n", po::value<int>(&num_frames)->default_value(120), "frames per clip")
+      ("seed", po::value<int>(&seed)->default_value(1), "random seed of the synthetic scenes")
+      ("hcrop,c", po::value<int>(&hcrop)->default_value(30), "border crop of the render stage")
+      ("warp-threads", po::value<int>(&warp_threads)->default_value(0), "threads of the striped warp engine (0 = one per core)")
+      ("kernel-width", po::value<int>(&kernel_width)->default_value(3840), "frame width of the warp kernel stage")
+      ("kernel-height", po::value<int>(&kernel_height)->default_value(2160), "frame height of the warp kernel stage")
+      ("ransac_max_iters,i", po::value<int>(&ransac_max_iters)->default_value(500), "Maximum number of iterations for RANSAC.")
+      ("ransac_good_ratio,g", po::value<float>(&ransac_good_ratio)->default_value(0.9), "Inlier Ratio used for RANSAC.")
+      ("scenario,s", po::value<string>(&only)->default_value(""), "only run the scenario with this name")
+      ("label,l", po::value<string>(&label)->default_value(""), "label stored in the report, e.g. the commit")
+      ("output,o", po::value<string>(&output_fn)->default_value("-"), "JSON report file, - for stdout");
+
+    po::variables_map vm;
+
+    // Parse command line arguments
+    try
+    {
+      po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+
+      if ( vm.count( "help" ) )
+      {
+        cout << "Benchmarks the estimation and rendering stages on synthetic footage with known motion. " << endl << endl;
+        cout << "Usage: " << argv[0] << " [options]" << endl  << endl << desc << endl;
+
+        return 0;
+      }
+
+      po::notify(vm);
+    }
+    catch ( po::error& e )
+    {
+      cerr << "ERROR: " << e.what() << endl << endl;
+      cerr << desc << endl;
+      return 1;
+    }
+  }
+  catch ( exception& e )
+  {
+    cerr << "Unhandled Exception reached the top of main: " << e.what() << ", application will now exit." << endl;
+    return 2;
+  }
+
+  vector<Scenario> scenarios;
+  Scenario translation = { "translation", "translation", 0, 0, 0 };
+  Scenario rotation = { "rotation", "rotation", 0, 0, 0 };
+  Scenario affine = { "affine", "affine", 0, 0, 0 };
+  Scenario noisy = { "noisy", "rotation", 8, 0, 0 };
+  Scenario blurred = { "blurred", "rotation", 2, 2.5, 0 };
+  Scenario outliers = { "outliers", "rotation", 2, 0, 6 };
+  scenarios.push_back(translation);
+  scenarios.push_back(rotation);
+  scenarios.push_back(affine);
+  scenarios.push_back(noisy);
+  scenarios.push_back(blurred);
+  scenarios.push_back(outliers);
+
+  Size frame_sz(width, height);
+  WarpEngine engine(warp_threads);
+
+  ofstream out_file;
+  if ( output_fn != "-" )
+  {
+    out_file.open(output_fn.c_str());
+    if ( !out_file.is_open() )
+    {
+      cerr << "Could not open " << output_fn << " for writing." << endl;
+      return 1;
+    }
+  }
+  ostream &out = output_fn == "-" ? cout : out_file;
+
+  out << "{" << endl;
+  out << "  \"label\": \"" << label << "\"," << endl;
+  out << "  \"width\": " << width << ", \"height\": " << height << ", \"frames\": " << num_frames
+      << ", \"seed\": " << seed << ", \"warp_threads\": " << engine.threads()
+      << ", \"warp_kernel\": \"" << nearIdentityKernel() << "\"," << endl;
+  out << "  \"scenarios\": [" << endl;
+
+  bool first_scenario = true;
+  for ( size_t s = 0; s < scenarios.size(); ++s )
+  {
+    const Scenario &sc = scenarios[s];
+    if ( !only.empty() && only != sc.name )
+      continue;
+
+    cerr << "Scenario " << sc.name << "..." << endl;
+    Clip clip = make_clip(sc, frame_sz, num_frames, seed + (unsigned) s * 1000);
+
+    StageResult grey, stabilize_track, videostab_track, ert_image, render_legacy, render_engine;
+    StageResult proxy_separate, proxy_fused, phase_shift, phase_rotation, hierarchical, kernel_legacy, kernel;
+    vector<Mat> transforms;
+    bench_stabilize(clip, ransac_max_iters, ransac_good_ratio, grey, stabilize_track, transforms);
+    bench_videostab(clip, videostab_track);
+    bench_phase(clip, false, phase_shift);
+    bench_phase(clip, true, phase_rotation);
+    bench_hierarchical(clip, ransac_max_iters, ransac_good_ratio, hierarchical);
+    bench_ert_image(clip, ransac_max_iters, ransac_good_ratio, ert_image);
+    bench_grey_proxy(clip, proxy_separate, proxy_fused);
+    bench_render(clip, transforms, hcrop, engine, render_legacy, render_engine);
+    bench_kernel(clip, transforms, hcrop, Size(kernel_width, kernel_height), kernel_legacy, kernel);
+
+    if ( !first_scenario )
+      out << "," << endl;
+    first_scenario = false;
+    out << "    {" << endl;
+    out << "      \"name\": \"" << sc.name << "\", \"motion\": \"" << sc.motion << "\", \"noise\": " << sc.noise
+        << ", \"blur\": " << sc.blur << ", \"outliers\": " << sc.outliers << "," << endl;
+    out << "      \"stages\": {" << endl;
+    write_stage(out, "grey", grey, false);
+    write_stage(out, "stabilize_estimate", stabilize_track, false);
+    write_stage(out, "videostab_estimate", videostab_track, false);
+    write_stage(out, "phase_estimate", phase_shift, false);
+    write_stage(out, "phase_rotation_estimate", phase_rotation, false);
+    write_stage(out, "hierarchical_estimate", hierarchical, false);
+    write_stage(out, "ert_image", ert_image, false);
+    write_stage(out, "grey_proxy_cvtColor_resize", proxy_separate, false);
+    write_stage(out, "grey_proxy_fused", proxy_fused, false);
+    write_stage(out, "render_warpAffine", render_legacy, false);
+    write_stage(out, "render_warp_engine", render_engine, false);
+    write_stage(out, "warp_kernel_warpAffine", kernel_legacy, false);
+    write_stage(out, "warp_kernel_near_identity", kernel, true);
+    out << "      }" << endl;
+    out << "    }";
+  }
+  out << endl << "  ]" << endl << "}" << endl;
+
+  return 0;
+}
@@ -0,0 +1,423 @@
+#include "camera_path.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace po = boost::program_options;
+
+namespace
+{
+
+// frames before a window that its differences reach back to
+const int ORDERS = 3;
+
+// ADMM penalties: each difference order's is its weight times DIFF_RHO, so
+// all of them are soft thresholded by 1 / DIFF_RHO; the crop constraint's is
+// CROP_RHO. Poses are in pixels, so these are in pixels too.
+const double DIFF_RHO = 1.0;
+const double CROP_RHO = 0.3;
+// over-relaxation of the ADMM steps, which speeds up convergence
+const double RELAX = 1.6;
+// stop when the path and its projection onto the crop constraint agree,
+// and stopped moving, to within this many pixels
+const double TOLERANCE = 0.01;
+const int CHECK_EVERY = 10;
+const int DYKSTRA_STEPS = 8;
+
+// coefficients of the forward differences of order 1 to 3
+const double DIFF[ORDERS + 1][ORDERS + 1] = {
+  { 1, 0, 0, 0 },
+  { -1, 1, 0, 0 },
+  { 1, -2, 1, 0 },
+  { -1, 3, -3, 1 },
+};
+
+double soft( double v, double t )
+{
+  return v > t ? v - t : v < -t ? v + t : 0;
+}
+
+// Projects (a, b) onto |a| + alpha |b| <= room.
+void project_rhombus( double &a, double &b, double alpha, double room )
+{
+  if ( room <= 0 )
+  {
+    a = b = 0;
+    return;
+  }
+  double sa = a < 0 ? -1 : 1, sb = b < 0 ? -1 : 1;
+  double pa = std::fabs(a), pb = std::fabs(b);
+  if ( pa + alpha * pb <= room )
+    return;
+  double t = (pa + alpha * pb - room) / (1 + alpha * alpha);
+  pa -= t;
+  pb -= alpha * t;
+  if ( pa < 0 )
+  {
+    pa = 0;
+    pb = room / alpha;
+  }
+  else if ( pb < 0 )
+  {
+    pa = room;
+    pb = 0;
+  }
+  a = sa * pa;
+  b = sb * pb;
+}
+
+}
+
+// Banded Cholesky factor of the ADMM system of a window of n frames,
+// rho_u I + sum_k rho_k D_k' D_k, which has ORDERS diagonals below the main.
+struct L1PathSmoother::Banded
+{
+  Banded() : n(0) {}
+
+  void factor( int frames, const double *rho, double rho_u )
+  {
+    n = frames;
+    L.assign(n * (ORDERS + 1), 0.0);
+    // L(i, i - d) is stored at L[i * (ORDERS + 1) + d]; first the matrix
+    for ( int i = 0; i < n; ++i )
+      at(i, 0) = rho_u;
+    for ( int k = 1; k <= ORDERS; ++k )
+    {
+      for ( int r = 0; r + k < n; ++r )
+      {
+        for ( int p = 0; p <= k; ++p )
+        {
+          for ( int q = 0; q <= p; ++q )
+            at(r + p, p - q) += rho[k] * DIFF[k][p] * DIFF[k][q];
+        }
+      }
+    }
+    for ( int j = 0; j < n; ++j )
+    {
+      for ( int i = j; i <= std::min(j + ORDERS, n - 1); ++i )
+      {
+        double sum = at(i, i - j);
+        for ( int k = std::max(i - ORDERS, 0); k < j; ++k )
+          sum -= at(i, i - k) * at(j, j - k);
+        at(i, i - j) = i == j ? std::sqrt(sum) : sum / at(j, 0);
+      }
+    }
+  }
+
+  int size() const { return n; }
+
+  // Solves in place, with a stride between the values.
+  void solve( double *x, int stride ) const
+  {
+    for ( int i = 0; i < n; ++i )
+    {
+      double sum = x[i * stride];
+      for ( int k = std::max(i - ORDERS, 0); k < i; ++k )
+        sum -= at(i, i - k) * x[k * stride];
+      x[i * stride] = sum / at(i, 0);
+    }
+    for ( int i = n - 1; i >= 0; --i )
+    {
+      double sum = x[i * stride];
+      for ( int k = i + 1; k <= std::min(i + ORDERS, n - 1); ++k )
+        sum -= at(k, k - i) * x[k * stride];
+      x[i * stride] = sum / at(i, 0);
+    }
+  }
+
+  double &at( int i, int d ) { return L[i * (ORDERS + 1) + d]; }
+  double at( int i, int d ) const { return L[i * (ORDERS + 1) + d]; }
+
+  int n;
+  std::vector<double> L;
+};
+
+po::options_description pathOptions( PathOptions &opts )
+{
+  po::options_description desc("Path smoothing");
+  desc.add_options()
+    ("smoother", po::value<std::string>(&opts.smoother)->default_value("box")->notifier([]( const std::string &s ) {
+        if ( s != "box" && s != "l1" )
+          throw po::error( "--smoother must be box or l1, not " + s );
+      }), "camera path smoothing: box (moving average) or l1 (L1-optimal path that keeps the frame border out of the crop)")
+    ("crop", po::value<int>(&opts.crop)->default_value(20), "border cropped off the stabilized frames, in pixels horizontally; vertically it keeps the aspect ratio")
+    ("l1-window", po::value<int>(&opts.window)->default_value(300), "frames solved at once by --smoother l1")
+    ("l1-overlap", po::value<int>(&opts.overlap)->default_value(60), "frames of a window that the next one solves again")
+    ("l1-iterations", po::value<int>(&opts.iterations)->default_value(500), "most ADMM iterations per window")
+    ("l1-weights", po::value<std::vector<double> >()->multitoken()->notifier([&opts]( const std::vector<double> &w ) {
+        if ( w.size() != 3 )
+          throw po::error( "--l1-weights takes the velocity, acceleration and jerk weights" );
+        opts.velocity = w[0];
+        opts.acceleration = w[1];
+        opts.jerk = w[2];
+      }), "weights of the velocity, acceleration and jerk of the path (default 10 1 100)");
+  return desc;
+}
+
+int verticalCrop( cv::Size frame, int hcrop )
+{
+  return hcrop * frame.height / frame.width;
+}
+
+L1PathSmoother::L1PathSmoother( cv::Size frame, const PathOptions &_opts )
+  : opts(_opts), size(frame), warm_z(ORDERS + 1), warm_y(ORDERS + 1), system(new Banded),
+    solved(0), total_iterations(0)
+{
+  opts.window = std::max(opts.window, 2 * ORDERS + 2);
+  opts.overlap = std::min(std::max(opts.overlap, 0), opts.window / 2);
+  hcrop = opts.crop;
+  vcrop = verticalCrop(frame, hcrop);
+  cx = frame.width / 2.0;
+  cy = frame.height / 2.0;
+  radius = std::sqrt(cx * cx + cy * cy);
+  // the linearized crop constraint: a translation of the frame centre by
+  // (ex, ey) and a rotation by ea / radius move the cropped corners by up
+  // to |ex| + ax |ea| horizontally and |ey| + ay |ea| vertically
+  ax = (cy - vcrop) / radius;
+  ay = (cx - hcrop) / radius;
+  hroom = hcrop - 1;
+  vroom = vcrop - 1;
+}
+
+cv::Vec3d L1PathSmoother::toSolver( const cv::Vec3d &pose ) const
+{
+  return cv::Vec3d(pose[0] - pose[2] * cy, pose[1] + pose[2] * cx, pose[2] * radius);
+}
+
+cv::Vec3d L1PathSmoother::fromSolver( const cv::Vec3d &v ) const
+{
+  double a = v[2] / radius;
+  return cv::Vec3d(v[0] + a * cy, v[1] - a * cx, a);
+}
+
+void L1PathSmoother::project( double *e ) const
+{
+  if ( std::fabs(e[0]) + ax * std::fabs(e[2]) <= hroom && std::fabs(e[1]) + ay * std::fabs(e[2]) <= vroom )
+    return;
+  // Dykstra's alternating projections onto the two rhombi, which share ea
+  double p[3] = { 0, 0, 0 }, q[3] = { 0, 0, 0 };
+  for ( int it = 0; it < DYKSTRA_STEPS; ++it )
+  {
+    double y[3] = { e[0] + p[0], e[1] + p[1], e[2] + p[2] };
+    project_rhombus(y[0], y[2], ax, hroom);
+    for ( int c = 0; c < 3; ++c )
+      p[c] = e[c] + p[c] - y[c];
+    double x[3] = { y[0] + q[0], y[1] + q[1], y[2] + q[2] };
+    project_rhombus(x[1], x[2], ay, vroom);
+    for ( int c = 0; c < 3; ++c )
+    {
+      q[c] = y[c] + q[c] - x[c];
+      e[c] = x[c];
+    }
+  }
+}
+
+bool L1PathSmoother::cropInside( const cv::Vec3d &e ) const
+{
+  double da = e[2] / radius;
+  double dx = e[0] + da * cy, dy = e[1] - da * cx;
+  double c = std::cos(da), s = std::sin(da);
+  for ( int k = 0; k < 4; ++k )
+  {
+    double qx = (k & 1) ? size.width - hcrop : hcrop;
+    double qy = (k & 2) ? size.height - vcrop : vcrop;
+    double px = c * (qx - dx) + s * (qy - dy);
+    double py = -s * (qx - dx) + c * (qy - dy);
+    // a hair inside, so that rounding never puts a corner on the border
+    if ( px < 0.01 || px > size.width - 1.01 || py < 0.01 || py > size.height - 1.01 )
+      return false;
+  }
+  return true;
+}
+
+void L1PathSmoother::push( const cv::Vec3d &pose )
+{
+  path.push_back(toSolver(pose));
+  if ( (int)(path.size() - pins.size()) >= opts.window )
+    solveWindow(opts.window - opts.overlap, false);
+}
+
+void L1PathSmoother::finish()
+{
+  if ( path.size() > pins.size() )
+    solveWindow((int)(path.size() - pins.size()), true);
+}
+
+bool L1PathSmoother::pop( cv::Vec3d &smoothed )
+{
+  if ( ready.empty() )
+    return false;
+  smoothed = ready.front();
+  ready.pop_front();
+  return true;
+}
+
+void L1PathSmoother::solveWindow( int emit, bool last )
+{
+  TRACE_SCOPE("l1_path_window");
+  const int n = (int) path.size(), P = (int) pins.size();
+  const double weight[ORDERS + 1] = { 0, opts.velocity, opts.acceleration, opts.jerk };
+  double rho[ORDERS + 1];
+  for ( int k = 0; k <= ORDERS; ++k )
+    rho[k] = weight[k] * DIFF_RHO;
+  if ( system->size() != n )
+    system->factor(n, rho, CROP_RHO);
+
+  // the state, warm started from the overlap of the last window
+  std::vector<cv::Vec3d> s(n), u(n), yu(n, cv::Vec3d(0, 0, 0)), rhs(n);
+  std::vector<cv::Vec3d> z[ORDERS + 1], y[ORDERS + 1];
+  int warm = std::min((int) warm_s.size(), n);
+  for ( int i = 0; i < n; ++i )
+  {
+    if ( i < P )
+    {
+      s[i] = u[i] = pins[i];
+    }
+    else if ( i < warm )
+    {
+      s[i] = warm_s[i];
+      u[i] = warm_u[i];
+      yu[i] = warm_yu[i];
+    }
+    else
+    {
+      // new frames keep the correction of the frame before them
+      cv::Vec3d e = i > 0 ? u[i-1] - path[i-1] : cv::Vec3d(0, 0, 0);
+      project(e.val);
+      s[i] = u[i] = path[i] + e;
+    }
+  }
+  for ( int k = 1; k <= ORDERS; ++k )
+  {
+    int rows = std::max(n - k, 0);
+    z[k].assign(rows, cv::Vec3d(0, 0, 0));
+    y[k].assign(rows, cv::Vec3d(0, 0, 0));
+    for ( int r = 0; r < rows; ++r )
+    {
+      if ( r < (int) warm_z[k].size() && r + k < warm )
+      {
+        z[k][r] = warm_z[k][r];
+        y[k][r] = warm_y[k][r];
+      }
+      else
+      {
+        for ( int p = 0; p <= k; ++p )
+          z[k][r] += DIFF[k][p] * s[r + p];
+      }
+    }
+  }
+
+  std::vector<cv::Vec3d> u_check(u);
+  int it = 0;
+  while ( it < opts.iterations )
+  {
+    // s: the banded least squares between the differences and the crop
+    for ( int i = 0; i < n; ++i )
+      rhs[i] = CROP_RHO * (u[i] - yu[i]);
+    for ( int k = 1; k <= ORDERS; ++k )
+    {
+      for ( int r = 0; r + k < n; ++r )
+      {
+        cv::Vec3d d = rho[k] * (z[k][r] - y[k][r]);
+        for ( int p = 0; p <= k; ++p )
+          rhs[r + p] += DIFF[k][p] * d;
+      }
+    }
+    for ( int c = 0; c < 3; ++c )
+      system->solve(&rhs[0][c], 3);
+    s.swap(rhs);
+
+    // z: soft thresholded differences, and their duals
+    for ( int k = 1; k <= ORDERS; ++k )
+    {
+      for ( int r = 0; r + k < n; ++r )
+      {
+        cv::Vec3d d(0, 0, 0);
+        for ( int p = 0; p <= k; ++p )
+          d += DIFF[k][p] * s[r + p];
+        d = RELAX * d + (1 - RELAX) * z[k][r];
+        for ( int c = 0; c < 3; ++c )
+          z[k][r][c] = soft(d[c] + y[k][r][c], 1 / DIFF_RHO);
+        y[k][r] += d - z[k][r];
+      }
+    }
+
+    // u: the crop constraint, pinned frames stay where they were emitted
+    for ( int i = 0; i < n; ++i )
+    {
+      cv::Vec3d v = RELAX * s[i] + (1 - RELAX) * u[i];
+      if ( i >= P )
+      {
+        cv::Vec3d e = v + yu[i] - path[i];
+        project(e.val);
+        u[i] = path[i] + e;
+      }
+      yu[i] += v - u[i];
+    }
+
+    ++it;
+    if ( it % CHECK_EVERY == 0 )
+    {
+      double gap = 0, moved = 0;
+      for ( int i = 0; i < n; ++i )
+      {
+        for ( int c = 0; c < 3; ++c )
+        {
+          gap = std::max(gap, std::fabs(s[i][c] - u[i][c]));
+          moved = std::max(moved, std::fabs(u[i][c] - u_check[i][c]));
+        }
+      }
+      if ( gap < TOLERANCE && moved < TOLERANCE * CHECK_EVERY )
+        break;
+      u_check = u;
+    }
+  }
+  solved++;
+  total_iterations += it;
+
+  // Emits u, which meets the linearized crop constraint; where the exact
+  // rotation still shows the border, the correction is scaled down.
+  std::deque<cv::Vec3d> emitted(pins);
+  for ( int i = P; i < P + emit; ++i )
+  {
+    cv::Vec3d e = u[i] - path[i];
+    if ( !cropInside(e) )
+    {
+      double lo = 0, hi = 1;
+      for ( int b = 0; b < 20; ++b )
+      {
+        double mid = (lo + hi) / 2;
+        if ( cropInside(mid * e) )
+          lo = mid;
+        else
+          hi = mid;
+      }
+      e *= lo;
+    }
+    u[i] = path[i] + e;
+    emitted.push_back(u[i]);
+    ready.push_back(fromSolver(u[i]));
+  }
+  if ( last )
+  {
+    path.clear();
+    pins.clear();
+    warm_s.clear();
+    return;
+  }
+
+  // the next window starts ORDERS frames before the first frame not emitted
+  int next_pins = std::min((int) emitted.size(), ORDERS);
+  int shift = P + emit - next_pins;
+  pins.assign(emitted.end() - next_pins, emitted.end());
+  path.erase(path.begin(), path.begin() + shift);
+  warm_s.assign(s.begin() + shift, s.end());
+  warm_u.assign(u.begin() + shift, u.end());
+  warm_yu.assign(yu.begin() + shift, yu.end());
+  for ( int k = 1; k <= ORDERS; ++k )
+  {
+    warm_z[k].assign(z[k].begin() + std::min(shift, (int) z[k].size()), z[k].end());
+    warm_y[k].assign(y[k].begin() + std::min(shift, (int) y[k].size()), y[k].end());
+  }
+}
@@ -0,0 +1,110 @@
+//
+//  camera_path.h
+//  Footage_Manipulation
+//
+//  Camera path smoothing under a crop constraint. The smoothed path is the
+//  L1-optimal one of Grundmann et al. ("Auto-directed video stabilization
+//  with robust L1 optimal camera paths"): it minimizes a weighted sum of
+//  the absolute velocity, acceleration and jerk of the path, which makes it
+//  piecewise constant, linear or parabolic like a tripod, a dolly or an
+//  ease-in, while every frame stays close enough to the original path that
+//  the cropped output never shows the frame border.
+//
+//  The path is solved in overlapping windows by ADMM (soft thresholding of
+//  the differences, a banded solve and a projection onto the crop
+//  constraint per iteration). A window is warm started from the solution of
+//  the overlap, and the frames before it are pinned to the ones already
+//  emitted. Time is linear in the number of frames and memory is bounded by
+//  the window, so flights of hundreds of thousands of frames are fine.
+
+#ifndef __camera_path_h
+#define __camera_path_h
+
+#include <opencv2/opencv.hpp>
+
+#include <boost/program_options.hpp>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct PathOptions
+{
+  PathOptions() : smoother("box"), crop(20), window(300), overlap(60), iterations(500),
+                  velocity(10), acceleration(1), jerk(100) {}
+
+  std::string smoother;  // "box" (moving average, the crop is not enforced) or "l1"
+  int crop;              // horizontal border crop in pixels; the vertical one keeps the aspect ratio
+  int window;            // frames solved at once by "l1"
+  int overlap;           // frames of a window solved again, warm started, by the next one
+  int iterations;        // most ADMM iterations per window
+  double velocity;       // weights of the absolute first, second and third differences
+  double acceleration;
+  double jerk;
+};
+
+// "Path smoothing" options group for the tools' command lines.
+boost::program_options::options_description pathOptions( PathOptions &opts );
+
+// Vertical border crop that keeps the aspect ratio of frame with hcrop.
+int verticalCrop( cv::Size frame, int hcrop );
+
+// Feeds on the poses (x, y, angle in radians) of the frames, i.e. the
+// accumulated frame to frame motion, and hands out their smoothed poses in
+// the same order once their window has been solved. Rendering frame i
+// displaced by smoothed - original, rotating about the frame origin as
+// videostab does, fills the frame cropped by the crop of the options.
+class L1PathSmoother
+{
+public:
+  L1PathSmoother( cv::Size frame, const PathOptions &opts );
+
+  void push( const cv::Vec3d &pose );
+
+  // The smoothed pose of the oldest frame not yet popped, when it is solved.
+  bool pop( cv::Vec3d &smoothed );
+
+  // Solves the frames pushed since the last window; call before the last pops.
+  void finish();
+
+  int windows() const { return solved; }
+  long iterations() const { return total_iterations; }
+
+private:
+  struct Banded;
+
+  // The solver's poses are of the frame centre, with the angle in pixels
+  // at the corners, so the three are smoothed on a comparable scale.
+  cv::Vec3d toSolver( const cv::Vec3d &pose ) const;
+  cv::Vec3d fromSolver( const cv::Vec3d &v ) const;
+  // Projects a correction onto the linearized crop constraint.
+  void project( double *e ) const;
+  // Whether the cropped frame stays inside the frame moved by correction e.
+  bool cropInside( const cv::Vec3d &e ) const;
+  // Solves the window in path and emits its first emit unpinned frames.
+  void solveWindow( int emit, bool last );
+
+  PathOptions opts;
+  cv::Size size;
+  int hcrop, vcrop;
+  double cx, cy;          // frame centre
+  double radius;          // pixels per radian of the solver's angle
+  double hroom, vroom;    // crop in pixels, less a pixel for interpolation
+  double ax, ay;          // share of a solver angle unit the cropped corners move by
+
+  // the frames of the next window, original poses in solver coordinates:
+  // the last (up to 3) emitted ones, pinned to their smoothed poses in
+  // pins, then the pending ones
+  std::deque<cv::Vec3d> path, pins;
+  // ADMM state of the overlap, kept as warm start; one row per frame, and
+  // per difference order one row per difference
+  std::vector<cv::Vec3d> warm_s, warm_u, warm_yu;
+  std::vector<std::vector<cv::Vec3d> > warm_z, warm_y;
+  std::shared_ptr<Banded> system;
+  std::deque<cv::Vec3d> ready;
+  int solved;
+  long total_iterations;
+};
+
+#endif
@@ -1,4 +1,9 @@
 #include "ert.h"
+#include "grey.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
 
 static void
 icvGetRTMatrix( const CvPoint2D32f* a, const CvPoint2D32f* b,
@@ -99,7 +104,7 @@ icvGetRTMatrix( const CvPoint2D32f* a, const CvPoint2D32f* b,
 }
 
 int
-cvEstimateRigidTransformRansac( const CvArr* matA, const CvArr* matB, CvMat* matM, int full_affine, int ransac_max_iters=500, double ransac_good_ratio=0.5)
+cvEstimateRigidTransformRansac( const CvArr* matA, const CvArr* matB, CvMat* matM, int full_affine, int ransac_max_iters=500, double ransac_good_ratio=0.5, RansacStats* stats=0)
 {
     const int COUNT = 15;
     const int WIDTH = 160, HEIGHT = 120;
@@ -109,11 +114,11 @@ cvEstimateRigidTransformRansac( const CvArr* matA, const CvArr* matB, CvMat* mat
     //const double RANSAC_GOOD_RATIO = 0.5;
     double RANSAC_GOOD_RATIO = ransac_good_ratio;
 
-    cv::Ptr<CvMat> sA, sB;
+    cv::Mat sA, sB;
+    CvMat stubSA, stubSB;
     cv::AutoBuffer<CvPoint2D32f> pA, pB;
     cv::AutoBuffer<int> good_idx;
     cv::AutoBuffer<char> status;
-    cv::Ptr<CvMat> gray;
 
     CvMat stubA, *A = cvGetMat( matA, &stubA );
     CvMat stubB, *B = cvGetMat( matB, &stubB );
@@ -152,26 +157,15 @@ cvEstimateRigidTransformRansac( const CvArr* matA, const CvArr* matB, CvMat* mat
 
         if( !equal_sizes || cn != 1 )
         {
-            sA = cvCreateMat( sz1.height, sz1.width, CV_8UC1 );
-            sB = cvCreateMat( sz1.height, sz1.width, CV_8UC1 );
-
-            if( cn != 1 )
-            {
-                gray = cvCreateMat( sz0.height, sz0.width, CV_8UC1 );
-                cvCvtColor( A, gray, CV_BGR2GRAY );
-                cvResize( gray, sA, CV_INTER_AREA );
-                cvCvtColor( B, gray, CV_BGR2GRAY );
-                cvResize( gray, sB, CV_INTER_AREA );
-                gray.release();
-            }
-            else
-            {
-                cvResize( A, sA, CV_INTER_AREA );
-                cvResize( B, sB, CV_INTER_AREA );
-            }
-
-            A = sA;
-            B = sB;
+            TRACE_SCOPE("ert_downscale");
+            // grey conversion and area downscaling in one pass over each image
+            greyDownscale( cv::cvarrToMat(A), sA, sz1 );
+            greyDownscale( cv::cvarrToMat(B), sB, sz1 );
+
+            stubSA = sA;
+            stubSB = sB;
+            A = &stubSA;
+            B = &stubSB;
         }
 
         count_y = COUNT;
@@ -190,6 +184,7 @@ cvEstimateRigidTransformRansac( const CvArr* matA, const CvArr* matB, CvMat* mat
             }
 
         // find the corresponding points in B
+        TRACE_SCOPE("ert_flow");
         cvCalcOpticalFlowPyrLK( A, B, 0, 0, pA, pB, count, cvSize(10,10), 3,
                                 status, 0, cvTermCriteria(CV_TERMCRIT_ITER,40,0.1), 0 );
 
@@ -223,13 +218,23 @@ cvEstimateRigidTransformRansac( const CvArr* matA, const CvArr* matB, CvMat* mat
 
     good_idx.allocate(count);
 
+    if( stats )
+        stats->points = count;
+
     if( count < RANSAC_SIZE0 )
+    {
+        if( stats )
+            stats->result = RANSAC_TOO_FEW_POINTS;
         return 0;
+    }
 
     CvMat _pB = cvMat(1, count, CV_32FC2, pB);
     brect = cvBoundingRect(&_pB, 1);
+    const double threshold = MAX(brect.width,brect.height)*0.05;
+    int best_count = 0;
 
     // RANSAC stuff:
+    TRACE_SCOPE("ert_ransac");
     // 1. find the consensus
     for( k = 0; k < RANSAC_MAX_ITERS; k++ )
     {
@@ -300,28 +305,60 @@ cvEstimateRigidTransformRansac( const CvArr* matA, const CvArr* matB, CvMat* mat
         for( i = 0, good_count = 0; i < count; i++ )
         {
             if( fabs( m[0]*pA[i].x + m[1]*pA[i].y + m[2] - pB[i].x ) +
-                fabs( m[3]*pA[i].x + m[4]*pA[i].y + m[5] - pB[i].y ) < MAX(brect.width,brect.height)*0.05 )
+                fabs( m[3]*pA[i].x + m[4]*pA[i].y + m[5] - pB[i].y ) < threshold )
                 good_idx[good_count++] = i;
         }
+        best_count = MAX( best_count, good_count );
 
         if( good_count >= count*RANSAC_GOOD_RATIO )
             break;
     }
 
+    if( stats )
+    {
+        stats->iterations = MIN( k+1, RANSAC_MAX_ITERS );
+        stats->best_inliers = best_count;
+        stats->threshold = threshold / scale;
+    }
+
     if( k >= RANSAC_MAX_ITERS )
+    {
+        if( stats )
+            stats->result = RANSAC_NO_CONSENSUS;
         return 0;
+    }
+
+    // refit to the consensus; pA & pB keep all the points for the recount
+    cv::AutoBuffer<CvPoint2D32f> fitA(good_count), fitB(good_count);
+    for( i = 0; i < good_count; i++ )
+    {
+        j = good_idx[i];
+        fitA[i] = pA[j];
+        fitB[i] = pB[j];
+    }
+
+    icvGetRTMatrix( fitA, fitB, good_count, &M, full_affine );
 
-    if( good_count < count )
+    if( stats )
     {
-        for( i = 0; i < good_count; i++ )
+        // the refit moves away from the sample, so the inliers (and their
+        // residual) are counted again against the transform returned
+        double sum = 0;
+        int inliers = 0;
+        for( i = 0; i < count; i++ )
         {
-            j = good_idx[i];
-            pA[i] = pA[j];
-            pB[i] = pB[j];
+            double dx = m[0]*pA[i].x + m[1]*pA[i].y + m[2] - pB[i].x;
+            double dy = m[3]*pA[i].x + m[4]*pA[i].y + m[5] - pB[i].y;
+            if( fabs(dx) + fabs(dy) < threshold )
+            {
+                inliers++;
+                sum += sqrt( dx*dx + dy*dy );
+            }
         }
+        stats->inliers = inliers;
+        stats->residual = inliers > 0 ? sum / inliers / scale : 0;
     }
 
-    icvGetRTMatrix( pA, pB, good_count, &M, full_affine );
     m[2] /= scale;
     m[5] /= scale;
     cvConvert( &M, matM );
@@ -329,15 +366,276 @@ cvEstimateRigidTransformRansac( const CvArr* matA, const CvArr* matB, CvMat* mat
     return 1;
 }
 
+const char *ransacResultName( int result )
+{
+    switch( result )
+    {
+    case RANSAC_OK: return "ok";
+    case RANSAC_TOO_FEW_POINTS: return "too_few_points";
+    case RANSAC_NO_CONSENSUS: return "no_consensus";
+    }
+    return "unknown";
+}
+
 cv::Mat estimateRigidTransformRansac( cv::InputArray src1,
                                      cv::InputArray src2,
                                     bool fullAffine, int ransac_max_iters=500, double ransac_good_ratio=0.5)
 {
+    return estimateRigidTransformRansac(src1, src2, fullAffine, ransac_max_iters, ransac_good_ratio, 0);
+}
+
+cv::Mat estimateRigidTransformRansac( cv::InputArray src1,
+                                     cv::InputArray src2,
+                                     bool fullAffine, int ransac_max_iters, double ransac_good_ratio,
+                                     RansacStats* stats)
+{
+    TRACE_SCOPE("estimateRigidTransformRansac");
+    int64 t0 = cv::getTickCount();
+    if( stats )
+        *stats = RansacStats();
     cv::Mat M(2, 3, CV_64F), A = src1.getMat(), B = src2.getMat();
     CvMat matA = A, matB = B, matM = M;
-    int err = cvEstimateRigidTransformRansac(&matA, &matB, &matM, fullAffine,ransac_max_iters, ransac_good_ratio);
+    int err = cvEstimateRigidTransformRansac(&matA, &matB, &matM, fullAffine,ransac_max_iters, ransac_good_ratio, stats);
+    if( stats )
+        stats->ms = (cv::getTickCount() - t0) * 1000. / cv::getTickFrequency();
     if (err == 1)
         return M;
     else
         return cv::Mat();
-}
\ No newline at end of file
+}
+
+static cv::Mat affine3x3( const cv::Mat &M )
+{
+    cv::Mat M3 = cv::Mat::eye(3, 3, CV_64F);
+    M.copyTo(M3.rowRange(0, 2));
+    return M3;
+}
+
+// Grey pixels of r in frame: a view of a grey frame, converted into buf
+// from a BGR one.
+static cv::Mat greyPatch( const cv::Mat &frame, cv::Rect r, cv::Mat &buf )
+{
+    if( frame.channels() == 1 )
+        return frame(r);
+    cv::cvtColor(frame(r), buf, CV_BGR2GRAY);
+    return buf;
+}
+
+HierarchicalEstimator::HierarchicalEstimator( const HierarchyOptions &_opts )
+    : opts(_opts)
+{
+    opts.coarse_side = std::max(opts.coarse_side, 32);
+    opts.patches = std::max(opts.patches, 3);
+    opts.window = std::max(opts.window, 5);
+    opts.patch_radius = std::max(opts.patch_radius, opts.window);
+}
+
+void HierarchicalEstimator::prepare( cv::Size size )
+{
+    frame_size = size;
+    coarse_size = scaledSize(size, (double)opts.coarse_side / std::max(size.width, size.height));
+    ref_coarse.release();
+}
+
+cv::Rect HierarchicalEstimator::patchRect( cv::Point2f c ) const
+{
+    int side = 2*opts.patch_radius + 1;
+    return cv::Rect(cvRound(c.x) - opts.patch_radius, cvRound(c.y) - opts.patch_radius, side, side);
+}
+
+void HierarchicalEstimator::setReference( const cv::Mat &frame, const std::vector<cv::Point2f> &points )
+{
+    CV_Assert( frame.depth() == CV_8U && (frame.channels() == 1 || frame.channels() == 3) );
+    if( frame.size() != frame_size )
+        prepare(frame.size());
+    greyDownscale(frame, ref_coarse, coarse_size);
+    adopt(frame, points);
+}
+
+void HierarchicalEstimator::adopt( const cv::Mat &frame, const std::vector<cv::Point2f> &points )
+{
+    TRACE_SCOPE("hierarchical_reference");
+    ref_coarse_points.clear();
+    cv::goodFeaturesToTrack(ref_coarse, ref_coarse_points, 200, 0.01, std::max(opts.coarse_side/32, 2));
+
+    // coarse pixel centres sit at s*(p + 0.5) - 0.5
+    double sx = (double)coarse_size.width / frame_size.width;
+    double sy = (double)coarse_size.height / frame_size.height;
+
+    std::vector<cv::Point2f> seeds = points;
+    bool chosen = seeds.empty();
+    if( chosen )
+    {
+        // the strongest corner of each cell of a grid over the frame, so the
+        // patches are spread out; the corners come strongest first
+        int g = cvCeil(std::sqrt((double)opts.patches));
+        std::vector<char> taken(g*g, 0);
+        for( size_t i = 0; i < ref_coarse_points.size() && (int)seeds.size() < opts.patches; i++ )
+        {
+            const cv::Point2f &c = ref_coarse_points[i];
+            int cx = std::min((int)(c.x*g/coarse_size.width), g - 1);
+            int cy = std::min((int)(c.y*g/coarse_size.height), g - 1);
+            if( taken[cy*g + cx] )
+                continue;
+            taken[cy*g + cx] = 1;
+            seeds.push_back(cv::Point2f((float)((c.x + 0.5)/sx - 0.5), (float)((c.y + 0.5)/sy - 0.5)));
+        }
+    }
+
+    cv::Rect frame_rect(cv::Point(), frame_size);
+    ref_points.clear();
+    ref_patches.clear();
+    ref_rects.clear();
+    for( size_t i = 0; i < seeds.size(); i++ )
+    {
+        cv::Rect r = patchRect(seeds[i]);
+        cv::Mat patch;
+        cv::Point2f p = seeds[i];
+        if( (r & frame_rect) == r )
+            patch = greyPatch(frame, r, cur_patch).clone();
+
+        if( chosen )
+        {
+            if( patch.empty() )
+                continue;
+            // a coarse corner is only known to a coarse pixel: snap to the
+            // strongest full resolution corner, away from the patch border so
+            // the LK window fits around it
+            int m = opts.window/2 + 1;
+            cv::Mat inner = patch(cv::Rect(m, m, patch.cols - 2*m, patch.rows - 2*m));
+            std::vector<cv::Point2f> best;
+            cv::goodFeaturesToTrack(inner, best, 1, 0.01, 0);
+            if( best.empty() )
+                continue;
+            cv::cornerSubPix(inner, best, cv::Size(2, 2), cv::Size(-1, -1),
+                             cv::TermCriteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, 20, 0.03));
+            p = best[0] + cv::Point2f((float)(r.x + m), (float)(r.y + m));
+        }
+
+        // given points keep their index even when their patch is outside
+        // the frame; they are then never tracked
+        ref_points.push_back(p);
+        ref_patches.push_back(patch);
+        ref_rects.push_back(r);
+    }
+}
+
+cv::Mat HierarchicalEstimator::coarseMotion( const cv::Mat &frame )
+{
+    TRACE_SCOPE("hierarchical_coarse");
+    greyDownscale(frame, cur_coarse, coarse_size);
+
+    std::vector<cv::Point2f> moved, a, b;
+    std::vector<uchar> status;
+    std::vector<float> err;
+    if( !ref_coarse_points.empty() )
+        cv::calcOpticalFlowPyrLK(ref_coarse, cur_coarse, ref_coarse_points, moved, status, err);
+    for( size_t i = 0; i < status.size(); i++ )
+        if( status[i] )
+        {
+            a.push_back(ref_coarse_points[i]);
+            b.push_back(moved[i]);
+        }
+
+    cv::Mat M;
+    if( a.size() >= 3 )
+        M = estimateRigidTransformRansac(a, b, false, 500, 0.5);
+    if( M.empty() )
+        return M;
+
+    // back to full resolution pixels
+    double sx = (double)coarse_size.width / frame_size.width;
+    double sy = (double)coarse_size.height / frame_size.height;
+    cv::Mat S = (cv::Mat_<double>(2,3) << sx, 0, 0.5*(sx - 1),
+                                          0, sy, 0.5*(sy - 1));
+    cv::Mat full = affine3x3(S).inv() * affine3x3(M) * affine3x3(S);
+    return full.rowRange(0, 2).clone();
+}
+
+void HierarchicalEstimator::trackPoints( const cv::Mat &frame, std::vector<cv::Point2f> &points,
+                                         std::vector<uchar> &status )
+{
+    CV_Assert( hasReference() && frame.size() == frame_size );
+    coarse_T = coarseMotion(frame);
+    cv::Mat_<double> P = cv::Mat::eye(2, 3, CV_64F);
+    if( !coarse_T.empty() )
+        P = coarse_T;
+
+    TRACE_SCOPE("hierarchical_refine");
+    points.assign(ref_points.size(), cv::Point2f());
+    status.assign(ref_points.size(), 0);
+    cv::Rect frame_rect(cv::Point(), frame_size);
+    std::vector<cv::Point2f> from(1), to(1);
+    std::vector<uchar> found;
+    std::vector<float> err;
+    for( size_t i = 0; i < ref_points.size(); i++ )
+    {
+        if( ref_patches[i].empty() )
+            continue;
+        const cv::Point2f &p = ref_points[i];
+        cv::Point2f q((float)(P(0,0)*p.x + P(0,1)*p.y + P(0,2)),
+                      (float)(P(1,0)*p.x + P(1,1)*p.y + P(1,2)));
+        cv::Rect r = patchRect(q);
+        if( (r & frame_rect) != r )
+            continue;
+        cv::Mat patch = greyPatch(frame, r, cur_patch);
+
+        // the prediction is within a few pixels, so one pyramid level and a
+        // small window suffice
+        from[0] = p - cv::Point2f((float)ref_rects[i].x, (float)ref_rects[i].y);
+        to[0] = q - cv::Point2f((float)r.x, (float)r.y);
+        cv::calcOpticalFlowPyrLK(ref_patches[i], patch, from, to, found, err,
+                                 cv::Size(opts.window, opts.window), 1,
+                                 cv::TermCriteria(CV_TERMCRIT_ITER | CV_TERMCRIT_EPS, 30, 0.01),
+                                 cv::OPTFLOW_USE_INITIAL_FLOW);
+        if( found[0] )
+        {
+            points[i] = to[0] + cv::Point2f((float)r.x, (float)r.y);
+            status[i] = 1;
+        }
+    }
+}
+
+cv::Mat HierarchicalEstimator::estimate( const cv::Mat &frame, bool fullAffine, int ransac_max_iters,
+                                         double ransac_good_ratio, RansacStats *stats )
+{
+    std::vector<cv::Point2f> tracked, a, b;
+    std::vector<uchar> status;
+    trackPoints(frame, tracked, status);
+    for( size_t i = 0; i < status.size(); i++ )
+        if( status[i] )
+        {
+            a.push_back(ref_points[i]);
+            b.push_back(tracked[i]);
+        }
+
+    cv::Mat T;
+    if( a.size() >= 3 )
+        T = estimateRigidTransformRansac(a, b, fullAffine, ransac_max_iters, ransac_good_ratio, stats);
+    else if( stats )
+    {
+        *stats = RansacStats();
+        stats->points = (int)a.size();
+        stats->result = RANSAC_TOO_FEW_POINTS;
+    }
+    if( T.empty() && !coarse_T.empty() )
+        T = coarse_T.clone();
+    return T;
+}
+
+cv::Mat HierarchicalEstimator::track( const cv::Mat &frame, bool fullAffine, int ransac_max_iters,
+                                      double ransac_good_ratio, RansacStats *stats )
+{
+    if( !hasReference() || frame.size() != frame_size )
+    {
+        if( stats )
+            *stats = RansacStats();
+        setReference(frame);
+        return cv::Mat();
+    }
+    cv::Mat T = estimate(frame, fullAffine, ransac_max_iters, ransac_good_ratio, stats);
+    // the frame's coarse level is already there
+    std::swap(ref_coarse, cur_coarse);
+    adopt(frame, std::vector<cv::Point2f>());
+    return T;
+}
@@ -12,9 +12,109 @@
 
 #include <opencv2/opencv.hpp>
 
+#include <vector>
+
+// Why estimateRigidTransformRansac returned what it did.
+enum RansacResult
+{
+  RANSAC_OK = 0,
+  RANSAC_TOO_FEW_POINTS,  // fewer than 3 point pairs (or tracked grid points)
+  RANSAC_NO_CONSENSUS     // no sample reached ransac_good_ratio in ransac_max_iters
+};
+
+// Name of a RansacResult, for logs and reports.
+const char *ransacResultName( int result );
+
+// What a call to estimateRigidTransformRansac did.
+struct RansacStats
+{
+  RansacStats() : points(0), inliers(0), best_inliers(0), iterations(0), result(RANSAC_OK),
+                  residual(0), threshold(0), ms(0) {}
+
+  int points;        // point pairs the estimate started from
+  int inliers;       // point pairs within threshold of the returned (refit) transform
+  int best_inliers;  // largest consensus of any sample, also when it failed
+  int iterations;    // RANSAC iterations run
+  int result;        // RansacResult
+  double residual;   // mean distance of those inliers to it, in input pixels
+  double threshold;  // inlier threshold (L1 distance), in input pixels
+  double ms;         // wall time of the call, including the tracking of the image path
+};
+
 cv::Mat estimateRigidTransformRansac( cv::InputArray src1,
                                      cv::InputArray src2,
                                      bool fullAffine, int ransac_max_iters, double ransac_good_ratio);
 
+// Same as above, and fills stats (may be NULL).
+cv::Mat estimateRigidTransformRansac( cv::InputArray src1,
+                                     cv::InputArray src2,
+                                     bool fullAffine, int ransac_max_iters, double ransac_good_ratio,
+                                     RansacStats *stats);
+
+// Coarse-to-fine estimation, see HierarchicalEstimator.
+struct HierarchyOptions
+{
+  HierarchyOptions() : coarse_side(256), patches(32), patch_radius(24), window(15) {}
+
+  int coarse_side;   // longest side of the coarse level, in pixels
+  int patches;       // full resolution patches refined per frame
+  int patch_radius;  // patches are 2*patch_radius+1 pixels square
+  int window;        // LK window inside the patches
+};
+
+// Motion between full resolution frames at about the cost of a proxy
+// analysis. A cheap global estimate on a coarse greyDownscale'd level
+// (corners, LK, RANSAC) predicts where the reference points went, and LK
+// then only refines each prediction on a small full resolution patch
+// around it, with a small window and a single pyramid level. The frames
+// are never converted, filtered or pyramided at full resolution.
+// Frames are CV_8UC1 (grey or luma) or BGR.
+class HierarchicalEstimator
+{
+public:
+  explicit HierarchicalEstimator( const HierarchyOptions &opts = HierarchyOptions() );
+
+  // Sets the reference frame. Without points, up to opts.patches
+  // well-textured points spread over the frame are chosen on the coarse
+  // level and snapped to the strongest corner of their patch; otherwise the
+  // given points (full resolution pixels) are tracked. Only the patches are
+  // kept, not the frame.
+  void setReference( const cv::Mat &frame, const std::vector<cv::Point2f> &points = std::vector<cv::Point2f>() );
+  bool hasReference() const { return !ref_coarse.empty(); }
+
+  // The reference points, refined.
+  const std::vector<cv::Point2f> &points() const { return ref_points; }
+
+  // Tracks the reference points into frame; status[i] is 0 for the points
+  // that were lost or whose patch left the frame.
+  void trackPoints( const cv::Mat &frame, std::vector<cv::Point2f> &points, std::vector<uchar> &status );
+
+  // Reference to frame with the Ert RANSAC over the tracked points, or the
+  // coarse estimate when too few of them are left; empty if both fail.
+  cv::Mat estimate( const cv::Mat &frame, bool fullAffine, int ransac_max_iters, double ransac_good_ratio,
+                    RansacStats *stats = 0 );
+
+  // Previous frame to frame, which then becomes the reference. The first
+  // call only sets the reference and returns an empty matrix.
+  cv::Mat track( const cv::Mat &frame, bool fullAffine, int ransac_max_iters, double ransac_good_ratio,
+                 RansacStats *stats = 0 );
+
+private:
+  void prepare( cv::Size frame_size );
+  void adopt( const cv::Mat &frame, const std::vector<cv::Point2f> &points );
+  cv::Mat coarseMotion( const cv::Mat &frame );
+  cv::Rect patchRect( cv::Point2f centre ) const;
+
+  HierarchyOptions opts;
+  cv::Size frame_size, coarse_size;
+
+  cv::Mat ref_coarse, cur_coarse;
+  cv::Mat coarse_T;                            // of the last frame, empty if it failed
+  std::vector<cv::Point2f> ref_coarse_points;  // coarse level corners
+  std::vector<cv::Point2f> ref_points;         // full resolution
+  std::vector<cv::Mat> ref_patches;            // grey, ref_rects of the reference
+  std::vector<cv::Rect> ref_rects;
+  cv::Mat cur_patch;                           // BGR frames' patches in grey
+};
 
 #endif
@@ -0,0 +1,280 @@
+#include "frame_cache.h"
+
+// Boost includes
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <set>
+
+namespace fs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+static const char INDEX_MAGIC[4] = { 'F', 'M', 'F', 'C' };
+static const int32_t INDEX_VERSION = 1;
+static const size_t SLOT_ALIGN = 4096;
+
+struct IndexHeader
+{
+  char magic[4];
+  int32_t version;
+  int32_t width;
+  int32_t height;
+  int32_t type;
+  int32_t entries;
+  uint64_t slot_bytes;
+};
+
+static uint64_t fnv1a( uint64_t h, const void *data, size_t len )
+{
+  const unsigned char *p = static_cast<const unsigned char*>(data);
+  for ( size_t i = 0; i < len; ++i )
+  {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// file locks are per process, so the caches open in this one are tracked here
+static std::mutex open_mtx;
+static std::set<std::string> open_files;
+
+// The lock is taken on the data file before it is resized or mapped, and
+// released only once the last pinned frame is gone.
+struct FrameCache::Mapping
+{
+  ~Mapping()
+  {
+    std::lock_guard<std::mutex> guard(open_mtx);
+    open_files.erase(path);
+  }
+
+  std::string path;
+  bip::file_lock lock;
+  bip::file_mapping file;
+  bip::mapped_region region;
+};
+
+FrameCache::FrameCache( const std::string &dir, const std::string &fn, const std::string &plane,
+                        cv::Size size, int type, size_t max_bytes )
+  : frame_size(size), frame_type(type), slots(0), base(0),
+    mtx(std::make_shared<std::mutex>()), pins(std::make_shared<std::vector<int> >()),
+    hit_count(0), miss_count(0)
+{
+  size_t frame_bytes = (size_t) size.width * size.height * CV_ELEM_SIZE(type);
+  slot_bytes = (frame_bytes + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+  slots = (int) std::max(max_bytes / slot_bytes, (size_t) 1);
+
+  boost::system::error_code ec;
+  fs::path footage = fs::absolute(fn);
+  uint64_t footage_size = fs::file_size(footage, ec);
+  int64_t footage_time = ec ? 0 : (int64_t) fs::last_write_time(footage, ec);
+  if ( ec )
+  {
+    std::cerr << "Not caching frames of " << fn << ": " << ec.message() << std::endl;
+    return;
+  }
+  std::string path = footage.string();
+  int32_t dims[3] = { size.width, size.height, type };
+  uint64_t key = 14695981039346656037ULL;
+  key = fnv1a(key, path.data(), path.size());
+  key = fnv1a(key, &footage_size, sizeof(footage_size));
+  key = fnv1a(key, &footage_time, sizeof(footage_time));
+  key = fnv1a(key, plane.data(), plane.size());
+  key = fnv1a(key, dims, sizeof(dims));
+
+  char name[64];
+  snprintf(name, sizeof(name), "frames-%016llx.", (unsigned long long) key);
+  data_fn = (fs::path(dir) / (name + plane)).string();
+  index_fn = data_fn + ".idx";
+
+  try
+  {
+    fs::create_directories(dir);
+    // file_lock needs the file to exist
+    std::ofstream(data_fn.c_str(), std::ios::binary | std::ios::app);
+    std::shared_ptr<Mapping> m;
+    {
+      std::lock_guard<std::mutex> guard(open_mtx);
+      if ( open_files.insert(data_fn).second )
+      {
+        m = std::make_shared<Mapping>();
+        m->path = data_fn;
+      }
+    }
+    if ( m )
+    {
+      m->lock = bip::file_lock(data_fn.c_str());
+      if ( !m->lock.try_lock() )
+        m.reset();
+    }
+    if ( !m )
+    {
+      std::cerr << "Frame cache " << data_fn << " is in use, not caching" << std::endl;
+      return;
+    }
+    fs::resize_file(data_fn, (uintmax_t) slots * slot_bytes);
+    m->file = bip::file_mapping(data_fn.c_str(), bip::read_write);
+    m->region = bip::mapped_region(m->file, bip::read_write);
+    mapping = m;
+    base = static_cast<uchar*>(mapping->region.get_address());
+  }
+  catch ( std::exception &e )
+  {
+    std::cerr << "Could not open frame cache " << data_fn << ": " << e.what() << std::endl;
+    mapping.reset();
+    return;
+  }
+
+  pins->assign(slots, 0);
+  slot_frame.assign(slots, -1);
+  lru_pos.resize(slots);
+  load_index();
+  for ( int s = slots - 1; s >= 0; --s )
+    if ( slot_frame[s] < 0 )
+      free_slots.push_back(s);
+}
+
+FrameCache::~FrameCache()
+{
+  if ( enabled() )
+    save_index();
+}
+
+cv::Mat FrameCache::slot_mat( int slot )
+{
+  return cv::Mat(frame_size, frame_type, base + (size_t) slot * slot_bytes);
+}
+
+void FrameCache::load_index()
+{
+  std::ifstream in(index_fn.c_str(), std::ios::binary);
+  IndexHeader hdr;
+  if ( in.read((char *) &hdr, sizeof(hdr)) && memcmp(hdr.magic, INDEX_MAGIC, 4) == 0 &&
+       hdr.version == INDEX_VERSION && hdr.width == frame_size.width && hdr.height == frame_size.height &&
+       hdr.type == frame_type && hdr.slot_bytes == slot_bytes )
+  {
+    // most recently used first; slots beyond a smaller cap are dropped
+    int32_t entry[2];
+    for ( int i = 0; i < hdr.entries && in.read((char *) entry, sizeof(entry)); ++i )
+    {
+      int slot = entry[0], frame = entry[1];
+      if ( slot < 0 || slot >= slots || frame < 0 || slot_frame[slot] >= 0 || frame_slot.count(frame) )
+        continue;
+      slot_frame[slot] = frame;
+      frame_slot[frame] = slot;
+      lru_pos[slot] = lru.insert(lru.end(), slot);
+    }
+  }
+  in.close();
+  // the slots change from now on: a run that does not get to save the
+  // index must not leave the old one behind
+  boost::system::error_code ec;
+  fs::remove(index_fn, ec);
+}
+
+void FrameCache::save_index()
+{
+  std::lock_guard<std::mutex> lock(*mtx);
+  std::ofstream out(index_fn.c_str(), std::ios::binary | std::ios::trunc);
+  IndexHeader hdr;
+  memcpy(hdr.magic, INDEX_MAGIC, 4);
+  hdr.version = INDEX_VERSION;
+  hdr.width = frame_size.width;
+  hdr.height = frame_size.height;
+  hdr.type = frame_type;
+  hdr.entries = (int32_t) lru.size();
+  hdr.slot_bytes = slot_bytes;
+  out.write((const char *) &hdr, sizeof(hdr));
+  for ( std::list<int>::const_iterator it = lru.begin(); it != lru.end(); ++it )
+  {
+    int32_t entry[2] = { *it, slot_frame[*it] };
+    out.write((const char *) entry, sizeof(entry));
+  }
+  if ( !out )
+    std::cerr << "Could not write frame cache index " << index_fn << std::endl;
+}
+
+cv::Mat FrameCache::get( int index, std::shared_ptr<void> &pin )
+{
+  if ( !enabled() )
+    return cv::Mat();
+
+  int slot;
+  {
+    std::lock_guard<std::mutex> lock(*mtx);
+    std::map<int, int>::const_iterator it = frame_slot.find(index);
+    if ( it == frame_slot.end() )
+    {
+      miss_count++;
+      return cv::Mat();
+    }
+    hit_count++;
+    slot = it->second;
+    lru.splice(lru.begin(), lru, lru_pos[slot]);
+    (*pins)[slot]++;
+  }
+
+  // the pin holds the mapping as well, so the pixels stay valid even
+  // after the cache is gone
+  std::shared_ptr<std::mutex> m = mtx;
+  std::shared_ptr<std::vector<int> > p = pins;
+  std::shared_ptr<Mapping> mapped = mapping;
+  pin = std::shared_ptr<void>((void *) 0, [m, p, mapped, slot]( void * ) {
+    std::lock_guard<std::mutex> lock(*m);
+    (*p)[slot]--;
+  });
+  return slot_mat(slot);
+}
+
+void FrameCache::put( int index, const cv::Mat &pixels )
+{
+  if ( !enabled() )
+    return;
+  CV_Assert( pixels.size() == frame_size && pixels.type() == frame_type );
+
+  int slot = -1;
+  {
+    std::lock_guard<std::mutex> lock(*mtx);
+    if ( frame_slot.count(index) )
+      return;
+    if ( !free_slots.empty() )
+    {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    }
+    else
+    {
+      // the least recently used frame nobody holds
+      for ( std::list<int>::reverse_iterator it = lru.rbegin(); it != lru.rend(); ++it )
+        if ( (*pins)[*it] == 0 )
+        {
+          slot = *it;
+          break;
+        }
+      if ( slot < 0 )
+        return;
+      frame_slot.erase(slot_frame[slot]);
+      lru.erase(lru_pos[slot]);
+      slot_frame[slot] = -1;
+    }
+    // not findable yet, and pinned so it is not handed out again
+    (*pins)[slot]++;
+  }
+
+  cv::Mat dst = slot_mat(slot);
+  pixels.copyTo(dst);
+
+  std::lock_guard<std::mutex> lock(*mtx);
+  (*pins)[slot]--;
+  slot_frame[slot] = index;
+  frame_slot[index] = slot;
+  lru_pos[slot] = lru.insert(lru.begin(), slot);
+}
@@ -0,0 +1,82 @@
+//
+//  frame_cache.h
+//  Footage_Manipulation
+//
+//  Decoded frame cache on local scratch, so the second pass of a tool (and
+//  later runs over the same footage) reads frames instead of decoding them
+//  again. One plane (BGR or luma) of one video is kept in a file of fixed
+//  size frame slots that is memory mapped: a cached frame is a cv::Mat
+//  pointing into the mapping, nothing is copied or decoded. The cache is
+//  capped in size and evicts the least recently used frame; frames still
+//  in use are never evicted. The index of the slots is written when the
+//  cache is closed and removed while it is open, so a crashed run leaves
+//  an empty cache rather than a wrong one.
+
+#ifndef __frame_cache_h
+#define __frame_cache_h
+
+#include <opencv2/opencv.hpp>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class FrameCache
+{
+public:
+  // The cache of plane (a name such as "bgr" or "y") of the frames of fn,
+  // which are size and type, in dir. The file is keyed by fn's path, size
+  // and modification time, so changed footage starts a new cache. At most
+  // max_bytes (at least one frame) are used. When dir cannot be used, or
+  // another process has the same cache open, this one stays disabled and
+  // empty (see enabled()).
+  FrameCache( const std::string &dir, const std::string &fn, const std::string &plane,
+              cv::Size size, int type, size_t max_bytes );
+  ~FrameCache();
+
+  FrameCache( const FrameCache& ) = delete;
+  FrameCache& operator=( const FrameCache& ) = delete;
+
+  bool enabled() const { return base != 0; }
+
+  // The pixels of frame index, or an empty Mat when it is not cached. pin
+  // keeps them mapped and in the cache until it is released.
+  cv::Mat get( int index, std::shared_ptr<void> &pin );
+
+  // Copies pixels into the cache as frame index, evicting the least
+  // recently used frame when it is full; skipped when every slot is in use.
+  void put( int index, const cv::Mat &pixels );
+
+  int hits() const { return hit_count; }
+  int misses() const { return miss_count; }
+
+private:
+  struct Mapping;
+
+  void load_index();
+  void save_index();
+  cv::Mat slot_mat( int slot );
+
+  std::string data_fn, index_fn;
+  cv::Size frame_size;
+  int frame_type;
+  size_t slot_bytes;
+  int slots;
+  std::shared_ptr<Mapping> mapping;  // shared with the pins
+  uchar *base;
+
+  // guarded by mtx, which pins share with the cache
+  std::shared_ptr<std::mutex> mtx;
+  std::shared_ptr<std::vector<int> > pins;  // per slot
+  std::vector<int> slot_frame;              // per slot, -1 for free slots
+  std::vector<int> free_slots;
+  std::map<int, int> frame_slot;
+  std::list<int> lru;                       // used slots, most recent first
+  std::vector<std::list<int>::iterator> lru_pos;
+  int hit_count, miss_count;
+};
+
+#endif
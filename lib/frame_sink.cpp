@@ -0,0 +1,371 @@
+#include "frame_sink.h"
+#include "libav_io.h"
+#include "trace.h"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace po = boost::program_options;
+
+// ---------------------------------------------------------------------------
+// OpenCV VideoWriter backend
+
+class CvFrameSink : public FrameSink
+{
+public:
+  CvFrameSink( const std::string &fn, double fps, cv::Size size, const FrameSinkOptions &opts )
+  {
+    writer.open(fn, fourcc(opts.codec), fps, size, true);
+    if ( !writer.isOpened() )
+      throw std::runtime_error( "could not open " + fn + " for writing" );
+  }
+
+  void write( const cv::Mat &frame )
+  {
+    TRACE_SCOPE("encode");
+    writer << frame;
+  }
+
+private:
+  // VideoWriter only knows FOURCCs; map the libav names of the usual codecs.
+  static int fourcc( const std::string &codec )
+  {
+    if ( codec == "mjpeg" )
+      return CV_FOURCC('M','J','P','G');
+    if ( codec == "libx264" || codec == "h264" )
+      return CV_FOURCC('X','2','6','4');
+    if ( codec.size() == 4 )
+      return CV_FOURCC(codec[0], codec[1], codec[2], codec[3]);
+    return CV_FOURCC('m','p','4','v');
+  }
+
+  cv::VideoWriter writer;
+};
+
+// ---------------------------------------------------------------------------
+// Encoder thread
+
+// Encodes on a thread of its own behind a queue of at most depth frames.
+// Frames are copied into the queue, as callers reuse their buffers; the
+// copies' buffers are recycled.
+class AsyncFrameSink : public FrameSink
+{
+public:
+  AsyncFrameSink( std::unique_ptr<FrameSink> _sink, int _depth )
+    : sink(std::move(_sink)), depth(std::max(_depth, 1)), closing(false)
+  {
+    encoder = std::thread(&AsyncFrameSink::run, this);
+  }
+
+  ~AsyncFrameSink()
+  {
+    try
+    {
+      close();
+    }
+    catch ( std::exception &e )
+    {
+      std::cerr << "Could not encode all frames: " << e.what() << std::endl;
+    }
+  }
+
+  void close()
+  {
+    if ( encoder.joinable() )
+    {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        closing = true;
+      }
+      cond.notify_all();
+      encoder.join();
+      if ( !error )
+      {
+        try
+        {
+          sink->close();
+        }
+        catch ( ... )
+        {
+          error = std::current_exception();
+        }
+      }
+    }
+    if ( error )
+    {
+      // reported once
+      std::exception_ptr e = error;
+      error = std::exception_ptr();
+      std::rethrow_exception(e);
+    }
+  }
+
+  void write( const cv::Mat &frame )
+  {
+    cv::Mat copy;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      if ( !spare.empty() )
+      {
+        copy = spare.back();
+        spare.pop_back();
+      }
+    }
+    frame.copyTo(copy);
+
+    std::unique_lock<std::mutex> lock(mtx);
+    {
+      TRACE_SCOPE("encode_wait");
+      cond.wait(lock, [this] { return error || (int) queue.size() < depth; });
+    }
+    if ( error )
+      std::rethrow_exception(error);
+    queue.push_back(copy);
+    cond.notify_all();
+  }
+
+private:
+  void run()
+  {
+    traceThreadName("encoder");
+    while ( true )
+    {
+      cv::Mat frame;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cond.wait(lock, [this] { return closing || !queue.empty(); });
+        if ( queue.empty() )
+          return;
+        frame = queue.front();
+      }
+      try
+      {
+        sink->write(frame);
+      }
+      catch ( ... )
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        error = std::current_exception();
+        queue.clear();
+        cond.notify_all();
+        return;
+      }
+      {
+        // the frame counts against depth until it is encoded
+        std::lock_guard<std::mutex> lock(mtx);
+        queue.pop_front();
+        spare.push_back(frame);
+      }
+      cond.notify_all();
+    }
+  }
+
+  std::unique_ptr<FrameSink> sink;
+  int depth;
+  std::thread encoder;
+  std::mutex mtx;
+  std::condition_variable cond;
+  std::deque<cv::Mat> queue;
+  std::vector<cv::Mat> spare;
+  bool closing;
+  std::exception_ptr error;
+};
+
+static std::unique_ptr<FrameSink> open_backend( const std::string &fn, double fps, cv::Size size,
+                                                const FrameSinkOptions &opts )
+{
+#ifdef HAVE_LIBAV
+  if ( opts.backend != "opencv" )
+    return createLibavSink(fn, fps, size, opts);
+#else
+  if ( opts.backend == "libav" )
+    throw std::invalid_argument( "built without libav, use --encoder opencv" );
+#endif
+  return std::unique_ptr<FrameSink>(new CvFrameSink(fn, fps, size, opts));
+}
+
+#ifdef HAVE_LIBAV
+
+// ---------------------------------------------------------------------------
+// Parallel segments
+
+// Cuts the video into segments of segment_frames frames, each encoded into
+// a part file of its own (so it starts with a keyframe) on its own encoder
+// thread, with up to segments of them encoding at once. A segment's queue
+// takes up to all of its frames, so the caller moves on to the next
+// segment while the previous ones are still encoding; the queues together
+// hold at most segment_mb of frames, so big frames get shorter queues and
+// the caller waits for the encoders sooner. When the sink closes the parts
+// are joined into fn without re-encoding and removed.
+class SegmentedFrameSink : public FrameSink
+{
+public:
+  SegmentedFrameSink( const std::string &_fn, double _fps, cv::Size _size, const FrameSinkOptions &opts )
+    : fn(_fn), fps(_fps), size(_size), part_opts(opts), frames(0), closed(false)
+  {
+    // the cores are shared by the segments' encoders
+    if ( part_opts.encode_threads <= 0 )
+    {
+      int hw = (int) std::thread::hardware_concurrency();
+      part_opts.encode_threads = std::max(hw / std::max(opts.segments, 1), 1);
+    }
+    part_opts.segment_frames = std::max(opts.segment_frames, 1);
+    // the segments' queues share segment_mb
+    double frame_mb = std::max(size.area() * 3.0 / (1 << 20), 1e-6);
+    int fit = (int) (std::max(opts.segment_mb, 1) / frame_mb) / std::max(opts.segments, 1);
+    depth = std::min(std::max(fit, 1), part_opts.segment_frames);
+  }
+
+  ~SegmentedFrameSink()
+  {
+    try
+    {
+      close();
+    }
+    catch ( std::exception &e )
+    {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+
+  void write( const cv::Mat &frame )
+  {
+    if ( !failure.empty() )
+      throw std::runtime_error( failure );
+    if ( frames % part_opts.segment_frames == 0 )
+    {
+      // the oldest segment has to be done before another one starts
+      if ( (int) encoding.size() >= std::max(part_opts.segments, 1) )
+      {
+        TRACE_SCOPE("segment_wait");
+        retire();
+      }
+      parts.push_back(partName(parts.size()));
+      encoding.push_back(std::unique_ptr<FrameSink>(
+        new AsyncFrameSink(createLibavSink(parts.back(), fps, size, part_opts), depth)));
+    }
+    encoding.back()->write(frame);
+    frames++;
+  }
+
+  // Joins the parts only when every segment was encoded; otherwise they
+  // are kept and the first failure is thrown.
+  void close()
+  {
+    if ( closed )
+      return;
+    closed = true;
+    while ( !encoding.empty() )
+    {
+      try
+      {
+        retire();
+      }
+      catch ( std::exception & )
+      {
+        // the first failure is kept; the other segments still finish
+      }
+    }
+    std::string left = "; the segments are left in " + (parts.empty() ? fn : parts[0]) + " and following";
+    if ( !failure.empty() )
+      throw std::runtime_error( failure + left );
+    try
+    {
+      concatLibavVideos(parts, fn);
+    }
+    catch ( std::exception &e )
+    {
+      throw std::runtime_error( "could not join the segments of " + fn + ": " + e.what() + left );
+    }
+    for ( size_t i = 0; i < parts.size(); ++i )
+      boost::filesystem::remove(parts[i]);
+  }
+
+private:
+  // Waits for the oldest segment to be encoded; rethrows its encoder's error.
+  void retire()
+  {
+    size_t index = parts.size() - encoding.size();
+    std::unique_ptr<FrameSink> segment = std::move(encoding.front());
+    encoding.pop_front();
+    try
+    {
+      segment->close();
+    }
+    catch ( std::exception &e )
+    {
+      if ( failure.empty() )
+        failure = "could not encode segment " + std::to_string((long long) index) + " of " + fn + ": " + e.what();
+      throw std::runtime_error( failure );
+    }
+  }
+
+  // out.avi -> out.part0000.avi, the container is chosen by the extension
+  std::string partName( size_t i ) const
+  {
+    boost::filesystem::path p(fn);
+    char part[32];
+    std::snprintf(part, sizeof(part), ".part%04d", (int) i);
+    return (p.parent_path() / (p.stem().string() + part + p.extension().string())).string();
+  }
+
+  std::string fn;
+  double fps;
+  cv::Size size;
+  FrameSinkOptions part_opts;
+  int depth;  // queue of each segment
+  long frames;
+  std::vector<std::string> parts;
+  std::deque<std::unique_ptr<FrameSink> > encoding;
+  std::string failure;  // the first segment that failed, empty while all went well
+  bool closed;
+};
+
+#endif
+
+po::options_description frameSinkOptions( FrameSinkOptions &opts )
+{
+  po::options_description desc("Encoding");
+  desc.add_options()
+    ("encoder", po::value<std::string>(&opts.backend)->default_value("auto"), "encoder backend: opencv, libav or auto")
+    ("codec", po::value<std::string>(&opts.codec)->default_value("mpeg4"), "output codec (mpeg4, libx264, mjpeg, ...)")
+    ("encode-threads", po::value<int>(&opts.encode_threads)->default_value(0), "libav encoder threads (0 = one per core)")
+    ("preset", po::value<std::string>(&opts.preset)->default_value(""), "libav encoder preset, e.g. veryfast for libx264")
+    ("bitrate", po::value<int>(&opts.bitrate)->default_value(0), "output bitrate in bits/s (0 = encoder default)")
+    ("encode-queue", po::value<int>(&opts.queue)->default_value(4), "frames queued for the encoder thread (0 = encode on the processing thread)")
+    ("encode-segments", po::value<int>(&opts.segments)->default_value(1), "encode this many segments at once and join them losslessly at the end (libav)")
+    ("segment-frames", po::value<int>(&opts.segment_frames)->default_value(60), "frames per segment of --encode-segments; each starts with a keyframe")
+    ("segment-memory", po::value<int>(&opts.segment_mb)->default_value(512), "MB of frames queued for the segments of --encode-segments together; less makes them wait for each other");
+  return desc;
+}
+
+std::unique_ptr<FrameSink> FrameSink::open( const std::string &fn, double fps, cv::Size size,
+                                            const FrameSinkOptions &opts )
+{
+  if ( opts.backend != "auto" && opts.backend != "opencv" && opts.backend != "libav" )
+    throw std::invalid_argument( "unknown encoder backend: " + opts.backend );
+  if ( opts.segments > 1 )
+  {
+#ifdef HAVE_LIBAV
+    if ( opts.backend == "opencv" )
+      throw std::invalid_argument( "segments are joined with libav, use --encoder libav with --encode-segments" );
+    return std::unique_ptr<FrameSink>(new SegmentedFrameSink(fn, fps, size, opts));
+#else
+    throw std::invalid_argument( "built without libav, segments cannot be joined; use --encode-segments 1" );
+#endif
+  }
+  std::unique_ptr<FrameSink> sink = open_backend(fn, fps, size, opts);
+  if ( opts.queue > 0 )
+    return std::unique_ptr<FrameSink>(new AsyncFrameSink(std::move(sink), opts.queue));
+  return sink;
+}
@@ -0,0 +1,65 @@
+//
+//  frame_sink.h
+//  Footage_Manipulation
+//
+//  Video encoder interface used by the tools, the counterpart of FrameSource.
+//  Encoding runs on a thread of its own behind a short queue, so the tools'
+//  processing never waits for the encoder unless it falls behind. A long
+//  video can also be encoded in fixed-size segments on several encoders at
+//  once, whose files are joined without re-encoding when the sink closes.
+
+#ifndef __frame_sink_h
+#define __frame_sink_h
+
+#include <opencv2/opencv.hpp>
+
+#include <boost/program_options.hpp>
+
+#include <memory>
+#include <string>
+
+struct FrameSinkOptions
+{
+  FrameSinkOptions()
+    : backend("auto"), codec("mpeg4"), encode_threads(0), preset(""), bitrate(0),
+      queue(4), segments(1), segment_frames(60), segment_mb(512) {}
+
+  std::string backend;  // "opencv", "libav" or "auto" (libav when built with it)
+  std::string codec;    // encoder name, e.g. mpeg4, libx264, mjpeg
+  int encode_threads;   // libav encoder threads, 0 = one per core
+  std::string preset;   // libav encoder preset (e.g. x264's "veryfast"), "" = default
+  int bitrate;          // bits per second, 0 = encoder default
+  int queue;            // frames queued for the encoder thread, 0 = encode on the caller's thread
+  int segments;         // segments encoded at once (libav), 1 = one encoder for the whole video
+  int segment_frames;   // frames per segment
+  int segment_mb;       // MB of the frames queued for all segments together
+};
+
+// "Encoding" options group for the tools' command lines.
+boost::program_options::options_description frameSinkOptions( FrameSinkOptions &opts );
+
+class FrameSink
+{
+public:
+  // Opens fn for writing BGR frames of size at fps. Throws on failure,
+  // also from write() and close() when the encoder thread failed.
+  static std::unique_ptr<FrameSink> open( const std::string &fn, double fps, cv::Size size,
+                                          const FrameSinkOptions &opts = FrameSinkOptions() );
+
+  virtual ~FrameSink() {}
+
+  virtual void write( const cv::Mat &frame ) = 0;
+
+  // Finishes the video: waits for the encoder, flushes it and joins the
+  // segments. Throws when any frame could not be encoded; a sink that is
+  // destroyed without close() can only report that on stderr.
+  virtual void close() {}
+
+  FrameSink& operator<<( const cv::Mat &frame )
+  {
+    write(frame);
+    return *this;
+  }
+};
+
+#endif
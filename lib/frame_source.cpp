@@ -0,0 +1,508 @@
+#include "frame_source.h"
+#include "frame_cache.h"
+#include "libav_io.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+namespace po = boost::program_options;
+
+static const size_t FRAME_ALIGN = 64;
+
+// ---------------------------------------------------------------------------
+// FramePool
+
+struct FramePool::Shared
+{
+  struct Buffer
+  {
+    void allocate( cv::Size size, int type );
+
+    std::shared_ptr<uchar> storage; // empty once the slot adopted an OpenCV owned Mat
+    cv::Mat mat;
+  };
+
+  struct Slot
+  {
+    Buffer image, luma;
+  };
+
+  std::mutex mtx;
+  std::condition_variable cond;
+  std::vector<Slot> slots;
+  std::vector<int> free_slots;
+  bool interrupted;
+};
+
+void FramePool::Shared::Buffer::allocate( cv::Size size, int type )
+{
+  if ( size.area() <= 0 )
+    return;
+  size_t step = (size.width * CV_ELEM_SIZE(type) + FRAME_ALIGN - 1) / FRAME_ALIGN * FRAME_ALIGN;
+  storage.reset((uchar*) cv::fastMalloc(step * size.height + FRAME_ALIGN), cv::fastFree);
+  mat = cv::Mat(size, type, cv::alignPtr(storage.get(), (int) FRAME_ALIGN), step);
+}
+
+FramePool::FramePool( int capacity, cv::Size size, int type, bool luma )
+  : shared(std::make_shared<Shared>())
+{
+  shared->interrupted = false;
+  shared->slots.resize(std::max(capacity, 1));
+  for ( size_t i = 0; i < shared->slots.size(); ++i )
+  {
+    Shared::Slot &slot = shared->slots[i];
+    if ( type >= 0 )
+      slot.image.allocate(size, type);
+    if ( luma )
+      slot.luma.allocate(size, CV_8UC1);
+    shared->free_slots.push_back((int) i);
+  }
+}
+
+int FramePool::capacity() const
+{
+  return (int) shared->slots.size();
+}
+
+FramePtr FramePool::acquire()
+{
+  std::shared_ptr<Shared> s = shared;
+  std::unique_lock<std::mutex> lock(s->mtx);
+  s->cond.wait(lock, [&s] { return s->interrupted || !s->free_slots.empty(); });
+  if ( s->interrupted )
+    return FramePtr();
+
+  int slot = s->free_slots.back();
+  s->free_slots.pop_back();
+
+  Frame *frame = new Frame;
+  frame->slot = slot;
+  frame->image = s->slots[slot].image.mat;
+  frame->luma = s->slots[slot].luma.mat;
+  // Returning the slot only needs the shared state, so frames may outlive
+  // the pool and the source they came from.
+  return FramePtr(frame, [s]( Frame *f ) {
+    {
+      std::lock_guard<std::mutex> guard(s->mtx);
+      s->free_slots.push_back(f->slot);
+    }
+    s->cond.notify_one();
+    delete f;
+  });
+}
+
+void FramePool::adopt( const Frame &frame )
+{
+  std::lock_guard<std::mutex> lock(shared->mtx);
+  Shared::Slot &slot = shared->slots[frame.slot];
+  if ( frame.image.data != slot.image.mat.data )
+  {
+    slot.image.storage.reset();
+    slot.image.mat = frame.image;
+  }
+  if ( frame.luma.data != slot.luma.mat.data )
+  {
+    slot.luma.storage.reset();
+    slot.luma.mat = frame.luma;
+  }
+}
+
+void FramePool::interrupt( bool on )
+{
+  {
+    std::lock_guard<std::mutex> lock(shared->mtx);
+    shared->interrupted = on;
+  }
+  shared->cond.notify_all();
+}
+
+// ---------------------------------------------------------------------------
+// OpenCV VideoCapture backend
+
+class CvFrameSource : public FrameSource
+{
+public:
+  CvFrameSource( const std::string &_fn, const FrameSourceOptions &opts )
+    : FrameSource(opts), fn(_fn), capture(_fn)
+  {
+    if ( !capture.isOpened() )
+      throw std::runtime_error( "could not open " + fn );
+    frame_size = cv::Size((int) capture.get(CV_CAP_PROP_FRAME_WIDTH), (int) capture.get(CV_CAP_PROP_FRAME_HEIGHT));
+    frame_rate = capture.get(CV_CAP_PROP_FPS);
+    frame_count = (int) capture.get(CV_CAP_PROP_FRAME_COUNT);
+  }
+
+  ~CvFrameSource()
+  {
+    stop();
+  }
+
+protected:
+  bool decode( cv::Mat *image, cv::Mat *luma )
+  {
+    // VideoCapture only hands out BGR, so luma is converted here, off the
+    // consumer's thread
+    cv::Mat &bgr = image ? *image : scratch;
+    if ( !capture.read(bgr) )
+      return false;
+    if ( luma )
+      cv::cvtColor(bgr, *luma, CV_BGR2GRAY);
+    return true;
+  }
+
+  bool skip()
+  {
+    // decodes without the BGR conversion
+    return capture.grab();
+  }
+
+  bool seekTo( int frame )
+  {
+    return capture.set(CV_CAP_PROP_POS_FRAMES, frame);
+  }
+
+  int countFrames()
+  {
+    // grab() decodes without the colour conversion
+    cv::VideoCapture scan(fn);
+    int n = 0;
+    while ( scan.grab() )
+      n++;
+    return n;
+  }
+
+private:
+  std::string fn;
+  cv::VideoCapture capture;
+  cv::Mat scratch;
+};
+
+// ---------------------------------------------------------------------------
+// Raw packed BGR frames from a file, named pipe or stdin, e.g. a stream
+// converted by "ffmpeg -i <feed> -f rawvideo -pix_fmt bgr24 -"
+
+class RawFrameSource : public FrameSource
+{
+public:
+  RawFrameSource( const std::string &fn, const FrameSourceOptions &opts )
+    : FrameSource(opts), in(NULL), position(0)
+  {
+    if ( opts.raw_size.area() <= 0 )
+      throw std::invalid_argument( "the raw decoder needs --raw-size" );
+    in = fn == "-" ? stdin : std::fopen(fn.c_str(), "rb");
+    if ( !in )
+      throw std::runtime_error( "could not open " + fn );
+    frame_size = opts.raw_size;
+    frame_rate = opts.raw_fps;
+    frame_count = 0;  // not known before the stream ends
+  }
+
+  ~RawFrameSource()
+  {
+    stop();
+    if ( in != stdin )
+      std::fclose(in);
+  }
+
+protected:
+  bool decode( cv::Mat *image, cv::Mat *luma )
+  {
+    cv::Mat &bgr = image ? *image : scratch;
+    bgr.create(frame_size, CV_8UC3);
+    size_t row = frame_size.width * 3;
+    for ( int y = 0; y < bgr.rows; ++y )
+    {
+      if ( std::fread(bgr.ptr(y), 1, row, in) != row )
+        return false;
+    }
+    if ( luma )
+      cv::cvtColor(bgr, *luma, CV_BGR2GRAY);
+    position++;
+    return true;
+  }
+
+  bool seekTo( int frame )
+  {
+    // a pipe only goes forward
+    while ( position < frame && decode(NULL, NULL) )
+      ;
+    return position == frame;
+  }
+
+  int countFrames()
+  {
+    return frame_count;
+  }
+
+private:
+  std::FILE *in;
+  int position;
+  cv::Mat scratch;
+};
+
+// ---------------------------------------------------------------------------
+// FrameSource
+
+po::options_description frameSourceOptions( FrameSourceOptions &opts )
+{
+  po::options_description desc("Decoding");
+  desc.add_options()
+    ("decoder", po::value<std::string>(&opts.backend)->default_value("auto"), "decoder backend: opencv, libav, raw (packed BGR frames, - for stdin) or auto")
+    ("decode-threads", po::value<int>(&opts.decode_threads)->default_value(0), "libav decoder threads (0 = one per core)")
+    ("prefetch", po::value<int>(&opts.prefetch)->default_value(8), "number of frames decoded ahead")
+    ("exact-count", po::bool_switch(&opts.exact_count), "count the frames by scanning the video instead of trusting the container")
+    ("frame-cache", po::value<std::string>(&opts.cache_dir)->default_value(""), "keep decoded frames in this scratch directory, so later passes and runs read them instead of decoding")
+    ("frame-cache-size", po::value<size_t>(&opts.cache_mb)->default_value(4096), "size cap of the frame cache of a video, in MB; least recently used frames are evicted")
+    ("seek-gap", po::value<int>(&opts.seek_gap)->default_value(60), "frames the decoder decodes through instead of seeking when the next uncached frame is ahead of it; about the keyframe interval")
+    ("raw-size", po::value<std::string>()->notifier([&opts]( const std::string &s ) {
+        std::istringstream in(s);
+        int w = 0, h = 0;
+        char x = 0;
+        if ( !(in >> w >> x >> h) || x != 'x' || w <= 0 || h <= 0 )
+          throw po::error( "--raw-size must be WIDTHxHEIGHT, not " + s );
+        opts.raw_size = cv::Size(w, h);
+      }), "frame size of --decoder raw, WIDTHxHEIGHT")
+    ("raw-fps", po::value<double>(&opts.raw_fps)->default_value(30), "frame rate of --decoder raw");
+  return desc;
+}
+
+std::unique_ptr<FrameSource> FrameSource::create( const std::string &fn, const FrameSourceOptions &opts )
+{
+  if ( opts.backend != "auto" && opts.backend != "opencv" && opts.backend != "libav" && opts.backend != "raw" )
+    throw std::invalid_argument( "unknown decoder backend: " + opts.backend );
+  if ( opts.backend == "raw" )
+    return std::unique_ptr<FrameSource>(new RawFrameSource(fn, opts));
+#ifdef HAVE_LIBAV
+  if ( opts.backend != "opencv" )
+    return createLibavSource(fn, opts);
+#else
+  if ( opts.backend == "libav" )
+    throw std::invalid_argument( "built without libav, use --decoder opencv" );
+#endif
+  return std::unique_ptr<FrameSource>(new CvFrameSource(fn, opts));
+}
+
+int FrameSource::probeFrameCount( const std::string &fn, bool exact, const std::string &backend )
+{
+  FrameSourceOptions opts;
+  opts.backend = backend;
+  std::unique_ptr<FrameSource> source = create(fn, opts);
+  return exact ? source->countFrames() : source->frameCount();
+}
+
+void FrameSource::probe( const std::string &fn, const FrameSourceOptions &opts, int &frame_count, cv::Size &size )
+{
+  std::unique_ptr<FrameSource> source = create(fn, opts);
+  frame_count = source->frameCount();
+  size = source->size();
+}
+
+std::unique_ptr<FrameSource> FrameSource::open( const std::string &fn, const FrameSourceOptions &opts )
+{
+  std::unique_ptr<FrameSource> source = create(fn, opts);
+  if ( opts.exact_count )
+    source->frame_count = source->countFrames();
+  if ( !opts.cache_dir.empty() && !opts.live )
+    source->openCache(fn);
+  // the decoder thread seeks to start_frame unless it is cached
+  source->start();
+  return source;
+}
+
+void FrameSource::openCache( const std::string &fn )
+{
+  // the cap is shared in proportion to the planes' sizes
+  size_t cap = opts.cache_mb << 20;
+  if ( opts.color )
+    image_cache.reset(new FrameCache(opts.cache_dir, fn, "bgr", frame_size, CV_8UC3,
+                                     opts.luma ? cap / 4 * 3 : cap));
+  if ( opts.luma )
+    luma_cache.reset(new FrameCache(opts.cache_dir, fn, "y", frame_size, CV_8UC1,
+                                    opts.color ? cap / 4 : cap));
+}
+
+FramePtr FrameSource::cachedFrame( int index )
+{
+  std::shared_ptr<void> image_pin, luma_pin;
+  cv::Mat image, luma;
+  if ( image_cache && (image = image_cache->get(index, image_pin)).empty() )
+    return FramePtr();
+  if ( luma_cache && (luma = luma_cache->get(index, luma_pin)).empty() )
+    return FramePtr();
+
+  FramePtr frame = std::make_shared<Frame>();
+  frame->image = image;
+  frame->luma = luma;
+  frame->pins.push_back(image_pin);
+  frame->pins.push_back(luma_pin);
+  return frame;
+}
+
+FrameSource::FrameSource( const FrameSourceOptions &_opts )
+  : opts(_opts), frame_rate(0), frame_count(0), dropped_frames(0),
+    decoder_index(0), next_index(_opts.start_frame), finished(false), stopping(false)
+{
+  if ( !opts.color && !opts.luma )
+    throw std::invalid_argument( "the frame source has to decode colour, luma or both" );
+  opts.prefetch = std::max(opts.prefetch, 1);
+  if ( opts.buffers <= 0 )
+    opts.buffers = opts.prefetch + 4;
+}
+
+FrameSource::~FrameSource()
+{
+  stop();
+}
+
+void FrameSource::start()
+{
+  if ( !pool )
+    pool.reset(new FramePool(opts.buffers, frame_size, opts.color ? CV_8UC3 : -1, opts.luma));
+  pool->interrupt(false);
+  stopping = false;
+  finished = false;
+  error = std::exception_ptr();
+  decoder = std::thread(&FrameSource::run, this);
+}
+
+void FrameSource::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = true;
+  }
+  cond.notify_all();
+  if ( pool )
+    pool->interrupt(true);
+  if ( decoder.joinable() )
+    decoder.join();
+  queue.clear();
+}
+
+void FrameSource::seek( int frame )
+{
+  stop();
+  next_index = frame;
+  start();
+}
+
+void FrameSource::run()
+{
+  traceThreadName("decoder");
+  try
+  {
+    while ( true )
+    {
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cond.wait(lock, [this] { return stopping || opts.live || (int) queue.size() < opts.prefetch; });
+        if ( stopping )
+          return;
+      }
+      if ( opts.end_frame >= 0 && next_index >= opts.end_frame )
+        break;
+
+      FramePtr frame = (image_cache || luma_cache) && !opts.motion_vectors ? cachedFrame(next_index) : FramePtr();
+      if ( !frame )
+      {
+        frame = pool->acquire();
+        if ( !frame )
+          return;
+
+        // A seek lands on the keyframe before the target and decodes on from
+        // there, so a miss shortly after cached frames is quicker reached by
+        // decoding on; backward jumps and long gaps seek.
+        if ( decoder_index < next_index && next_index - decoder_index <= opts.seek_gap )
+        {
+          TRACE_SCOPE("skip");
+          while ( decoder_index < next_index && skip() )
+            decoder_index++;
+        }
+        if ( decoder_index != next_index )
+        {
+          TRACE_SCOPE("seek");
+          seekTo(next_index);
+          decoder_index = next_index;
+        }
+        cv::Mat image = frame->image, luma = frame->luma;
+        bool decoded;
+        {
+          TRACE_SCOPE("decode");
+          decoded = decode(opts.color ? &image : NULL, opts.luma ? &luma : NULL);
+        }
+        if ( !decoded )
+        {
+          // a full read tells us the real length of the video
+          if ( opts.end_frame < 0 )
+            frame_count = next_index;
+          break;
+        }
+        decoder_index++;
+        if ( opts.motion_vectors )
+          motionVectors(frame->vectors);
+        if ( image.data != frame->image.data || luma.data != frame->luma.data )
+        {
+          frame->image = image;
+          frame->luma = luma;
+          pool->adopt(*frame);
+        }
+        if ( image_cache )
+          image_cache->put(next_index, image);
+        if ( luma_cache )
+          luma_cache->put(next_index, luma);
+      }
+      frame->index = next_index++;
+      frame->arrival = cv::getTickCount();
+
+      // a live source keeps the newest frames, the oldest one's buffer goes
+      // back to the pool
+      FramePtr dropped;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        if ( opts.live && (int) queue.size() >= opts.prefetch )
+        {
+          dropped = queue.front();
+          queue.pop_front();
+          dropped_frames++;
+        }
+        queue.push_back(frame);
+      }
+      cond.notify_all();
+    }
+  }
+  catch ( ... )
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    error = std::current_exception();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    finished = true;
+  }
+  cond.notify_all();
+}
+
+FramePtr FrameSource::next()
+{
+  // time the consumer spends waiting for the decoder
+  TRACE_SCOPE("decode_wait");
+  std::unique_lock<std::mutex> lock(mtx);
+  cond.wait(lock, [this] { return finished || !queue.empty(); });
+  if ( queue.empty() )
+  {
+    if ( error )
+      std::rethrow_exception(error);
+    return FramePtr();
+  }
+  FramePtr frame = queue.front();
+  queue.pop_front();
+  lock.unlock();
+  cond.notify_all();
+  return frame;
+}
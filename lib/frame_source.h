@@ -0,0 +1,189 @@
+//
+//  frame_source.h
+//  Footage_Manipulation
+//
+//  Prefetching video decoder shared by the tools. Frames are decoded on a
+//  background thread into a fixed pool of preallocated buffers; a buffer
+//  returns to the pool once the last FramePtr referring to it is released,
+//  so steady state decoding never allocates. A live source (a stream, a
+//  named pipe, or raw frames from stdin) never waits for the consumer: it
+//  drops the oldest undelivered frame instead.
+
+#ifndef __frame_source_h
+#define __frame_source_h
+
+#include <opencv2/opencv.hpp>
+
+#include <boost/program_options.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class FrameCache;
+
+// Motion vectors the codec coded for a frame, per block: the block's centre
+// in the frame and where it came from in the previous frame. Vectors that
+// reach further back are scaled down to one frame.
+struct MotionVectors
+{
+  std::vector<cv::Point2f> from, to;
+};
+
+// A decoded frame. The pixels live in a pool buffer that is reused once the
+// frame is released, so treat image as read-only and clone() anything that
+// has to outlive the FramePtr.
+struct Frame
+{
+  Frame() : index(-1), slot(-1), arrival(0) {}
+  int index;      // frame number in the video
+  cv::Mat image;  // BGR pixels, empty without FrameSourceOptions::color
+  cv::Mat luma;   // grey (CV_8UC1) for motion analysis, with FrameSourceOptions::luma
+  int slot;       // pool buffer, owned by FramePool; -1 for cached frames
+  int64 arrival;  // cv::getTickCount() when the decoder delivered the frame
+  MotionVectors vectors;  // with FrameSourceOptions::motion_vectors, libav only
+  std::vector<std::shared_ptr<void> > pins;  // keep cached pixels mapped
+};
+
+typedef std::shared_ptr<Frame> FramePtr;
+
+class FramePool
+{
+public:
+  // Preallocates capacity buffers of size/type (none for type < 0) and,
+  // with luma, CV_8UC1 luma buffers, all with 64 byte aligned rows.
+  FramePool( int capacity, cv::Size size, int type, bool luma = false );
+
+  // Blocks until a buffer is free; returns nullptr once interrupted.
+  FramePtr acquire();
+
+  // Makes the frame's current image and luma the buffers of its slot, used
+  // when the decoder had to reallocate (e.g. the video reported a wrong size).
+  void adopt( const Frame &frame );
+
+  // Wakes up and fails blocked and future acquire() calls until cleared.
+  void interrupt( bool on );
+
+  int capacity() const;
+
+private:
+  struct Shared;
+  std::shared_ptr<Shared> shared;
+};
+
+struct FrameSourceOptions
+{
+  FrameSourceOptions()
+    : prefetch(8), buffers(0), start_frame(0), end_frame(-1), exact_count(false),
+      backend("auto"), decode_threads(0), color(true), luma(false), cache_mb(4096),
+      seek_gap(60), live(false), raw_fps(30), motion_vectors(false) {}
+
+  int prefetch;         // frames decoded ahead of the consumer
+  int buffers;          // pool size, 0 = prefetch + 4 (frames the consumer may hold)
+  int start_frame;      // first frame returned
+  int end_frame;        // one past the last frame returned, -1 = end of video
+  bool exact_count;     // count the frames by scanning the stream once at open
+  std::string backend;  // "opencv", "libav", "raw" or "auto" (libav when built with it)
+  int decode_threads;   // libav frame+slice decoding threads, 0 = one per core
+  bool color;           // decode BGR pixels into Frame::image
+  bool luma;            // fill Frame::luma: the Y plane straight from the libav
+                        // decoder (as coded, usually 16-235), grey converted on
+                        // the decoder thread with OpenCV
+  std::string cache_dir;  // decoded frame cache (see FrameCache), "" = none
+  size_t cache_mb;        // size cap of the frame cache of one video
+  int seek_gap;           // frames the decoder skips by decoding rather than
+                          // seeking, when a cache miss lies ahead of it
+  bool live;              // drop the oldest prefetched frame rather than wait
+                          // for the consumer; no frame cache
+  cv::Size raw_size;      // frame size of the "raw" backend (packed BGR, "-" = stdin)
+  double raw_fps;         // frame rate of the "raw" backend
+  bool motion_vectors;    // fill Frame::vectors; cached frames have none, so
+                          // the frame cache is only written
+};
+
+// "Decoding" options group for the tools' command lines.
+boost::program_options::options_description frameSourceOptions( FrameSourceOptions &opts );
+
+class FrameSource
+{
+public:
+  // Opens fn and starts decoding at opts.start_frame. Throws on failure.
+  static std::unique_ptr<FrameSource> open( const std::string &fn,
+                                            const FrameSourceOptions &opts = FrameSourceOptions() );
+
+  // Frame count of fn without starting a decoder (see frameCount()).
+  static int probeFrameCount( const std::string &fn, bool exact, const std::string &backend = "auto" );
+
+  // Frame count (the container's estimate) and frame size of fn as open()
+  // with opts would find them, without starting a decoder or a cache.
+  static void probe( const std::string &fn, const FrameSourceOptions &opts, int &frame_count, cv::Size &size );
+
+  virtual ~FrameSource();
+
+  // Next frame of the range, nullptr at the end.
+  FramePtr next();
+
+  // Restarts decoding at frame; the end of the range is kept. Frames in the
+  // frame cache are read from it without seeking the decoder.
+  void seek( int frame );
+
+  // Frames in the whole video: exact when counted (exact_count or after the
+  // decoder ran into the end of the video), the container's estimate otherwise.
+  int frameCount() const { return frame_count; }
+  double fps() const { return frame_rate; }
+  cv::Size size() const { return frame_size; }
+
+  // Frames a live source dropped because the consumer fell behind.
+  int dropped() const { return dropped_frames; }
+
+protected:
+  explicit FrameSource( const FrameSourceOptions &opts );
+
+  // Allocates the pool and starts the decoder thread; called by open() once
+  // the backend knows the frame size.
+  void start();
+  void stop();
+
+  // Backend interface, only ever called from one thread at a time. Backends
+  // must call stop() in their destructor, before their state goes away.
+  virtual bool decode( cv::Mat *image, cv::Mat *luma ) = 0;  // next frame into the non-NULL ones
+  virtual bool seekTo( int frame ) = 0;                       // next decode() returns frame
+  virtual int countFrames() = 0;                              // exact count, may be slow
+  // Goes past the next frame without handing it out, as cheaply as the
+  // backend can; decode(NULL, NULL) by default.
+  virtual bool skip() { return decode(NULL, NULL); }
+  // Motion vectors of the frame the last decode() returned; none by default.
+  virtual void motionVectors( MotionVectors &vectors ) { vectors = MotionVectors(); }
+
+  FrameSourceOptions opts;
+  cv::Size frame_size;
+  double frame_rate;
+  std::atomic<int> frame_count;
+  std::atomic<int> dropped_frames;
+
+private:
+  static std::unique_ptr<FrameSource> create( const std::string &fn, const FrameSourceOptions &opts );
+  void openCache( const std::string &fn );
+  FramePtr cachedFrame( int index );
+  void run();
+
+  std::unique_ptr<FramePool> pool;
+  std::thread decoder;
+  std::mutex mtx;
+  std::condition_variable cond;
+  std::deque<FramePtr> queue;
+  std::unique_ptr<FrameCache> image_cache, luma_cache;
+  int decoder_index;  // frame the backend decodes next
+  int next_index;
+  bool finished;
+  bool stopping;
+  std::exception_ptr error;
+};
+
+#endif
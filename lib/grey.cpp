@@ -0,0 +1,117 @@
+#include "grey.h"
+#include "trace.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+
+// cv::cvtColor's BGR2GRAY weights, in 14 bit fixed point
+const int GREY_SHIFT = 14;
+const uint64_t W_B = 1868, W_G = 9617, W_R = 4899;
+
+// Largest divisor of n that is at most limit, so the blocks tile n exactly
+// and the block averages keep the geometry of an area resize.
+int block_factor( int n, int limit )
+{
+  for ( int f = std::max(limit, 1); f > 1; --f )
+    if ( n % f == 0 )
+      return f;
+  return 1;
+}
+
+// Averages the fx x fy blocks of src into dst (CV_8UC1 of src's size / f).
+// The rows of a block are summed per byte into colsum, a plain loop over
+// contiguous memory that the compiler vectorizes; the columns of the block
+// and the grey weights are then applied once per output pixel.
+void box_grey( const cv::Mat &src, cv::Mat &dst, int fx, int fy )
+{
+  const int cn = src.channels();
+  const int row_len = dst.cols * fx * cn;
+  const uint64_t area = (uint64_t) fx * fy;
+  const uint64_t div = cn == 3 ? area << GREY_SHIFT : area;
+  std::vector<uint32_t> colsum(row_len);
+  uint32_t *acc = &colsum[0];
+
+  for ( int y = 0; y < dst.rows; ++y )
+  {
+    std::fill(colsum.begin(), colsum.end(), 0);
+    for ( int r = 0; r < fy; ++r )
+    {
+      const uchar *s = src.ptr<uchar>(y * fy + r);
+      for ( int i = 0; i < row_len; ++i )
+        acc[i] += s[i];
+    }
+
+    uchar *d = dst.ptr<uchar>(y);
+    const uint32_t *p = acc;
+    if ( cn == 3 )
+    {
+      for ( int x = 0; x < dst.cols; ++x )
+      {
+        uint64_t b = 0, g = 0, r = 0;
+        for ( int k = 0; k < fx; ++k, p += 3 )
+        {
+          b += p[0];
+          g += p[1];
+          r += p[2];
+        }
+        d[x] = (uchar)((b * W_B + g * W_G + r * W_R + div / 2) / div);
+      }
+    }
+    else
+    {
+      for ( int x = 0; x < dst.cols; ++x )
+      {
+        uint64_t v = 0;
+        for ( int k = 0; k < fx; ++k )
+          v += *p++;
+        d[x] = (uchar)((v + div / 2) / div);
+      }
+    }
+  }
+}
+
+}
+
+cv::Size scaledSize( cv::Size sz, double scale )
+{
+  scale = std::min(scale, 1.);
+  return cv::Size(std::max(cvRound(sz.width * scale), 1), std::max(cvRound(sz.height * scale), 1));
+}
+
+void greyDownscale( const cv::Mat &src_, cv::Mat &dst, cv::Size dsize )
+{
+  CV_Assert( src_.depth() == CV_8U && (src_.channels() == 1 || src_.channels() == 3) );
+  CV_Assert( dsize.width > 0 && dsize.height > 0 && dsize.width <= src_.cols && dsize.height <= src_.rows );
+  TRACE_SCOPE("grey_downscale");
+  // keeps the pixels alive should dst be src
+  cv::Mat src = src_;
+
+  if ( dsize == src.size() )
+  {
+    if ( src.channels() == 1 )
+      src.copyTo(dst);
+    else
+      cv::cvtColor(src, dst, CV_BGR2GRAY);
+    return;
+  }
+
+  int fx = block_factor(src.cols, src.cols / dsize.width);
+  int fy = block_factor(src.rows, src.rows / dsize.height);
+  cv::Size blocks(src.cols / fx, src.rows / fy);
+  if ( blocks == dsize )
+  {
+    dst.create(dsize, CV_8UC1);
+    box_grey(src, dst, fx, fy);
+  }
+  else
+  {
+    // the remaining non-integer factor works on the far smaller block image
+    cv::Mat averaged(blocks, CV_8UC1);
+    box_grey(src, averaged, fx, fy);
+    cv::resize(averaged, dst, dsize, 0, 0, cv::INTER_AREA);
+  }
+}
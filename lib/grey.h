@@ -0,0 +1,25 @@
+//
+//  grey.h
+//  Footage_Manipulation
+//
+//  Grey images for motion analysis. Tracking only needs luminance at a
+//  modest resolution, so instead of converting the full frame to grey and
+//  then resizing it, greyDownscale() reads every source pixel once and sums
+//  the colour channels of each block, weighting them into grey only once
+//  per output pixel.
+
+#ifndef __grey_h
+#define __grey_h
+
+#include <opencv2/opencv.hpp>
+
+// Grey of src (CV_8UC3 BGR, with the weights of cv::cvtColor BGR2GRAY, or
+// CV_8UC1 already grey/luma) area-averaged down to dsize, which must not be
+// larger than src. Integer factors take one pass over src; any remainder is
+// resized from the block averages with INTER_AREA.
+void greyDownscale( const cv::Mat &src, cv::Mat &dst, cv::Size dsize );
+
+// dsize for scaling sz by scale (0 < scale <= 1), rounded as cv::resize does.
+cv::Size scaledSize( cv::Size sz, double scale );
+
+#endif
@@ -0,0 +1,292 @@
+#include "lens.h"
+
+// Boost includes
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// General C++ includes
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <unistd.h>
+
+namespace fs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+static const char MAP_MAGIC[8] = { 'F', 'M', 'U', 'N', 'D', 'M', 'A', 'P' };
+static const uint32_t MAP_VERSION = 1;
+static const size_t MAP_ALIGN = 64;
+
+struct MapFileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t key;
+  int32_t width;
+  int32_t height;
+  int32_t interpolation;
+  int32_t map1_type;
+  int32_t map2_type;
+  int32_t reserved;
+  uint64_t map1_offset;
+  uint64_t map1_step;
+  uint64_t map2_offset;
+  uint64_t map2_step;
+};
+
+static uint64_t fnv1a( uint64_t h, const void *data, size_t len )
+{
+  const unsigned char *p = static_cast<const unsigned char*>(data);
+  for ( size_t i = 0; i < len; ++i )
+  {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static uint64_t align_up( uint64_t v )
+{
+  return (v + MAP_ALIGN - 1) / MAP_ALIGN * MAP_ALIGN;
+}
+
+bool readCalibration( const std::string &calib_fn, cv::Mat &intrinsic, cv::Mat &distcoeffs )
+{
+  cv::FileStorage fs(calib_fn, cv::FileStorage::READ);
+  if ( !fs.isOpened() )
+    return false;
+
+  fs["intrinsic"] >> intrinsic;
+  fs["distcoeffs"] >> distcoeffs;
+  return !intrinsic.empty() && !distcoeffs.empty();
+}
+
+uint64_t undistortMapKey( const cv::Mat &intrinsic, const cv::Mat &distcoeffs,
+                          cv::Size size, int interpolation )
+{
+  cv::Mat K, D;
+  intrinsic.convertTo(K, CV_64F);
+  distcoeffs.convertTo(D, CV_64F);
+  K = K.reshape(1, 1).clone();
+  D = D.reshape(1, 1).clone();
+
+  uint64_t h = 14695981039346656037ULL;
+  h = fnv1a(h, MAP_MAGIC, sizeof(MAP_MAGIC));
+  h = fnv1a(h, &MAP_VERSION, sizeof(MAP_VERSION));
+  int32_t dims[4] = { size.width, size.height, interpolation, (int32_t) D.total() };
+  h = fnv1a(h, dims, sizeof(dims));
+  h = fnv1a(h, K.ptr<double>(), K.total() * sizeof(double));
+  h = fnv1a(h, D.ptr<double>(), D.total() * sizeof(double));
+  return h;
+}
+
+std::string defaultMapCacheDir()
+{
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  if ( xdg && *xdg )
+    return std::string(xdg) + "/footage-manipulation";
+  const char *home = getenv("HOME");
+  if ( home && *home )
+    return std::string(home) + "/.cache/footage-manipulation";
+  return "";
+}
+
+int parseInterpolation( const std::string &name )
+{
+  if ( name == "nearest" )
+    return cv::INTER_NEAREST;
+  if ( name == "linear" )
+    return cv::INTER_LINEAR;
+  if ( name == "cubic" )
+    return cv::INTER_CUBIC;
+  if ( name == "lanczos" )
+    return cv::INTER_LANCZOS4;
+  throw std::invalid_argument( "unknown interpolation mode: " + name );
+}
+
+static std::string cache_path( const std::string &cache_dir, uint64_t key )
+{
+  char name[64];
+  snprintf(name, sizeof(name), "undistort-%016llx.map", (unsigned long long) key);
+  return (fs::path(cache_dir) / name).string();
+}
+
+// Holds the file mapping and the mapped region for the lifetime of the maps.
+struct MappedCacheFile
+{
+  explicit MappedCacheFile( const char *path )
+    : file(path, bip::read_only), region(file, bip::read_only) {}
+
+  bip::file_mapping file;
+  bip::mapped_region region;
+};
+
+static bool map_cache_file( const std::string &path, uint64_t key, cv::Size size,
+                            int interpolation, UndistortMaps &maps )
+{
+  if ( !fs::exists(path) )
+    return false;
+
+  try
+  {
+    std::shared_ptr<MappedCacheFile> mapped = std::make_shared<MappedCacheFile>(path.c_str());
+
+    const char *base = static_cast<const char*>(mapped->region.get_address());
+    size_t file_size = mapped->region.get_size();
+    if ( file_size < sizeof(MapFileHeader) )
+      return false;
+
+    MapFileHeader hdr;
+    memcpy(&hdr, base, sizeof(hdr));
+    if ( memcmp(hdr.magic, MAP_MAGIC, sizeof(MAP_MAGIC)) != 0 || hdr.version != MAP_VERSION ||
+         hdr.header_size != sizeof(MapFileHeader) || hdr.key != key ||
+         hdr.width != size.width || hdr.height != size.height ||
+         hdr.interpolation != interpolation ||
+         hdr.map1_type != CV_16SC2 || hdr.map2_type != CV_16UC1 )
+      return false;
+
+    if ( hdr.map1_offset + hdr.map1_step * size.height > file_size ||
+         hdr.map2_offset + hdr.map2_step * size.height > file_size )
+      return false;
+
+    // cv::remap never writes to its maps, so wrapping the read-only pages is safe.
+    char *data = const_cast<char*>(base);
+    maps.map1 = cv::Mat(size, CV_16SC2, data + hdr.map1_offset, hdr.map1_step);
+    maps.map2 = cv::Mat(size, CV_16UC1, data + hdr.map2_offset, hdr.map2_step);
+    maps.backing = mapped;
+    return true;
+  }
+  catch ( bip::interprocess_exception &e )
+  {
+    std::cerr << "Could not map undistortion cache " << path << ": " << e.what() << std::endl;
+    return false;
+  }
+}
+
+static void write_cache_file( const std::string &path, uint64_t key, const UndistortMaps &maps )
+{
+  MapFileHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, MAP_MAGIC, sizeof(MAP_MAGIC));
+  hdr.version = MAP_VERSION;
+  hdr.header_size = sizeof(MapFileHeader);
+  hdr.key = key;
+  hdr.width = maps.size.width;
+  hdr.height = maps.size.height;
+  hdr.interpolation = maps.interpolation;
+  hdr.map1_type = maps.map1.type();
+  hdr.map2_type = maps.map2.type();
+  hdr.map1_step = maps.map1.cols * maps.map1.elemSize();
+  hdr.map2_step = maps.map2.cols * maps.map2.elemSize();
+  hdr.map1_offset = align_up(sizeof(MapFileHeader));
+  hdr.map2_offset = align_up(hdr.map1_offset + hdr.map1_step * maps.size.height);
+
+  // Write to a private temporary file and rename it into place so that
+  // concurrent runs never see a partially written cache file.
+  std::string tmp = path + ".tmp." + std::to_string((long long) getpid());
+  {
+    std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+    if ( !out )
+    {
+      std::cerr << "Could not write undistortion cache " << tmp << std::endl;
+      return;
+    }
+    out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+
+    const cv::Mat *mats[2] = { &maps.map1, &maps.map2 };
+    const uint64_t offsets[2] = { hdr.map1_offset, hdr.map2_offset };
+    for ( int m = 0; m < 2; ++m )
+    {
+      std::vector<char> pad(offsets[m] - (uint64_t) out.tellp(), 0);
+      out.write(pad.data(), pad.size());
+      size_t row_bytes = mats[m]->cols * mats[m]->elemSize();
+      for ( int r = 0; r < mats[m]->rows; ++r )
+        out.write(mats[m]->ptr<char>(r), row_bytes);
+    }
+    if ( !out )
+    {
+      std::cerr << "Could not write undistortion cache " << tmp << std::endl;
+      out.close();
+      boost::system::error_code ec;
+      fs::remove(tmp, ec);
+      return;
+    }
+  }
+
+  boost::system::error_code ec;
+  fs::rename(tmp, path, ec);
+  if ( ec )
+  {
+    std::cerr << "Could not install undistortion cache " << path << ": " << ec.message() << std::endl;
+    fs::remove(tmp, ec);
+  }
+}
+
+UndistortMaps loadUndistortMaps( const cv::Mat &intrinsic, const cv::Mat &distcoeffs,
+                                 cv::Size size, int interpolation,
+                                 const std::string &cache_dir )
+{
+  UndistortMaps maps;
+  maps.size = size;
+  maps.interpolation = interpolation;
+  maps.from_cache = false;
+
+  uint64_t key = undistortMapKey(intrinsic, distcoeffs, size, interpolation);
+  std::string path;
+  if ( !cache_dir.empty() )
+  {
+    path = cache_path(cache_dir, key);
+    if ( map_cache_file(path, key, size, interpolation, maps) )
+    {
+      maps.from_cache = true;
+      return maps;
+    }
+  }
+
+  cv::initUndistortRectifyMap(intrinsic, distcoeffs, cv::Mat(), intrinsic, size,
+                              CV_16SC2, maps.map1, maps.map2);
+
+  if ( !path.empty() )
+  {
+    boost::system::error_code ec;
+    fs::create_directories(cache_dir, ec);
+    if ( ec )
+      std::cerr << "Could not create undistortion cache directory " << cache_dir << ": " << ec.message() << std::endl;
+    else
+      write_cache_file(path, key, maps);
+  }
+  return maps;
+}
+
+cv::Mat undistortFloatMap( const UndistortMaps &maps )
+{
+  cv::Mat float_map, unused;
+  cv::convertMaps(maps.map1, maps.map2, float_map, unused, CV_32FC2);
+  return float_map;
+}
+
+void undistortPixelPoints( const std::vector<cv::Point2f> &src, std::vector<cv::Point2f> &dst,
+                           const cv::Mat &intrinsic, const cv::Mat &distcoeffs )
+{
+  if ( src.empty() )
+  {
+    dst.clear();
+    return;
+  }
+  cv::undistortPoints(src, dst, intrinsic, distcoeffs, cv::noArray(), intrinsic);
+}
+
+void composeUndistortAffine( const cv::Mat &float_map, const cv::Mat &A, cv::Size out_size,
+                             cv::Mat &composed )
+{
+  // The lens map is smooth, so bilinearly resampling it at A*p is as good as
+  // evaluating the distortion model there, and a lot cheaper.
+  cv::warpAffine(float_map, composed, A, out_size, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP,
+                 cv::BORDER_CONSTANT, cv::Scalar(-1, -1));
+}
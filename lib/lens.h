@@ -0,0 +1,71 @@
+//
+//  lens.h
+//  Footage_Manipulation
+//
+//  Lens undistortion maps built from the calibration produced by
+//  tools/calibrate, with an on-disk cache so the remap tables are only
+//  computed once per (calibration, resolution, interpolation).
+
+#ifndef __lens_h
+#define __lens_h
+
+#include <opencv2/opencv.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Fixed point remap tables (CV_16SC2 + CV_16UC1) for cv::remap. When the
+// maps come from the cache, map1/map2 point straight into a read-only
+// memory mapping of the cache file which `backing` keeps alive.
+struct UndistortMaps
+{
+  cv::Mat map1;
+  cv::Mat map2;
+  cv::Size size;
+  int interpolation;
+  bool from_cache;
+  std::shared_ptr<void> backing;
+};
+
+// Reads the "intrinsic" and "distcoeffs" nodes written by tools/calibrate.
+bool readCalibration( const std::string &calib_fn, cv::Mat &intrinsic, cv::Mat &distcoeffs );
+
+// Hash of everything the remap tables depend on.
+uint64_t undistortMapKey( const cv::Mat &intrinsic, const cv::Mat &distcoeffs,
+                          cv::Size size, int interpolation );
+
+// Default cache location: $XDG_CACHE_HOME/footage-manipulation or
+// ~/.cache/footage-manipulation.
+std::string defaultMapCacheDir();
+
+// Returns the undistortion maps for frames of `size`. If cache_dir is not
+// empty the maps are memory-mapped from cache_dir when a matching cache
+// file exists, and written there otherwise. Cache failures are not fatal:
+// the maps are then simply built in memory.
+UndistortMaps loadUndistortMaps( const cv::Mat &intrinsic, const cv::Mat &distcoeffs,
+                                 cv::Size size, int interpolation,
+                                 const std::string &cache_dir );
+
+// Float version (CV_32FC2) of the maps: for every pixel of the undistorted
+// image, the position of that pixel in the distorted frame.
+cv::Mat undistortFloatMap( const UndistortMaps &maps );
+
+// Maps distorted pixel coordinates to pixel coordinates in the undistorted
+// image (the camera matrix is kept, as in tools/undistort).
+void undistortPixelPoints( const std::vector<cv::Point2f> &src, std::vector<cv::Point2f> &dst,
+                           const cv::Mat &intrinsic, const cv::Mat &distcoeffs );
+
+// Builds the remap table that renders an output frame of out_size straight
+// from the distorted frame: an output pixel p is taken from the undistorted
+// position A*p (A is 2x3, output to undistorted) and then pushed through the
+// lens model in float_map. Positions outside the frame get (-1,-1) so that
+// cv::remap treats them as border.
+void composeUndistortAffine( const cv::Mat &float_map, const cv::Mat &A, cv::Size out_size,
+                             cv::Mat &composed );
+
+// Parses "nearest", "linear", "cubic" or "lanczos" into a cv::INTER_* flag.
+int parseInterpolation( const std::string &name );
+
+#endif
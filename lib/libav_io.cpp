@@ -0,0 +1,512 @@
+#include "libav_io.h"
+#include "trace.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/motion_vector.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+static std::string av_error( int err )
+{
+  char buf[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+  av_strerror(err, buf, sizeof(buf));
+  return buf;
+}
+
+static void check( int err, const std::string &what )
+{
+  if ( err < 0 )
+    throw std::runtime_error( what + ": " + av_error(err) );
+}
+
+static int resolve_threads( int requested )
+{
+  if ( requested > 0 )
+    return requested;
+  int hw = (int) std::thread::hardware_concurrency();
+  return hw > 0 ? hw : 1;
+}
+
+// ---------------------------------------------------------------------------
+// Decoder
+
+class LibavFrameSource : public FrameSource
+{
+public:
+  LibavFrameSource( const std::string &_fn, const FrameSourceOptions &opts )
+    : FrameSource(opts), fn(_fn), fmt(NULL), ctx(NULL), sws(NULL), grey_sws(NULL), packet(NULL), frame(NULL),
+      stream_index(-1), flushing(false), skip_until(AV_NOPTS_VALUE), position(0), last_reference(-1)
+  {
+    try
+    {
+      check(avformat_open_input(&fmt, fn.c_str(), NULL, NULL), "could not open " + fn);
+      check(avformat_find_stream_info(fmt, NULL), "could not read stream info of " + fn);
+      stream_index = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+      check(stream_index, "no video stream in " + fn);
+      AVStream *st = fmt->streams[stream_index];
+
+      const AVCodec *codec = avcodec_find_decoder(st->codecpar->codec_id);
+      if ( !codec )
+        throw std::runtime_error( "no decoder for " + fn );
+      ctx = avcodec_alloc_context3(codec);
+      check(avcodec_parameters_to_context(ctx, st->codecpar), "could not set up the decoder");
+      ctx->thread_count = resolve_threads(opts.decode_threads);
+      ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+      AVDictionary *codec_opts = NULL;
+      if ( opts.motion_vectors )
+        av_dict_set(&codec_opts, "flags2", "+export_mvs", 0);
+      int ret = avcodec_open2(ctx, codec, &codec_opts);
+      av_dict_free(&codec_opts);
+      check(ret, "could not open the decoder");
+
+      packet = av_packet_alloc();
+      frame = av_frame_alloc();
+
+      AVRational rate = av_guess_frame_rate(fmt, st, NULL);
+      frame_rate = rate.num > 0 && rate.den > 0 ? av_q2d(rate) : 0;
+      frame_size = cv::Size(ctx->width, ctx->height);
+      if ( st->nb_frames > 0 )
+        frame_count = (int) st->nb_frames;
+      else if ( fmt->duration > 0 )
+        frame_count = (int)(fmt->duration * frame_rate / AV_TIME_BASE + 0.5);
+    }
+    catch ( ... )
+    {
+      release();
+      throw;
+    }
+  }
+
+  ~LibavFrameSource()
+  {
+    stop();
+    release();
+  }
+
+protected:
+  bool decode( cv::Mat *image, cv::Mat *luma )
+  {
+    while ( true )
+    {
+      int ret = avcodec_receive_frame(ctx, frame);
+      if ( ret == 0 )
+      {
+        // after a seek, drop the frames between the keyframe and the target
+        if ( skip_until != AV_NOPTS_VALUE && frame->best_effort_timestamp != AV_NOPTS_VALUE &&
+             frame->best_effort_timestamp < skip_until )
+        {
+          av_frame_unref(frame);
+          continue;
+        }
+        skip_until = AV_NOPTS_VALUE;
+        if ( image )
+          convert(*image);
+        if ( luma )
+          extractLuma(*luma);
+        if ( opts.motion_vectors )
+          extractVectors();
+        position++;
+        av_frame_unref(frame);
+        return true;
+      }
+      if ( ret == AVERROR_EOF )
+        return false;
+      if ( ret != AVERROR(EAGAIN) )
+        check(ret, "decoding failed");
+
+      if ( flushing )
+        return false;
+      ret = av_read_frame(fmt, packet);
+      if ( ret < 0 )
+      {
+        // drain the frames still inside the (frame threaded) decoder
+        flushing = true;
+        avcodec_send_packet(ctx, NULL);
+        continue;
+      }
+      if ( packet->stream_index == stream_index )
+      {
+        ret = avcodec_send_packet(ctx, packet);
+        if ( ret < 0 && ret != AVERROR(EAGAIN) )
+          check(ret, "decoding failed");
+      }
+      av_packet_unref(packet);
+    }
+  }
+
+  bool seekTo( int index )
+  {
+    int64_t target = frame_pts(index);
+    // land on the keyframe before the target and decode forward from there
+    if ( avformat_seek_file(fmt, stream_index, INT64_MIN, target, target, AVSEEK_FLAG_BACKWARD) < 0 &&
+         av_seek_frame(fmt, stream_index, target, AVSEEK_FLAG_BACKWARD) < 0 )
+      return false;
+    avcodec_flush_buffers(ctx);
+    flushing = false;
+    skip_until = index > 0 ? target : AV_NOPTS_VALUE;
+    position = index;
+    last_reference = -1;
+    return true;
+  }
+
+  void motionVectors( MotionVectors &v )
+  {
+    v = vectors;
+  }
+
+  int countFrames()
+  {
+    // every video packet is one frame, so counting needs no decoding
+    AVFormatContext *scan = NULL;
+    if ( avformat_open_input(&scan, fn.c_str(), NULL, NULL) < 0 )
+      return frame_count;
+    AVPacket *pkt = av_packet_alloc();
+    int n = 0;
+    while ( av_read_frame(scan, pkt) >= 0 )
+    {
+      if ( pkt->stream_index == stream_index )
+        n++;
+      av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    avformat_close_input(&scan);
+    return n;
+  }
+
+private:
+  int64_t frame_pts( int index ) const
+  {
+    AVStream *st = fmt->streams[stream_index];
+    AVRational rate = av_d2q(frame_rate > 0 ? frame_rate : 30, 100000);
+    int64_t start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    return start + av_rescale_q(index, av_inv_q(rate), st->time_base);
+  }
+
+  void convert( cv::Mat &dst )
+  {
+    dst.create(frame->height, frame->width, CV_8UC3);
+    sws = sws_getCachedContext(sws, frame->width, frame->height, (AVPixelFormat) frame->format,
+                               frame->width, frame->height, AV_PIX_FMT_BGR24,
+                               SWS_BILINEAR, NULL, NULL, NULL);
+    uint8_t *data[1] = { dst.data };
+    int linesize[1] = { (int) dst.step };
+    sws_scale(sws, frame->data, frame->linesize, 0, frame->height, data, linesize);
+  }
+
+  // 8 bit luma in a plane of its own (the planar and semi-planar YUV
+  // formats), so the analysis grey is a row copy instead of a conversion.
+  static bool has_luma_plane( int format )
+  {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat) format);
+    return desc && !(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL |
+                                    AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_BE)) &&
+           desc->nb_components >= 1 && desc->comp[0].plane == 0 && desc->comp[0].depth == 8 &&
+           desc->comp[0].step == 1 && desc->comp[0].offset == 0 && desc->comp[0].shift == 0;
+  }
+
+  void extractLuma( cv::Mat &dst )
+  {
+    dst.create(frame->height, frame->width, CV_8UC1);
+    if ( has_luma_plane(frame->format) )
+    {
+      cv::Mat(frame->height, frame->width, CV_8UC1, frame->data[0], frame->linesize[0]).copyTo(dst);
+      return;
+    }
+    grey_sws = sws_getCachedContext(grey_sws, frame->width, frame->height, (AVPixelFormat) frame->format,
+                                    frame->width, frame->height, AV_PIX_FMT_GRAY8,
+                                    SWS_POINT, NULL, NULL, NULL);
+    uint8_t *data[1] = { dst.data };
+    int linesize[1] = { (int) dst.step };
+    sws_scale(grey_sws, frame->data, frame->linesize, 0, frame->height, data, linesize);
+  }
+
+  // The vectors of the frame that refer to a past frame. Which one is not
+  // exported; in the usual streams without B-pyramids or several reference
+  // frames it is the last I or P frame, so they are divided by the frames
+  // since then. Until that is known (after a seek) there are none.
+  void extractVectors()
+  {
+    vectors.from.clear();
+    vectors.to.clear();
+    int span = last_reference >= 0 ? position - last_reference : 0;
+    if ( frame->pict_type != AV_PICTURE_TYPE_B )
+      last_reference = position;
+    AVFrameSideData *sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+    if ( !sd || span <= 0 )
+      return;
+    const AVMotionVector *mv = (const AVMotionVector*) sd->data;
+    size_t n = sd->size / sizeof(AVMotionVector);
+    for ( size_t i = 0; i < n; ++i )
+    {
+      if ( mv[i].source >= 0 )
+        continue;
+      // src = dst + motion / motion_scale
+      double scale = (mv[i].motion_scale > 0 ? mv[i].motion_scale : 1) * span;
+      cv::Point2f to(mv[i].dst_x, mv[i].dst_y);
+      vectors.from.push_back(cv::Point2f((float)(to.x + mv[i].motion_x / scale), (float)(to.y + mv[i].motion_y / scale)));
+      vectors.to.push_back(to);
+    }
+  }
+
+  void release()
+  {
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&ctx);
+    avformat_close_input(&fmt);
+    sws_freeContext(sws);
+    sws = NULL;
+    sws_freeContext(grey_sws);
+    grey_sws = NULL;
+  }
+
+  std::string fn;
+  AVFormatContext *fmt;
+  AVCodecContext *ctx;
+  SwsContext *sws;       // to BGR
+  SwsContext *grey_sws;  // to grey, for formats without a luma plane
+  AVPacket *packet;
+  AVFrame *frame;
+  int stream_index;
+  bool flushing;
+  int64_t skip_until;
+  int position;        // frame number of the next frame decode() returns
+  int last_reference;  // frame number of the last I or P frame, -1 = unknown
+  MotionVectors vectors;
+};
+
+std::unique_ptr<FrameSource> createLibavSource( const std::string &fn, const FrameSourceOptions &opts )
+{
+  return std::unique_ptr<FrameSource>(new LibavFrameSource(fn, opts));
+}
+
+// ---------------------------------------------------------------------------
+// Encoder
+
+class LibavFrameSink : public FrameSink
+{
+public:
+  LibavFrameSink( const std::string &fn, double fps, cv::Size size, const FrameSinkOptions &opts )
+    : fmt(NULL), ctx(NULL), stream(NULL), sws(NULL), frame(NULL), packet(NULL), next_pts(0), closed(false)
+  {
+    try
+    {
+      check(avformat_alloc_output_context2(&fmt, NULL, NULL, fn.c_str()), "could not create " + fn);
+
+      const AVCodec *codec = avcodec_find_encoder_by_name(opts.codec.c_str());
+      if ( !codec )
+        throw std::invalid_argument( "unknown encoder " + opts.codec );
+      ctx = avcodec_alloc_context3(codec);
+      ctx->width = size.width;
+      ctx->height = size.height;
+      AVRational rate = av_d2q(fps > 0 ? fps : 30, 100000);
+      ctx->framerate = rate;
+      ctx->time_base = av_inv_q(rate);
+      ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+      if ( codec->pix_fmts && codec->pix_fmts[0] != AV_PIX_FMT_NONE )
+        ctx->pix_fmt = codec->pix_fmts[0];
+      ctx->thread_count = resolve_threads(opts.encode_threads);
+      ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+      if ( opts.bitrate > 0 )
+        ctx->bit_rate = opts.bitrate;
+      if ( !opts.preset.empty() )
+        av_opt_set(ctx->priv_data, "preset", opts.preset.c_str(), 0);
+      if ( fmt->oformat->flags & AVFMT_GLOBALHEADER )
+        ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+      check(avcodec_open2(ctx, codec, NULL), "could not open the " + opts.codec + " encoder");
+
+      stream = avformat_new_stream(fmt, NULL);
+      if ( !stream )
+        throw std::runtime_error( "could not add a stream to " + fn );
+      stream->time_base = ctx->time_base;
+      check(avcodec_parameters_from_context(stream->codecpar, ctx), "could not set up the stream");
+
+      if ( !(fmt->oformat->flags & AVFMT_NOFILE) )
+        check(avio_open(&fmt->pb, fn.c_str(), AVIO_FLAG_WRITE), "could not open " + fn);
+      check(avformat_write_header(fmt, NULL), "could not write the header of " + fn);
+
+      frame = av_frame_alloc();
+      frame->format = ctx->pix_fmt;
+      frame->width = ctx->width;
+      frame->height = ctx->height;
+      check(av_frame_get_buffer(frame, 0), "could not allocate a frame");
+      packet = av_packet_alloc();
+    }
+    catch ( ... )
+    {
+      release();
+      throw;
+    }
+  }
+
+  ~LibavFrameSink()
+  {
+    try
+    {
+      close();
+    }
+    catch ( ... )
+    {
+      // destructors must not throw; the file is left truncated
+    }
+    release();
+  }
+
+  void close()
+  {
+    if ( closed )
+      return;
+    closed = true;
+    encode(NULL);
+    check(av_write_trailer(fmt), "could not finish the file");
+  }
+
+  void write( const cv::Mat &image )
+  {
+    TRACE_SCOPE("encode");
+    CV_Assert( image.type() == CV_8UC3 && image.cols == ctx->width && image.rows == ctx->height );
+    check(av_frame_make_writable(frame), "could not reuse the frame");
+    sws = sws_getCachedContext(sws, image.cols, image.rows, AV_PIX_FMT_BGR24,
+                               ctx->width, ctx->height, ctx->pix_fmt,
+                               SWS_BILINEAR, NULL, NULL, NULL);
+    const uint8_t *data[1] = { image.data };
+    int linesize[1] = { (int) image.step };
+    sws_scale(sws, data, linesize, 0, image.rows, frame->data, frame->linesize);
+    frame->pts = next_pts++;
+    encode(frame);
+  }
+
+private:
+  void encode( AVFrame *f )
+  {
+    check(avcodec_send_frame(ctx, f), "encoding failed");
+    while ( true )
+    {
+      int ret = avcodec_receive_packet(ctx, packet);
+      if ( ret == AVERROR(EAGAIN) || ret == AVERROR_EOF )
+        return;
+      check(ret, "encoding failed");
+      av_packet_rescale_ts(packet, ctx->time_base, stream->time_base);
+      packet->stream_index = stream->index;
+      check(av_interleaved_write_frame(fmt, packet), "could not write a packet");
+    }
+  }
+
+  void release()
+  {
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&ctx);
+    if ( fmt && !(fmt->oformat->flags & AVFMT_NOFILE) )
+      avio_closep(&fmt->pb);
+    avformat_free_context(fmt);
+    fmt = NULL;
+    sws_freeContext(sws);
+    sws = NULL;
+  }
+
+  AVFormatContext *fmt;
+  AVCodecContext *ctx;
+  AVStream *stream;
+  SwsContext *sws;
+  AVFrame *frame;
+  AVPacket *packet;
+  int64_t next_pts;
+  bool closed;
+};
+
+std::unique_ptr<FrameSink> createLibavSink( const std::string &fn, double fps, cv::Size size,
+                                            const FrameSinkOptions &opts )
+{
+  return std::unique_ptr<FrameSink>(new LibavFrameSink(fn, fps, size, opts));
+}
+
+// ---------------------------------------------------------------------------
+// Joining
+
+void concatLibavVideos( const std::vector<std::string> &parts, const std::string &fn )
+{
+  AVFormatContext *out = NULL;
+  check(avformat_alloc_output_context2(&out, NULL, NULL, fn.c_str()), "could not create " + fn);
+  AVPacket *pkt = av_packet_alloc();
+  AVFormatContext *in = NULL;
+  auto release = [&]() {
+    avformat_close_input(&in);
+    av_packet_free(&pkt);
+    if ( !(out->oformat->flags & AVFMT_NOFILE) )
+      avio_closep(&out->pb);
+    avformat_free_context(out);
+  };
+  try
+  {
+    AVStream *ost = NULL;
+    int64_t end = 0, last_dts = AV_NOPTS_VALUE;  // in ost->time_base
+    for ( size_t i = 0; i < parts.size(); ++i )
+    {
+      check(avformat_open_input(&in, parts[i].c_str(), NULL, NULL), "could not open " + parts[i]);
+      check(avformat_find_stream_info(in, NULL), "could not read stream info of " + parts[i]);
+      int si = av_find_best_stream(in, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+      check(si, "no video stream in " + parts[i]);
+      AVStream *ist = in->streams[si];
+      if ( !ost )
+      {
+        ost = avformat_new_stream(out, NULL);
+        if ( !ost )
+          throw std::runtime_error( "could not add a stream to " + fn );
+        check(avcodec_parameters_copy(ost->codecpar, ist->codecpar), "could not set up the stream");
+        ost->codecpar->codec_tag = 0;
+        ost->time_base = ist->time_base;
+        if ( !(out->oformat->flags & AVFMT_NOFILE) )
+          check(avio_open(&out->pb, fn.c_str(), AVIO_FLAG_WRITE), "could not open " + fn);
+        check(avformat_write_header(out, NULL), "could not write the header of " + fn);
+      }
+
+      // every part starts at 0: it is shifted behind the previous one, and
+      // far enough for its first (B-frame delayed) dts to follow the last
+      bool first = true;
+      int64_t offset = end;
+      while ( av_read_frame(in, pkt) >= 0 )
+      {
+        if ( pkt->stream_index == si )
+        {
+          av_packet_rescale_ts(pkt, ist->time_base, ost->time_base);
+          if ( first && pkt->dts != AV_NOPTS_VALUE && last_dts != AV_NOPTS_VALUE )
+            offset = std::max(offset, last_dts + 1 - pkt->dts);
+          first = false;
+          if ( pkt->pts != AV_NOPTS_VALUE )
+            pkt->pts += offset;
+          if ( pkt->dts != AV_NOPTS_VALUE )
+          {
+            pkt->dts += offset;
+            last_dts = pkt->dts;
+          }
+          int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+          if ( ts != AV_NOPTS_VALUE )
+            end = std::max(end, ts + std::max<int64_t>(pkt->duration, 1));
+          pkt->stream_index = ost->index;
+          pkt->pos = -1;
+          check(av_interleaved_write_frame(out, pkt), "could not write " + fn);
+        }
+        av_packet_unref(pkt);
+      }
+      avformat_close_input(&in);
+    }
+    if ( ost )
+      check(av_write_trailer(out), "could not finish " + fn);
+  }
+  catch ( ... )
+  {
+    release();
+    throw;
+  }
+  release();
+}
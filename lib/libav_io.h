@@ -0,0 +1,33 @@
+//
+//  libav_io.h
+//  Footage_Manipulation
+//
+//  FFmpeg (libavformat/libavcodec) FrameSource and FrameSink backends,
+//  built when CMake is run with -DWITH_LIBAV=ON. They give control over the
+//  decoder and encoder threads, the encoder preset, and seek to the frame
+//  through the preceding keyframe.
+
+#ifndef __libav_io_h
+#define __libav_io_h
+
+#ifdef HAVE_LIBAV
+
+#include "frame_source.h"
+#include "frame_sink.h"
+
+#include <string>
+#include <vector>
+
+std::unique_ptr<FrameSource> createLibavSource( const std::string &fn, const FrameSourceOptions &opts );
+
+std::unique_ptr<FrameSink> createLibavSink( const std::string &fn, double fps, cv::Size size,
+                                            const FrameSinkOptions &opts );
+
+// Writes the video streams of parts one after the other into fn, without
+// re-encoding; the parts must come from encoders with the same settings.
+// Throws on failure.
+void concatLibavVideos( const std::vector<std::string> &parts, const std::string &fn );
+
+#endif
+
+#endif
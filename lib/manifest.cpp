@@ -0,0 +1,398 @@
+#include "manifest.h"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = boost::filesystem;
+
+namespace
+{
+
+bool all_digits( const std::string &s, size_t from )
+{
+  if ( from >= s.size() )
+    return false;
+  for ( size_t i = from; i < s.size(); ++i )
+    if ( !isdigit((unsigned char) s[i]) )
+      return false;
+  return true;
+}
+
+bool valid_id( const std::string &id )
+{
+  if ( id.empty() )
+    return false;
+  for ( size_t i = 0; i < id.size(); ++i )
+  {
+    char c = id[i];
+    if ( !isalnum((unsigned char) c) && c != '.' && c != '_' && c != '-' )
+      return false;
+  }
+  return true;
+}
+
+// host:pid, written into the claims to tell the workers apart in the logs.
+std::string worker_tag()
+{
+  char host[256] = "unknown";
+  gethostname(host, sizeof(host) - 1);
+  std::stringstream tag;
+  tag << host << ":" << getpid();
+  return tag.str();
+}
+
+// What the lock directory says about one shard.
+struct ShardState
+{
+  ShardState() : done(false), attempt(0), failed(false) {}
+  bool done;
+  int attempt;   // highest claimed attempt, 0 = never claimed
+  bool failed;   // that attempt left a failure marker
+};
+
+// One directory scan for all shards; names are <id>.<kind>[.<n>].
+std::map<std::string, ShardState> scan_locks( const fs::path &dir, const std::set<std::string> &ids )
+{
+  std::map<std::string, ShardState> states;
+  std::map<std::string, std::set<int> > failures;
+  for ( fs::directory_iterator it(dir), end; it != end; ++it )
+  {
+    std::string name = it->path().filename().string();
+    size_t kind_pos = std::string::npos;
+    std::string id;
+    for ( size_t p = name.find('.'); p != std::string::npos; p = name.find('.', p + 1) )
+    {
+      if ( ids.count(name.substr(0, p)) )
+      {
+        id = name.substr(0, p);
+        kind_pos = p + 1;
+      }
+    }
+    if ( id.empty() )
+      continue;
+
+    std::string rest = name.substr(kind_pos);
+    ShardState &state = states[id];
+    if ( rest == "done" )
+    {
+      state.done = true;
+    }
+    else if ( rest.compare(0, 6, "claim.") == 0 && all_digits(rest, 6) )
+    {
+      state.attempt = std::max(state.attempt, atoi(rest.c_str() + 6));
+    }
+    else if ( rest.compare(0, 7, "failed.") == 0 && all_digits(rest, 7) )
+    {
+      failures[id].insert(atoi(rest.c_str() + 7));
+    }
+  }
+  for ( std::map<std::string, ShardState>::iterator it = states.begin(); it != states.end(); ++it )
+    it->second.failed = failures[it->first].count(it->second.attempt) > 0;
+  return states;
+}
+
+fs::path lock_file( const fs::path &dir, const std::string &id, const std::string &kind, int attempt = -1 )
+{
+  std::stringstream name;
+  name << id << "." << kind;
+  if ( attempt >= 0 )
+    name << "." << attempt;
+  return dir / name.str();
+}
+
+// Creates path only if it does not exist yet, atomically also on NFS v3+.
+bool create_exclusive( const fs::path &path, const std::string &contents )
+{
+  int fd = open(path.string().c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+  if ( fd < 0 )
+    return false;
+  ssize_t written = write(fd, contents.data(), contents.size());
+  close(fd);
+  return written == (ssize_t) contents.size();
+}
+
+// Written to a private file and renamed into place, so readers never see a
+// partial marker.
+void write_marker( const fs::path &path, const std::string &contents )
+{
+  fs::path tmp = path.string() + ".tmp." + std::to_string((long long) getpid());
+  {
+    std::ofstream out(tmp.string().c_str(), std::ios::trunc);
+    out << contents;
+  }
+  fs::rename(tmp, path);
+}
+
+// Keeps touching a claim while its shard is processed.
+class Heartbeat
+{
+public:
+  Heartbeat( const fs::path &_claim, int interval_secs )
+    : claim(_claim), interval(std::max(interval_secs, 1)), stopping(false),
+      thread(&Heartbeat::run, this) {}
+
+  ~Heartbeat()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stopping = true;
+    }
+    cond.notify_all();
+    thread.join();
+  }
+
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    while ( !cond.wait_for(lock, std::chrono::seconds(interval), [this] { return stopping; }) )
+    {
+      boost::system::error_code ec;
+      fs::last_write_time(claim, std::time(0), ec);
+    }
+  }
+
+  fs::path claim;
+  int interval;
+  bool stopping;
+  std::mutex mtx;
+  std::condition_variable cond;
+  std::thread thread;
+};
+
+}
+
+void applyOperation( PipelineJob &job, const std::string &operation )
+{
+  if ( operation == "undistort" )
+  {
+    job.method = "none";
+    job.hcrop = 0;
+    job.numx = job.numy = 1;
+    job.overlap = 0;
+    job.tile_x = job.tile_y = -1;
+  }
+  else if ( operation == "stabilize" )
+  {
+    job.calib_fn.clear();
+    job.numx = job.numy = 1;
+    job.overlap = 0;
+    job.tile_x = job.tile_y = -1;
+  }
+  else if ( operation == "split" )
+  {
+    job.calib_fn.clear();
+    job.method = "none";
+    job.hcrop = 0;
+  }
+  else if ( operation != "pipeline" )
+  {
+    throw std::invalid_argument( "unknown operation " + operation );
+  }
+}
+
+std::vector<Shard> readManifest( const std::string &manifest_fn )
+{
+  cv::FileStorage storage(manifest_fn, cv::FileStorage::READ);
+  if ( !storage.isOpened() )
+    throw std::invalid_argument( "could not read manifest " + manifest_fn );
+
+  // the defaults alone need not be a valid job, only each shard over them
+  PipelineJob defaults;
+  readPipelineEntries(storage["defaults"], defaults, manifest_fn + ": defaults");
+
+  std::vector<Shard> shards;
+  std::set<std::string> ids;
+  cv::FileNode list = storage["shards"];
+  if ( list.type() != cv::FileNode::SEQ || list.size() == 0 )
+    throw std::invalid_argument( manifest_fn + ": no shards" );
+  for ( cv::FileNodeIterator it = list.begin(); it != list.end(); ++it )
+  {
+    Shard shard;
+    (*it)["id"] >> shard.id;
+    if ( !valid_id(shard.id) )
+      throw std::invalid_argument( manifest_fn + ": invalid shard id \"" + shard.id + "\"" );
+    if ( !ids.insert(shard.id).second )
+      throw std::invalid_argument( manifest_fn + ": duplicate shard id " + shard.id );
+    shard.operation = "pipeline";
+    if ( !(*it)["operation"].empty() )
+      (*it)["operation"] >> shard.operation;
+    shard.job = defaults;
+    readPipelineEntries(*it, shard.job, manifest_fn + ": shard " + shard.id);
+    applyOperation(shard.job, shard.operation);
+    validatePipelineJob(shard.job, manifest_fn + ": shard " + shard.id);
+    shards.push_back(shard);
+  }
+  return shards;
+}
+
+void writeManifest( const std::string &manifest_fn, const std::vector<Shard> &shards )
+{
+  cv::FileStorage storage(manifest_fn, cv::FileStorage::WRITE);
+  if ( !storage.isOpened() )
+    throw std::runtime_error( "could not write manifest " + manifest_fn );
+  storage << "shards" << "[";
+  for ( size_t i = 0; i < shards.size(); ++i )
+  {
+    storage << "{";
+    storage << "id" << shards[i].id << "operation" << shards[i].operation;
+    writePipelineJob(storage, shards[i].job);
+    storage << "}";
+  }
+  storage << "]";
+}
+
+std::vector<Shard> shardJob( const PipelineJob &job, int total_frames, bool per_tile, const std::string &id_prefix )
+{
+  int end = job.end_frame >= 0 ? std::min(job.end_frame, total_frames) : total_frames;
+  int length = end - job.start_frame;
+  if ( length <= 0 )
+    throw std::invalid_argument( "the job covers no frames" );
+  int segment_len = std::max(length / job.timesplit, 1);
+
+  std::string prefix = id_prefix;
+  for ( size_t i = 0; i < prefix.size(); ++i )
+    if ( !valid_id(prefix.substr(i, 1)) )
+      prefix[i] = '_';
+
+  std::vector<Shard> shards;
+  for ( int t = 0; t < job.timesplit; ++t )
+  {
+    PipelineJob segment = job;
+    segment.start_frame = job.start_frame + t * segment_len;
+    segment.end_frame = t == job.timesplit - 1 ? job.end_frame : segment.start_frame + segment_len;
+    segment.timesplit = 1;
+    segment.first_segment = job.first_segment + t;
+    if ( job.method == "reference" && job.reference_frame < 0 )
+      segment.reference_frame = job.start_frame;
+    if ( segment.start_frame >= end )
+      break;
+
+    for ( int y = 0; y < (per_tile ? job.numy : 1); ++y )
+    {
+      for ( int x = 0; x < (per_tile ? job.numx : 1); ++x )
+      {
+        Shard shard;
+        std::stringstream id;
+        id << prefix << "-t" << segment.first_segment;
+        shard.job = segment;
+        if ( per_tile )
+        {
+          id << "-" << y << "-" << x;
+          shard.job.tile_x = x;
+          shard.job.tile_y = y;
+        }
+        shard.id = id.str();
+        shard.operation = "pipeline";
+        shards.push_back(shard);
+      }
+    }
+  }
+  return shards;
+}
+
+WorkerStats runWorker( const std::vector<Shard> &shards, const WorkerOptions &opts,
+                       const std::function<void(const Shard &)> &process, std::ostream &log )
+{
+  fs::path dir(opts.lock_dir);
+  fs::create_directories(dir);
+  std::set<std::string> ids;
+  for ( size_t i = 0; i < shards.size(); ++i )
+    ids.insert(shards[i].id);
+  const std::string tag = worker_tag();
+
+  WorkerStats stats;
+  std::set<std::string> abandoned;  // over all scans, a scan may stop early
+  while ( true )
+  {
+    std::map<std::string, ShardState> states = scan_locks(dir, ids);
+    bool waiting = false, worked = false;
+    for ( size_t i = 0; i < shards.size() && !worked; ++i )
+    {
+      const Shard &shard = shards[i];
+      ShardState state = states[shard.id];
+      if ( state.done )
+        continue;
+
+      if ( state.attempt > 0 && !state.failed )
+      {
+        // running elsewhere, unless its owner stopped refreshing the claim
+        // or the claim was deleted since the scan
+        boost::system::error_code ec;
+        std::time_t touched = fs::last_write_time(lock_file(dir, shard.id, "claim", state.attempt), ec);
+        if ( !ec && std::time(0) - touched < opts.stale_secs )
+        {
+          waiting = true;
+          continue;
+        }
+        log << "Shard " << shard.id << ": attempt " << state.attempt << " went stale" << std::endl;
+      }
+      if ( state.attempt >= opts.max_attempts )
+      {
+        abandoned.insert(shard.id);
+        continue;
+      }
+
+      int attempt = state.attempt + 1;
+      fs::path claim = lock_file(dir, shard.id, "claim", attempt);
+      std::stringstream owner;
+      owner << tag << " " << std::time(0) << std::endl;
+      if ( !create_exclusive(claim, owner.str()) )
+      {
+        // another worker got this attempt first
+        waiting = true;
+        continue;
+      }
+
+      worked = true;
+      log << "Shard " << shard.id << ": attempt " << attempt << " on " << tag << std::endl;
+      try
+      {
+        {
+          Heartbeat heartbeat(claim, opts.stale_secs / 4);
+          process(shard);
+        }
+        write_marker(lock_file(dir, shard.id, "done"), owner.str());
+        stats.completed++;
+        log << "Shard " << shard.id << ": done" << std::endl;
+      }
+      catch ( std::exception &e )
+      {
+        write_marker(lock_file(dir, shard.id, "failed", attempt), tag + " " + e.what() + "\n");
+        stats.failed++;
+        log << "Shard " << shard.id << ": attempt " << attempt << " failed: " << e.what() << std::endl;
+      }
+      catch ( ... )
+      {
+        // still an attempt of its own, not one left to go stale
+        write_marker(lock_file(dir, shard.id, "failed", attempt), tag + " unknown error\n");
+        stats.failed++;
+        log << "Shard " << shard.id << ": attempt " << attempt << " failed with an unknown error" << std::endl;
+      }
+    }
+
+    if ( !worked )
+    {
+      if ( !waiting )
+        break;
+      std::this_thread::sleep_for(std::chrono::seconds(std::max(opts.poll_secs, 1)));
+    }
+  }
+  stats.abandoned = abandoned.size();
+  return stats;
+}
@@ -0,0 +1,84 @@
+//
+//  manifest.h
+//  Footage_Manipulation
+//
+//  Sharded job manifests and the worker that drains them. A manifest lists
+//  shards (input, operation, frame range, tiles); any number of workers on
+//  any number of machines share a lock directory and claim shards through
+//  files created there with O_EXCL, so no central service is needed.
+//
+//  Per shard the lock directory holds:
+//    <id>.claim.<n>   attempt n is running; its owner keeps touching it
+//    <id>.failed.<n>  attempt n failed, with the error
+//    <id>.done        the shard is finished
+//  An attempt whose claim was not touched for the stale timeout, or whose
+//  claim was deleted, is taken to have died, and the next worker claims
+//  attempt n+1.
+
+#ifndef __manifest_h
+#define __manifest_h
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+
+struct Shard
+{
+  std::string id;         // unique, used in the lock file names: [A-Za-z0-9._-]
+  std::string operation;  // "pipeline", "undistort", "stabilize" or "split"
+  PipelineJob job;        // with the operation applied
+};
+
+// Restricts job to one operation of the chain: "undistort" (no
+// stabilization, no crop, whole frame), "stabilize" (no undistortion, whole
+// frame), "split" (tiles only) or "pipeline" (as configured).
+void applyOperation( PipelineJob &job, const std::string &operation );
+
+// Reads a manifest:
+//
+//   %YAML:1.0
+//   defaults: { <job entries shared by every shard> }
+//   shards:
+//     - { id: "flight1-t0", operation: "pipeline", start_frame: 0, end_frame: 9000,
+//         split: { first_segment: 0 } }
+//     - ...
+//
+// Throws std::invalid_argument on a malformed manifest or duplicate ids.
+std::vector<Shard> readManifest( const std::string &manifest_fn );
+
+void writeManifest( const std::string &manifest_fn, const std::vector<Shard> &shards );
+
+// One shard per time segment of job (and per tile with per_tile), writing
+// the same files as running job in one go. total_frames is the length of
+// the input.
+std::vector<Shard> shardJob( const PipelineJob &job, int total_frames, bool per_tile,
+                             const std::string &id_prefix );
+
+struct WorkerOptions
+{
+  WorkerOptions() : stale_secs(600), max_attempts(3), poll_secs(10) {}
+
+  std::string lock_dir;  // shared by all workers of the manifest
+  int stale_secs;        // an unrefreshed claim older than this is retried
+  int max_attempts;      // attempts per shard before it is given up
+  int poll_secs;         // wait between scans while other workers hold shards
+};
+
+struct WorkerStats
+{
+  WorkerStats() : completed(0), failed(0), abandoned(0) {}
+
+  int completed;  // shards this worker finished
+  int failed;     // attempts of this worker that threw
+  int abandoned;  // shards given up after max_attempts, by anyone
+};
+
+// Claims and processes shards until every shard is done or abandoned.
+// process runs one shard; an exception marks the attempt failed.
+WorkerStats runWorker( const std::vector<Shard> &shards, const WorkerOptions &opts,
+                       const std::function<void(const Shard &)> &process, std::ostream &log );
+
+#endif
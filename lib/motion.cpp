@@ -0,0 +1,322 @@
+#include "motion.h"
+#include "grey.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace po = boost::program_options;
+
+namespace
+{
+
+// log-polar grid of the magnitude spectra: log-radius columns, angle rows
+// over [0, pi) (the magnitude spectrum of a real image is symmetric)
+const int LP_RADII = 128;
+const int LP_ANGLES = 360;
+
+cv::Mat affine3( const cv::Mat &M )
+{
+  cv::Mat M3 = cv::Mat::eye(3, 3, CV_64F);
+  M.copyTo(M3.rowRange(0, 2));
+  return M3;
+}
+
+}
+
+po::options_description motionOptions( MotionOptions &opts )
+{
+  po::options_description desc("Motion estimation");
+  desc.add_options()
+    ("motion", po::value<std::string>(&opts.method)->default_value("features")->notifier([]( const std::string &m ) {
+        if ( m != "features" && m != "phase" && m != "hierarchical" && m != "vectors" )
+          throw po::error( "--motion must be features, phase, hierarchical or vectors, not " + m );
+      }), "frame motion from features (corners, LK, RANSAC), phase (FFT phase correlation, falling back to features on low confidence), hierarchical (coarse estimate refined on full resolution patches) or vectors (the codec's motion vectors, falling back to features)")
+    ("phase-size", po::value<int>(&opts.proxy_side)->default_value(512), "longest side of the phase correlation proxy, in pixels")
+    ("phase-rotation", po::bool_switch(&opts.rotation), "also estimate rotation and scale by phase correlation (log-polar spectra)")
+    ("phase-min-confidence", po::value<double>(&opts.min_confidence)->default_value(0.05), "phase correlation peaks below this fall back to features")
+    ("coarse-size", po::value<int>(&opts.hierarchy.coarse_side)->default_value(256), "longest side of the coarse level of --motion hierarchical, in pixels")
+    ("patches", po::value<int>(&opts.hierarchy.patches)->default_value(32), "full resolution patches refined per frame by --motion hierarchical")
+    ("vector-min-inliers", po::value<double>(&opts.min_vector_inliers)->default_value(0.3), "--motion vectors falls back to features when fewer motion vectors than this share agree")
+    ("analysis-stride", po::value<int>(&opts.stride)->default_value(1)->notifier([]( int n ) {
+        if ( n < 1 )
+          throw po::error( "--analysis-stride must be at least 1" );
+      }), "estimate the motion of every Nth frame only and interpolate the others, while the motion is calm")
+    ("stride-max-residual", po::value<double>(&opts.max_stride_residual)->default_value(2), "RANSAC inlier residual, in pixels, above which every frame is analysed again")
+    ("stride-max-rotation", po::value<double>(&opts.max_stride_rotation)->default_value(0.2), "rotation, in degrees per frame, above which every frame is analysed again");
+  return desc;
+}
+
+cv::Mat affinePower( const cv::Mat &T, double s )
+{
+  cv::Mat M;
+  T.convertTo(M, CV_64F);
+  double m00 = M.at<double>(0,0), m01 = M.at<double>(0,1), m10 = M.at<double>(1,0), m11 = M.at<double>(1,1);
+  double tx = M.at<double>(0,2), ty = M.at<double>(1,2);
+
+  // rotation of the closest similarity; K = R(-theta) M is what is left
+  double theta = atan2(m10 - m01, m00 + m11);
+  double c = cos(theta), sn = sin(theta);
+  double k00 = c*m00 + sn*m10, k01 = c*m01 + sn*m11;
+  double k10 = -sn*m00 + c*m10, k11 = -sn*m01 + c*m11;
+
+  // SE(2) log: t = V(theta) v, with V = [a -b; b a]
+  double a = std::abs(theta) < 1e-9 ? 1 : sin(theta) / theta;
+  double b = std::abs(theta) < 1e-9 ? 0 : (1 - cos(theta)) / theta;
+  double n = a*a + b*b;
+  double vx = (a*tx + b*ty) / n, vy = (-b*tx + a*ty) / n;
+
+  // exp of the scaled twist
+  double ts = s * theta;
+  double as = std::abs(ts) < 1e-9 ? 1 : sin(ts) / ts;
+  double bs = std::abs(ts) < 1e-9 ? 0 : (1 - cos(ts)) / ts;
+  double cs = cos(ts), ss = sin(ts);
+  k00 = 1 + s * (k00 - 1);
+  k01 = s * k01;
+  k10 = s * k10;
+  k11 = 1 + s * (k11 - 1);
+  cv::Mat P = (cv::Mat_<double>(2,3) << cs*k00 - ss*k10, cs*k01 - ss*k11, s * (as*vx - bs*vy),
+                                        ss*k00 + cs*k10, ss*k01 + cs*k11, s * (bs*vx + as*vy));
+  return P;
+}
+
+cv::Mat affineInterpolate( const cv::Mat &A, const cv::Mat &B, double s )
+{
+  cv::Mat A64, B64;
+  A.convertTo(A64, CV_64F);
+  B.convertTo(B64, CV_64F);
+  cv::Mat A3 = affine3(A64);
+  cv::Mat AB = A3.inv() * affine3(B64);
+  cv::Mat I = A3 * affine3(affinePower(AB.rowRange(0, 2), s));
+  return I.rowRange(0, 2).clone();
+}
+
+AnalysisStride::AnalysisStride( const MotionOptions &opts )
+  : stride(std::max(opts.stride, 1)), current(std::max(opts.stride, 1)), calm_run(0),
+    max_residual(opts.max_stride_residual), max_rotation(opts.max_stride_rotation * CV_PI / 180)
+{
+}
+
+bool AnalysisStride::calm( const cv::Mat &M, int span, const RansacStats &ransac ) const
+{
+  if ( M.empty() )
+    return false;
+  if ( ransac.points > 0 && ransac.residual > max_residual )
+    return false;
+  cv::Mat M64;
+  M.convertTo(M64, CV_64F);
+  double theta = atan2(M64.at<double>(1,0) - M64.at<double>(0,1), M64.at<double>(0,0) + M64.at<double>(1,1));
+  return std::abs(theta) <= max_rotation * std::max(span, 1);
+}
+
+void AnalysisStride::update( bool calm )
+{
+  if ( !calm )
+  {
+    current = 1;
+    calm_run = 0;
+  }
+  else if ( current < stride && ++calm_run >= stride )
+  {
+    current = stride;
+  }
+}
+
+PhaseCorrelator::PhaseCorrelator( const MotionOptions &_opts )
+  : opts(_opts), proxy_scale(1), log_step(0)
+{
+  opts.proxy_side = std::max(opts.proxy_side, 16);
+}
+
+void PhaseCorrelator::prepare( cv::Size size )
+{
+  frame_size = size;
+  proxy_scale = std::min(1.0, (double) opts.proxy_side / std::max(size.width, size.height));
+  proxy_size = scaledSize(size, proxy_scale);
+  dft_size = cv::Size(cv::getOptimalDFTSize(proxy_size.width), cv::getOptimalDFTSize(proxy_size.height));
+  cv::createHanningWindow(window, proxy_size, CV_32F);
+  ref = Spectra();
+  cur = Spectra();
+
+  if ( !opts.rotation )
+    return;
+
+  // Reddy & Chatterji's high-pass, which keeps the low frequencies from
+  // dominating the log-polar correlation; indices are unshifted DFT bins
+  highpass.create(dft_size, CV_32F);
+  for ( int y = 0; y < dft_size.height; ++y )
+  {
+    double fy = (double)(y <= dft_size.height / 2 ? y : y - dft_size.height) / dft_size.height;
+    float *h = highpass.ptr<float>(y);
+    for ( int x = 0; x < dft_size.width; ++x )
+    {
+      double fx = (double)(x <= dft_size.width / 2 ? x : x - dft_size.width) / dft_size.width;
+      double X = cos(CV_PI * fx) * cos(CV_PI * fy);
+      h[x] = (float)((1 - X) * (2 - X));
+    }
+  }
+
+  // samples at radius r (cycles per pixel) and angle phi of the unshifted
+  // spectrum; negative frequencies wrap around in the remap
+  lp_size = cv::Size(LP_RADII, LP_ANGLES);
+  double r_min = 2.0 / std::min(dft_size.width, dft_size.height), r_max = 0.5;
+  log_step = log(r_max / r_min) / LP_RADII;
+  lp_map.create(lp_size, CV_32FC2);
+  for ( int j = 0; j < LP_ANGLES; ++j )
+  {
+    double phi = CV_PI * j / LP_ANGLES;
+    cv::Point2f *m = lp_map.ptr<cv::Point2f>(j);
+    for ( int i = 0; i < LP_RADII; ++i )
+    {
+      double r = r_min * exp(i * log_step);
+      m[i] = cv::Point2f((float)(r * cos(phi) * dft_size.width), (float)(r * sin(phi) * dft_size.height));
+    }
+  }
+}
+
+void PhaseCorrelator::windowedSpectrum( const cv::Mat &grey, cv::Mat &F )
+{
+  padded.create(dft_size, CV_32F);
+  padded.setTo(0);
+  cv::Mat roi = padded(cv::Rect(cv::Point(), proxy_size));
+  grey.convertTo(roi, CV_32F);
+  roi -= cv::mean(roi);
+  cv::multiply(roi, window, roi);
+  cv::dft(padded, F, cv::DFT_COMPLEX_OUTPUT);
+}
+
+void PhaseCorrelator::logPolarSpectrum( const cv::Mat &F, cv::Mat &LF )
+{
+  cv::split(F, planes);
+  cv::magnitude(planes[0], planes[1], mag);
+  mag += 1;
+  cv::log(mag, mag);
+  cv::multiply(mag, highpass, mag);
+  cv::remap(mag, lp, lp_map, cv::Mat(), cv::INTER_LINEAR, cv::BORDER_WRAP);
+  lp -= cv::mean(lp);
+  cv::dft(lp, LF, cv::DFT_COMPLEX_OUTPUT);
+}
+
+void PhaseCorrelator::analyse( const cv::Mat &frame, Spectra &s )
+{
+  TRACE_SCOPE("phase_spectrum");
+  greyDownscale(frame, s.grey, proxy_size);
+  windowedSpectrum(s.grey, s.F);
+  if ( opts.rotation )
+    logPolarSpectrum(s.F, s.LF);
+}
+
+cv::Point2d PhaseCorrelator::correlate( const cv::Mat &Fa, const cv::Mat &Fb, double &response )
+{
+  TRACE_SCOPE("phase_correlate");
+  // normalized cross-power spectrum: only the phase difference is left,
+  // whose inverse transform is a peak at the shift of b against a
+  cv::mulSpectrums(Fb, Fa, cross, 0, true);
+  for ( int y = 0; y < cross.rows; ++y )
+  {
+    float *p = cross.ptr<float>(y);
+    for ( int x = 0; x < cross.cols; ++x, p += 2 )
+    {
+      float m = std::sqrt(p[0] * p[0] + p[1] * p[1]) + 1e-9f;
+      p[0] /= m;
+      p[1] /= m;
+    }
+  }
+  cv::idft(cross, corr, cv::DFT_REAL_OUTPUT | cv::DFT_SCALE);
+
+  cv::Point peak;
+  cv::minMaxLoc(corr, 0, 0, 0, &peak);
+
+  // sub-pixel peak from the 5x5 centroid, confidence from the energy of
+  // the 3x3 around the peak; the correlation wraps around
+  double sx = 0, sy = 0, sw = 0;
+  response = 0;
+  for ( int dy = -2; dy <= 2; ++dy )
+  {
+    int y = (peak.y + dy + corr.rows) % corr.rows;
+    for ( int dx = -2; dx <= 2; ++dx )
+    {
+      int x = (peak.x + dx + corr.cols) % corr.cols;
+      double v = corr.at<float>(y, x);
+      if ( std::abs(dx) <= 1 && std::abs(dy) <= 1 )
+        response += v;
+      if ( v > 0 )
+      {
+        sx += v * dx;
+        sy += v * dy;
+        sw += v;
+      }
+    }
+  }
+  response = std::min(std::max(response, 0.0), 1.0);
+
+  cv::Point2d shift(peak.x + (sw > 0 ? sx / sw : 0), peak.y + (sw > 0 ? sy / sw : 0));
+  if ( shift.x > corr.cols / 2 )
+    shift.x -= corr.cols;
+  if ( shift.y > corr.rows / 2 )
+    shift.y -= corr.rows;
+  return shift;
+}
+
+void PhaseCorrelator::setReference( const cv::Mat &frame )
+{
+  if ( frame.size() != frame_size )
+    prepare(frame.size());
+  analyse(frame, ref);
+}
+
+GlobalMotion PhaseCorrelator::estimate( const cv::Mat &frame )
+{
+  GlobalMotion gm;
+  if ( frame.size() != frame_size )
+    prepare(frame.size());
+  analyse(frame, cur);
+  if ( !hasReference() )
+    return gm;
+
+  // rotation and scale first: the magnitude spectra do not depend on the
+  // translation, and a frame turned back by them only differs by a shift
+  double angle = 0, scale = 1, response = 0;
+  cv::Point2d c((proxy_size.width - 1) * 0.5, (proxy_size.height - 1) * 0.5);
+  const cv::Mat *F = &cur.F;
+  if ( opts.rotation )
+  {
+    cv::Point2d lp_shift = correlate(ref.LF, cur.LF, response);
+    angle = lp_shift.y * CV_PI / LP_ANGLES;
+    scale = exp(-lp_shift.x * log_step);
+
+    double a = scale * cos(angle), b = scale * sin(angle);
+    cv::Mat M = (cv::Mat_<double>(2,3) << a, -b, c.x - a*c.x + b*c.y,
+                                          b,  a, c.y - b*c.x - a*c.y);
+    cv::warpAffine(cur.grey, rotated, M, proxy_size, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_REFLECT);
+    windowedSpectrum(rotated, F_rotated);
+    F = &F_rotated;
+  }
+  cv::Point2d t = correlate(ref.F, *F, response);
+
+  // proxy motion: p -> sR (p - c) + c + sR t
+  double a = scale * cos(angle), b = scale * sin(angle);
+  double dx = a * t.x - b * t.y, dy = b * t.x + a * t.y;
+  cv::Mat M = (cv::Mat_<double>(2,3) << a, -b, c.x + dx - (a*c.x - b*c.y),
+                                        b,  a, c.y + dy - (b*c.x + a*c.y));
+
+  // back to frame pixels; proxy pixel centres sit at s*(p + 0.5) - 0.5
+  double sx = (double) proxy_size.width / frame_size.width;
+  double sy = (double) proxy_size.height / frame_size.height;
+  cv::Mat P = (cv::Mat_<double>(2,3) << sx, 0, 0.5 * (sx - 1),
+                                        0, sy, 0.5 * (sy - 1));
+  cv::Mat full = affine3(P).inv() * affine3(M) * affine3(P);
+
+  gm.T = full.rowRange(0, 2).clone();
+  gm.angle = angle;
+  gm.scale = scale;
+  gm.confidence = response;
+  return gm;
+}
+
+GlobalMotion PhaseCorrelator::track( const cv::Mat &frame )
+{
+  GlobalMotion gm = estimate(frame);
+  std::swap(ref, cur);
+  return gm;
+}
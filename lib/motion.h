@@ -0,0 +1,137 @@
+//
+//  motion.h
+//  Footage_Manipulation
+//
+//  Global motion from FFT phase correlation of a small grey proxy of the
+//  frames. For nadir footage that moves almost only by translation and a
+//  little rotation this is much cheaper than tracking features, and it
+//  still works on water or sand where there are no features to track.
+//  Rotation and scale come from a phase correlation of the log-polar
+//  magnitude spectra (Fourier-Mellin), the translation from the frames
+//  themselves. Each frame is transformed once: its spectra are kept and
+//  reused when it becomes the reference for the next frame.
+//
+//  With an analysis stride the tools estimate the motion of every Nth frame
+//  only and interpolate the transforms of the frames in between on the
+//  motion manifold (see affinePower), dropping back to every frame where
+//  the motion is not calm.
+
+#ifndef __motion_h
+#define __motion_h
+
+#include <opencv2/opencv.hpp>
+
+#include <boost/program_options.hpp>
+
+#include <string>
+#include <vector>
+
+#include "ert.h"
+
+struct MotionOptions
+{
+  MotionOptions() : method("features"), proxy_side(512), rotation(false), min_confidence(0.05), min_vector_inliers(0.3),
+                    stride(1), max_stride_residual(2), max_stride_rotation(0.2) {}
+
+  std::string method;         // "features" (corners, LK, RANSAC), "phase", "hierarchical" or "vectors"
+  int proxy_side;             // longest side of the phase correlation proxy, in pixels
+  bool rotation;              // also estimate rotation and scale (log-polar)
+  double min_confidence;      // below this the tools use the feature path instead
+  double min_vector_inliers;  // "vectors": below this RANSAC inlier share, features are used
+  int stride;                 // frames from one analysed frame to the next while calm
+  double max_stride_residual; // RANSAC inlier residual (pixels) above which the stride drops to 1
+  double max_stride_rotation; // rotation (degrees per frame) above which the stride drops to 1
+  HierarchyOptions hierarchy; // the HierarchicalEstimator of "hierarchical"
+};
+
+// "Motion estimation" options group for the tools' command lines.
+boost::program_options::options_description motionOptions( MotionOptions &opts );
+
+struct GlobalMotion
+{
+  GlobalMotion() : angle(0), scale(1), confidence(0) {}
+
+  cv::Mat T;          // 2x3, reference frame to frame, in full resolution pixels
+  double angle;       // rotation in radians, 0 without MotionOptions::rotation
+  double scale;       // 1 without MotionOptions::rotation
+  double confidence;  // height of the correlation peak: ~1 for a perfect match, ~0 for noise
+};
+
+// The motion a fraction s of the way from the identity to the 2x3 affine
+// T. Rotation and translation move along SE(2), i.e. at constant angular
+// and linear velocity, the remaining scale and shear linearly. s = 1/n
+// gives the per-frame motion of a motion over n frames.
+cv::Mat affinePower( const cv::Mat &T, double s );
+
+// The 2x3 affine a fraction s of the way from A (s = 0) to B (s = 1):
+// A * affinePower(A^-1 * B, s), with 3x3 products.
+cv::Mat affineInterpolate( const cv::Mat &A, const cv::Mat &B, double s );
+
+// Adaptive analysis stride of MotionOptions: the frames of a calm stretch
+// are analysed every stride frames, after a spike every frame, until the
+// motion has been calm for stride analysed frames.
+class AnalysisStride
+{
+public:
+  explicit AnalysisStride( const MotionOptions &opts );
+
+  // Frames from the last analysed frame to the next one.
+  int next() const { return current; }
+
+  // Whether the motion M (2x3, empty when none was found) over span frames
+  // is calm enough to interpolate: found, with a RANSAC inlier residual and
+  // a rotation per frame below the limits.
+  bool calm( const cv::Mat &M, int span, const RansacStats &ransac ) const;
+
+  // Adapts next() to the latest analysed frame.
+  void update( bool calm );
+
+private:
+  int stride, current, calm_run;
+  double max_residual, max_rotation;
+};
+
+class PhaseCorrelator
+{
+public:
+  explicit PhaseCorrelator( const MotionOptions &opts = MotionOptions() );
+
+  // frame is CV_8UC1 (grey or luma) or BGR, at full resolution; the proxy
+  // is made with greyDownscale.
+  void setReference( const cv::Mat &frame );
+  bool hasReference() const { return !ref.F.empty(); }
+
+  // Motion from the reference to frame; the reference is kept.
+  GlobalMotion estimate( const cv::Mat &frame );
+
+  // Motion from the previous frame to frame, which then becomes the
+  // reference. The first call only sets the reference (confidence 0).
+  GlobalMotion track( const cv::Mat &frame );
+
+private:
+  struct Spectra
+  {
+    cv::Mat grey;  // proxy
+    cv::Mat F;     // spectrum of the windowed proxy
+    cv::Mat LF;    // spectrum of the log-polar magnitude spectrum, with rotation
+  };
+
+  void prepare( cv::Size frame_size );
+  void analyse( const cv::Mat &frame, Spectra &s );
+  void windowedSpectrum( const cv::Mat &grey, cv::Mat &F );
+  void logPolarSpectrum( const cv::Mat &F, cv::Mat &LF );
+  cv::Point2d correlate( const cv::Mat &Fa, const cv::Mat &Fb, double &response );
+
+  MotionOptions opts;
+  cv::Size frame_size, proxy_size, dft_size, lp_size;
+  double proxy_scale;  // proxy pixels per frame pixel
+  double log_step;     // log-radius per log-polar column
+
+  // built once per frame size and reused for every frame
+  cv::Mat window, highpass, lp_map;
+  Spectra ref, cur;
+  cv::Mat padded, cross, corr, mag, lp, rotated, F_rotated;
+  std::vector<cv::Mat> planes;
+};
+
+#endif
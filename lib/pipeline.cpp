@@ -0,0 +1,601 @@
+#include "pipeline.h"
+
+#include "ert.h"
+#include "lens.h"
+#include "thread_pool.h"
+#include "tiles.h"
+#include "trace.h"
+#include "warp.h"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+namespace fs = boost::filesystem;
+
+namespace
+{
+
+template <typename T>
+void read_opt( const cv::FileNode &node, const char *key, T &value )
+{
+  cv::FileNode n = node[key];
+  if ( !n.empty() )
+    n >> value;
+}
+
+cv::Mat rigid_affine( double dx, double dy, double da )
+{
+  return (cv::Mat_<double>(2, 3) << cos(da), -sin(da), dx,
+                                    sin(da),  cos(da), dy);
+}
+
+// Keeps the point pairs LK found and, with a calibration, moves both sets
+// into undistorted pixel coordinates.
+void good_pairs( const std::vector<cv::Point2f> &a, const std::vector<cv::Point2f> &b,
+                 const std::vector<uchar> &status, const cv::Mat &intrinsic, const cv::Mat &distcoeffs,
+                 std::vector<cv::Point2f> &a2, std::vector<cv::Point2f> &b2 )
+{
+  a2.clear();
+  b2.clear();
+  for ( size_t i = 0; i < status.size(); ++i )
+  {
+    if ( status[i] )
+    {
+      a2.push_back(a[i]);
+      b2.push_back(b[i]);
+    }
+  }
+  if ( !intrinsic.empty() && !a2.empty() )
+  {
+    std::vector<cv::Point2f> a_u, b_u;
+    undistortPixelPoints(a2, a_u, intrinsic, distcoeffs);
+    undistortPixelPoints(b2, b_u, intrinsic, distcoeffs);
+    a2.swap(a_u);
+    b2.swap(b_u);
+  }
+}
+
+// Renders the output frame for a raw frame and its stabilizing transform T
+// (frame to stabilized, in undistorted coordinates): lens undistortion,
+// stabilization and border crop in a single remap/warp.
+class Renderer
+{
+public:
+  // shared_engine, when not null, is used instead of an engine of
+  // warp_threads of the renderer's own.
+  Renderer( cv::Size _size, int hcrop, const cv::Mat &_undist_map, WarpEngine *shared_engine, int warp_threads )
+    : size(_size), undist_map(_undist_map), engine(shared_engine)
+  {
+    C = cropAffine(size, hcrop, hcrop * size.height / size.width);
+    if ( !engine && warp_threads > 0 )
+    {
+      own_engine.reset(new WarpEngine(warp_threads));
+      engine = own_engine.get();
+    }
+  }
+
+  void render( const cv::Mat &frame, const cv::Mat &T, cv::Mat &out )
+  {
+    TRACE_SCOPE("render");
+    cv::Mat T_inv;
+    cv::invertAffineTransform(T, T_inv);
+    cv::Mat A = composeAffine(T_inv, C);
+    if ( engine && !undist_map.empty() )
+    {
+      engine->warpUndistortAffine(frame, out, undist_map, A, size);
+    }
+    else if ( engine )
+    {
+      engine->warpAffine(frame, out, A, size, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP);
+    }
+    else if ( !undist_map.empty() )
+    {
+      composeUndistortAffine(undist_map, A, size, composed_map);
+      cv::remap(frame, out, composed_map, cv::Mat(), cv::INTER_LINEAR);
+    }
+    else
+    {
+      cv::warpAffine(frame, out, A, size, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP);
+    }
+  }
+
+private:
+  cv::Size size;
+  cv::Mat undist_map, composed_map, C;
+  WarpEngine *engine;
+  std::unique_ptr<WarpEngine> own_engine;
+};
+
+// Cuts every output frame into the job's tiles and encodes them, opening the
+// streams of the next time segment when the frame count reaches it.
+class TileWriter
+{
+public:
+  // The tiles are encoded on shared_pool, or without one on a pool of
+  // threads of the writer's own.
+  TileWriter( const PipelineJob &_job, cv::Size frame_size, double _fps, int total_frames,
+              const FrameSinkOptions &_sink_opts, ThreadPool *shared_pool, int threads )
+    : job(_job), fps(_fps), sink_opts(_sink_opts), segment(-1), written(0), pool(shared_pool)
+  {
+    if ( !pool )
+    {
+      own_pool.reset(new ThreadPool(std::min(ThreadPool::resolveThreads(threads), job.numx * job.numy) - 1));
+      pool = own_pool.get();
+    }
+    segment_len = total_frames > 0 ? std::max(total_frames / job.timesplit, 1) : INT_MAX;
+    for ( int y = 0; y < job.numy; ++y )
+    {
+      for ( int x = 0; x < job.numx; ++x )
+      {
+        if ( (job.tile_x < 0 || job.tile_x == x) && (job.tile_y < 0 || job.tile_y == y) )
+        {
+          rects.push_back(tileRect(frame_size, x, y, job.numx, job.numy, job.overlap));
+          names.push_back(std::to_string((long long) y) + "-" + std::to_string((long long) x));
+        }
+      }
+    }
+    // the tile streams share the segments' memory
+    sink_opts.segment_mb = std::max(sink_opts.segment_mb / std::max((int) rects.size(), 1), 1);
+  }
+
+  void write( const cv::Mat &frame )
+  {
+    int s = std::min(written / segment_len, job.timesplit - 1);
+    if ( s != segment )
+      open(s);
+
+    TRACE_SCOPE("write_tiles");
+    pool->parallelFor((int) sinks.size(), [&](int i) {
+      *sinks[i] << cv::Mat(frame, rects[i]);
+    });
+    written++;
+  }
+
+  // Finishes the streams of the current time segment; throws when one of
+  // them could not be encoded.
+  void close()
+  {
+    for ( size_t i = 0; i < sinks.size(); ++i )
+      sinks[i]->close();
+    sinks.clear();
+  }
+
+private:
+  void open( int s )
+  {
+    close();
+    for ( size_t i = 0; i < rects.size(); ++i )
+    {
+      std::stringstream out_key;
+      out_key << names[i] << "-" << job.first_segment + s;
+      std::string out_fn = (fs::path(job.output_dir) / (out_key.str() + ".avi")).string();
+      sinks.push_back(FrameSink::open(out_fn, fps, rects[i].size(), sink_opts));
+    }
+    segment = s;
+  }
+
+  const PipelineJob &job;
+  double fps;
+  FrameSinkOptions sink_opts;
+  std::vector<cv::Rect> rects;
+  std::vector<std::string> names;  // <y>-<x> of each written tile
+  std::vector<std::unique_ptr<FrameSink> > sinks;
+  int segment, segment_len, written;
+  ThreadPool *pool;
+  std::unique_ptr<ThreadPool> own_pool;
+};
+
+struct Motion
+{
+  Motion() : dx(0), dy(0), da(0) {}
+  Motion( double _dx, double _dy, double _da ) : dx(_dx), dy(_dy), da(_da) {}
+  double dx, dy, da;
+};
+
+}
+
+PipelineResources::PipelineResources( int warp_threads, int tile_threads, int _max_maps )
+  : tile_pool(ThreadPool::resolveThreads(tile_threads) - 1), max_maps(std::max(_max_maps, 1)),
+    hits(0), loads(0)
+{
+  if ( warp_threads > 0 )
+    engine.reset(new WarpEngine(warp_threads));
+}
+
+cv::Mat PipelineResources::undistortMap( const std::string &calib_fn, const std::string &cache_dir, cv::Size size,
+                                         cv::Mat &intrinsic, cv::Mat &distcoeffs )
+{
+  // a calibration rewritten in place is read again
+  boost::system::error_code ec;
+  std::time_t modified = fs::last_write_time(calib_fn, ec);
+  std::stringstream key;
+  key << fs::absolute(calib_fn).string() << "|" << (ec ? 0 : modified) << "|" << cache_dir
+      << "|" << size.width << "x" << size.height;
+
+  // The map is built outside the lock: requests for it meanwhile find its
+  // entry and wait for the future, all others go on.
+  std::promise<LensMap> building;
+  std::shared_future<LensMap> lens;
+  bool build = false;
+  {
+    std::lock_guard<std::mutex> lock(maps_mtx);
+    for ( std::list<CachedMap>::iterator it = maps.begin(); it != maps.end(); ++it )
+    {
+      if ( it->key == key.str() )
+      {
+        maps.splice(maps.begin(), maps, it);
+        lens = it->lens;
+        hits++;
+        break;
+      }
+    }
+    if ( !lens.valid() )
+    {
+      CachedMap cached;
+      cached.key = key.str();
+      cached.lens = lens = building.get_future().share();
+      maps.push_front(cached);
+      // an evicted map that is still being built stays with its waiters
+      if ( maps.size() > max_maps )
+        maps.pop_back();
+      loads++;
+      build = true;
+    }
+  }
+
+  if ( build )
+  {
+    try
+    {
+      LensMap built;
+      if ( !readCalibration(calib_fn, built.intrinsic, built.distcoeffs) )
+        throw std::invalid_argument( "could not read calibration from " + calib_fn );
+      UndistortMaps undist = loadUndistortMaps(built.intrinsic, built.distcoeffs, size, cv::INTER_LINEAR, cache_dir);
+      built.map = undistortFloatMap(undist);
+      building.set_value(built);
+    }
+    catch ( ... )
+    {
+      // the waiters get the error, later requests try again
+      building.set_exception(std::current_exception());
+      std::lock_guard<std::mutex> lock(maps_mtx);
+      for ( std::list<CachedMap>::iterator it = maps.begin(); it != maps.end(); ++it )
+      {
+        if ( it->key == key.str() )
+        {
+          maps.erase(it);
+          break;
+        }
+      }
+    }
+  }
+
+  LensMap loaded = lens.get();
+  intrinsic = loaded.intrinsic;
+  distcoeffs = loaded.distcoeffs;
+  return loaded.map;
+}
+
+long PipelineResources::mapHits() const
+{
+  std::lock_guard<std::mutex> lock(maps_mtx);
+  return hits;
+}
+
+long PipelineResources::mapLoads() const
+{
+  std::lock_guard<std::mutex> lock(maps_mtx);
+  return loads;
+}
+
+PipelineJob readPipelineJob( const std::string &job_fn )
+{
+  cv::FileStorage storage(job_fn, cv::FileStorage::READ);
+  if ( !storage.isOpened() )
+    throw std::invalid_argument( "could not read job file " + job_fn );
+  PipelineJob job;
+  readPipelineEntries(storage.root(), job, job_fn);
+  validatePipelineJob(job, job_fn);
+  return job;
+}
+
+void readPipelineEntries( const cv::FileNode &node, PipelineJob &job, const std::string &where )
+{
+  read_opt(node, "input", job.input);
+  read_opt(node, "output_dir", job.output_dir);
+  read_opt(node, "start_frame", job.start_frame);
+  read_opt(node, "end_frame", job.end_frame);
+
+  cv::FileNode undistort = node["undistort"];
+  read_opt(undistort, "calibfn", job.calib_fn);
+  read_opt(undistort, "cachedir", job.cache_dir);
+
+  cv::FileNode stabilize = node["stabilize"];
+  read_opt(stabilize, "method", job.method);
+  read_opt(stabilize, "radius", job.smoothing_radius);
+  read_opt(stabilize, "hcrop", job.hcrop);
+  read_opt(stabilize, "reference_frame", job.reference_frame);
+  read_opt(stabilize, "ransac_max_iters", job.ransac_max_iters);
+  read_opt(stabilize, "ransac_good_ratio", job.ransac_good_ratio);
+  cv::FileNode corners = stabilize["corners"];
+  if ( !corners.empty() )
+  {
+    job.corners.clear();
+    for ( cv::FileNodeIterator it = corners.begin(); it != corners.end(); )
+    {
+      float x = (float) *it++;
+      if ( it == corners.end() )
+        throw std::invalid_argument( where + ": stabilize.corners needs x y pairs" );
+      float y = (float) *it++;
+      job.corners.push_back(cv::Point2f(x, y));
+    }
+  }
+
+  cv::FileNode split = node["split"];
+  read_opt(split, "numx", job.numx);
+  read_opt(split, "numy", job.numy);
+  read_opt(split, "timesplit", job.timesplit);
+  read_opt(split, "overlap", job.overlap);
+  read_opt(split, "first_segment", job.first_segment);
+  read_opt(split, "tile_x", job.tile_x);
+  read_opt(split, "tile_y", job.tile_y);
+}
+
+void validatePipelineJob( PipelineJob &job, const std::string &where )
+{
+  if ( job.input.empty() )
+    throw std::invalid_argument( where + ": no input" );
+  if ( job.output_dir.empty() )
+    job.output_dir = ".";
+  if ( job.method != "smooth" && job.method != "reference" && job.method != "none" )
+    throw std::invalid_argument( where + ": unknown stabilize method " + job.method );
+  if ( job.hcrop < 0 )
+    job.hcrop = job.method == "reference" ? 30 : 20;
+  if ( job.numx < 1 || job.numy < 1 || job.timesplit < 1 || job.overlap < 0 || job.smoothing_radius < 0 )
+    throw std::invalid_argument( where + ": invalid split or smoothing settings" );
+  if ( job.tile_x >= job.numx || job.tile_y >= job.numy )
+    throw std::invalid_argument( where + ": tile outside the split" );
+  if ( job.start_frame < 0 || (job.end_frame >= 0 && job.end_frame <= job.start_frame) )
+    throw std::invalid_argument( where + ": empty frame range" );
+}
+
+void writePipelineJob( cv::FileStorage &fs, const PipelineJob &job )
+{
+  fs << "input" << job.input;
+  fs << "output_dir" << job.output_dir;
+  fs << "start_frame" << job.start_frame;
+  fs << "end_frame" << job.end_frame;
+  fs << "undistort" << "{" << "calibfn" << job.calib_fn << "cachedir" << job.cache_dir << "}";
+  fs << "stabilize" << "{";
+  fs << "method" << job.method << "radius" << job.smoothing_radius << "hcrop" << job.hcrop;
+  fs << "reference_frame" << job.reference_frame;
+  fs << "ransac_max_iters" << job.ransac_max_iters << "ransac_good_ratio" << job.ransac_good_ratio;
+  if ( !job.corners.empty() )
+  {
+    fs << "corners" << "[:";
+    for ( size_t i = 0; i < job.corners.size(); ++i )
+      fs << job.corners[i].x << job.corners[i].y;
+    fs << "]";
+  }
+  fs << "}";
+  fs << "split" << "{";
+  fs << "numx" << job.numx << "numy" << job.numy << "timesplit" << job.timesplit << "overlap" << job.overlap;
+  fs << "first_segment" << job.first_segment << "tile_x" << job.tile_x << "tile_y" << job.tile_y;
+  fs << "}";
+}
+
+int runPipeline( const PipelineJob &job, const PipelineOptions &opts, const PipelineProgress &progress )
+{
+  // The smoother needs radius frames of motion on both sides of the output
+  // range; its corrections do not depend on where the trajectory starts.
+  const bool smooth = job.method == "smooth";
+  const int radius = smooth ? job.smoothing_radius : 0;
+  FrameSourceOptions src_opts = opts.decode;
+  // motion is tracked on the decoder's luma, BGR is only used for rendering
+  src_opts.luma = job.method != "none";
+  src_opts.start_frame = std::max(job.start_frame - radius, 0);
+  src_opts.end_frame = job.end_frame >= 0 ? job.end_frame + (smooth ? radius + 1 : 0) : -1;
+  if ( smooth )
+  {
+    // the smoother holds radius+2 frames besides the prefetched ones
+    src_opts.buffers = std::max(src_opts.buffers, std::max(src_opts.prefetch, 1) + radius + 6);
+  }
+  std::unique_ptr<FrameSource> source = FrameSource::open(job.input, src_opts);
+  cv::Size size = source->size();
+  int count = source->frameCount();
+  int end = job.end_frame < 0 ? count : (count > 0 ? std::min(job.end_frame, count) : job.end_frame);
+  int total = std::max(end - job.start_frame, 0);
+  auto in_range = [&job]( int index )
+  {
+    return index >= job.start_frame && (job.end_frame < 0 || index < job.end_frame);
+  };
+
+  cv::Mat intrinsic, distcoeffs, undist_map;
+  if ( !job.calib_fn.empty() && opts.resources )
+  {
+    undist_map = opts.resources->undistortMap(job.calib_fn, job.cache_dir.empty() ? defaultMapCacheDir() : job.cache_dir,
+                                              size, intrinsic, distcoeffs);
+  }
+  else if ( !job.calib_fn.empty() )
+  {
+    if ( !readCalibration(job.calib_fn, intrinsic, distcoeffs) )
+      throw std::invalid_argument( "could not read calibration from " + job.calib_fn );
+    UndistortMaps maps = loadUndistortMaps(intrinsic, distcoeffs, size, cv::INTER_LINEAR,
+                                           job.cache_dir.empty() ? defaultMapCacheDir() : job.cache_dir);
+    undist_map = undistortFloatMap(maps);
+  }
+
+  fs::create_directories(job.output_dir);
+  Renderer renderer(size, job.hcrop, undist_map, opts.resources ? opts.resources->warpEngine() : NULL,
+                    opts.warp_threads);
+  TileWriter tiles(job, size, source->fps(), total, opts.encode,
+                   opts.resources ? &opts.resources->tilePool() : NULL, opts.tile_threads);
+
+  cv::Mat out;
+  int done = 0;
+  auto emit = [&]( const Frame &frame, const cv::Mat &T )
+  {
+    if ( !in_range(frame.index) )
+      return;
+    renderer.render(frame.image, T, out);
+    tiles.write(out);
+    done++;
+    if ( progress )
+      progress(done, total);
+  };
+
+  cv::Mat identity = cv::Mat::eye(2, 3, CV_64F);
+  FramePtr first = source->next();
+  if ( !first )
+    return 0;
+
+  if ( job.method == "none" )
+  {
+    emit(*first, identity);
+    first.reset();
+    while ( FramePtr frame = source->next() )
+      emit(*frame, identity);
+  }
+  else if ( job.method == "reference" )
+  {
+    // stabilize: every frame is registered to the reference frame
+    cv::Mat ref_grey;
+    if ( job.reference_frame >= 0 && job.reference_frame != first->index )
+    {
+      FrameSourceOptions ref_opts = opts.decode;
+      ref_opts.start_frame = job.reference_frame;
+      ref_opts.end_frame = job.reference_frame + 1;
+      ref_opts.prefetch = 1;
+      ref_opts.exact_count = false;
+      ref_opts.color = false;
+      ref_opts.luma = true;
+      // the main source has the frame cache open
+      ref_opts.cache_dir.clear();
+      FramePtr ref = FrameSource::open(job.input, ref_opts)->next();
+      if ( !ref )
+        throw std::invalid_argument( "could not read the reference frame" );
+      ref_grey = ref->luma.clone();
+    }
+    else
+    {
+      ref_grey = first->luma.clone();
+    }
+    std::vector<cv::Point2f> ref_corners = job.corners;
+    if ( ref_corners.empty() )
+      cv::goodFeaturesToTrack(ref_grey, ref_corners, 50, 0.01, 30);
+
+    cv::Mat last_T = identity;
+    for ( FramePtr frame = first; frame; frame = source->next() )
+    {
+      first.reset();
+      const cv::Mat &curr_grey = frame->luma;
+      std::vector<cv::Point2f> curr_corners, ref2, curr2;
+      std::vector<uchar> status;
+      std::vector<float> err;
+      if ( !ref_corners.empty() )
+      {
+        TRACE_SCOPE("calcOpticalFlowPyrLK");
+        cv::calcOpticalFlowPyrLK(ref_grey, curr_grey, ref_corners, curr_corners, status, err);
+      }
+      good_pairs(ref_corners, curr_corners, status, intrinsic, distcoeffs, ref2, curr2);
+
+      cv::Mat T = estimateRigidTransformRansac(curr2, ref2, true, job.ransac_max_iters, job.ransac_good_ratio);
+      if ( T.empty() )
+        T = last_T;
+      last_T = T;
+      emit(*frame, T);
+    }
+  }
+  else
+  {
+    // videostab, with the averaging window applied as the frames come in:
+    // frame k is rendered once the motion up to frame k+radius+1 is known,
+    // so only radius+2 decoded frames are held instead of a second decode.
+    // As in videostab, frame k is corrected with the k -> k+1 transform and
+    // the last frame of the video is not written.
+    std::vector<Motion> prev_to_cur, trajectory;
+    std::deque<FramePtr> pending;
+    // the previous frame is always the last pending one, so its luma needs
+    // no copy
+    cv::Mat prev_grey = first->luma, last_T = identity;
+    pending.push_back(first);
+    first.reset();
+
+    int rendered = 0;
+    bool eof = false;
+    while ( !eof )
+    {
+      FramePtr cur = source->next();
+      if ( cur )
+      {
+        const cv::Mat &cur_grey = cur->luma;
+        std::vector<cv::Point2f> prev_corner, cur_corner, prev2, cur2;
+        std::vector<uchar> status;
+        std::vector<float> err;
+        {
+          TRACE_SCOPE("goodFeaturesToTrack");
+          cv::goodFeaturesToTrack(prev_grey, prev_corner, 200, 0.01, 30);
+        }
+        if ( !prev_corner.empty() )
+        {
+          TRACE_SCOPE("calcOpticalFlowPyrLK");
+          cv::calcOpticalFlowPyrLK(prev_grey, cur_grey, prev_corner, cur_corner, status, err);
+        }
+        good_pairs(prev_corner, cur_corner, status, intrinsic, distcoeffs, prev2, cur2);
+
+        cv::Mat T;
+        if ( prev2.size() >= 3 )
+        {
+          TRACE_SCOPE("estimateRigidTransform");
+          T = cv::estimateRigidTransform(prev2, cur2, false);
+        }
+        if ( T.empty() )
+          T = last_T;
+        last_T = T;
+
+        Motion m(T.at<double>(0,2), T.at<double>(1,2), atan2(T.at<double>(1,0), T.at<double>(0,0)));
+        Motion acc = trajectory.empty() ? Motion() : trajectory.back();
+        prev_to_cur.push_back(m);
+        trajectory.push_back(Motion(acc.dx + m.dx, acc.dy + m.dy, acc.da + m.da));
+
+        pending.push_back(cur);
+        prev_grey = cur_grey;
+      }
+      else
+      {
+        eof = true;
+      }
+
+      int n = (int) prev_to_cur.size();
+      while ( rendered < n && (eof || rendered + radius < n) )
+      {
+        Motion sum;
+        int lo = std::max(rendered - radius, 0), hi = std::min(rendered + radius, n - 1);
+        for ( int j = lo; j <= hi; ++j )
+        {
+          sum.dx += trajectory[j].dx;
+          sum.dy += trajectory[j].dy;
+          sum.da += trajectory[j].da;
+        }
+        int count = hi - lo + 1;
+        const Motion &m = prev_to_cur[rendered], &t = trajectory[rendered];
+        cv::Mat T = rigid_affine(m.dx + sum.dx / count - t.dx,
+                                 m.dy + sum.dy / count - t.dy,
+                                 m.da + sum.da / count - t.da);
+        emit(*pending.front(), T);
+        pending.pop_front();
+        rendered++;
+      }
+    }
+  }
+  tiles.close();
+  return done;
+}
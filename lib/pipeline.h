@@ -0,0 +1,148 @@
+//
+//  pipeline.h
+//  Footage_Manipulation
+//
+//  The undistort -> stabilize -> split chain run in-process over a single
+//  decode. Undistortion is folded into the stabilizing warp (one remap per
+//  frame) and the output tiles are encoded straight from the rendered frame,
+//  so no intermediate video is written.
+
+#ifndef __pipeline_h
+#define __pipeline_h
+
+#include <opencv2/opencv.hpp>
+
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "frame_sink.h"
+#include "frame_source.h"
+#include "thread_pool.h"
+#include "warp.h"
+
+// Everything one run needs, read from a job file (see readPipelineJob).
+struct PipelineJob
+{
+  PipelineJob()
+    : start_frame(0), end_frame(-1), method("smooth"), smoothing_radius(30), hcrop(-1),
+      reference_frame(-1), ransac_max_iters(500), ransac_good_ratio(0.9),
+      numx(1), numy(1), timesplit(1), overlap(0), first_segment(0), tile_x(-1), tile_y(-1) {}
+
+  std::string input;        // footage file
+  std::string output_dir;   // tiles are written as <y>-<x>-<t>.avi, as by split_vid
+  int start_frame;
+  int end_frame;            // one past the last frame, -1 = end of video
+
+  // undistort
+  std::string calib_fn;     // empty = footage is already undistorted
+  std::string cache_dir;    // undistortion map cache, empty = defaultMapCacheDir()
+
+  // stabilize
+  std::string method;       // "smooth" (videostab), "reference" (stabilize) or "none"
+  int smoothing_radius;     // smooth: averaging window, in frames on each side
+  int hcrop;                // horizontal border crop, -1 = the tool's default
+  int reference_frame;      // reference: frame the others are registered to, -1 = start_frame
+  std::vector<cv::Point2f> corners;  // reference: points to track, empty = picked automatically
+  int ransac_max_iters;     // reference: RANSAC parameters, as in stabilize
+  double ransac_good_ratio;
+
+  // split
+  int numx, numy;           // spatial tiles
+  int timesplit;            // time segments
+  int overlap;              // pixels shared between neighbouring tiles
+  int first_segment;        // <t> of the first time segment in the tile names
+  int tile_x, tile_y;       // only write this tile, -1 = all
+};
+
+// Reads a job from a cv::FileStorage (YAML or XML) file, e.g.
+//
+//   %YAML:1.0
+//   input: "flight.mp4"
+//   output_dir: "tiles"
+//   undistort: { calibfn: "calib.yml" }
+//   stabilize: { method: "smooth", radius: 30, hcrop: 20 }
+//   split: { numx: 4, numy: 4, timesplit: 2, overlap: 16 }
+//
+// Missing entries keep their defaults. Throws std::invalid_argument on a
+// missing input or an invalid setting.
+PipelineJob readPipelineJob( const std::string &job_fn );
+
+// The two steps of the above, for jobs embedded in larger files (e.g. the
+// shards of a manifest): reads the entries present in node over job, then
+// checks the result and fills in the defaults that depend on other entries.
+// where names the node in error messages.
+void readPipelineEntries( const cv::FileNode &node, PipelineJob &job, const std::string &where );
+void validatePipelineJob( PipelineJob &job, const std::string &where );
+
+// Writes job as the entries of the current map of fs, readable by the above.
+void writePipelineJob( cv::FileStorage &fs, const PipelineJob &job );
+
+// What a long-running process (see pipeline_service.h) keeps from one run
+// to the next: a warp engine and a tile encoding pool that all runs share,
+// concurrent ones too, and the undistortion maps of the calibrations it
+// has seen, least recently used first out.
+class PipelineResources
+{
+public:
+  PipelineResources( int warp_threads, int tile_threads, int max_maps = 8 );
+
+  WarpEngine *warpEngine() { return engine.get(); }  // null with warp_threads 0
+  ThreadPool &tilePool() { return tile_pool; }
+
+  // The float lens map (see undistortFloatMap) of the calibration in
+  // calib_fn for frames of size, with the calibration itself. Read and
+  // built on the first request, again when calib_fn changed; requests for
+  // the same map meanwhile wait for it, all others go on. Throws
+  // std::invalid_argument when calib_fn can not be read.
+  cv::Mat undistortMap( const std::string &calib_fn, const std::string &cache_dir, cv::Size size,
+                        cv::Mat &intrinsic, cv::Mat &distcoeffs );
+
+  long mapHits() const;
+  long mapLoads() const;
+
+private:
+  struct LensMap
+  {
+    cv::Mat intrinsic, distcoeffs, map;
+  };
+  struct CachedMap
+  {
+    std::string key;
+    std::shared_future<LensMap> lens;  // ready once built
+  };
+
+  std::unique_ptr<WarpEngine> engine;
+  ThreadPool tile_pool;
+  size_t max_maps;
+  std::list<CachedMap> maps;  // most recently used first
+  mutable std::mutex maps_mtx;
+  long hits, loads;
+};
+
+struct PipelineOptions
+{
+  PipelineOptions() : warp_threads(0), tile_threads(0), resources(NULL) {}
+
+  FrameSourceOptions decode;
+  FrameSinkOptions encode;
+  int warp_threads;   // striped warp engine threads, 0 leaves warping to OpenCV
+  int tile_threads;   // tiles encoded in parallel, 0 = one thread per core
+  PipelineResources *resources;  // when set, used instead of the two above and of fresh maps
+};
+
+// Called after each output frame with the frames done and the expected total.
+typedef std::function<void(int, int)> PipelineProgress;
+
+// Runs the job. Returns the number of frames written to every tile stream.
+// Frames outside [start_frame, end_frame) that the smoothing window needs
+// are decoded but not written, so a job covering part of the video writes
+// the same frames as the corresponding part of a job over all of it.
+int runPipeline( const PipelineJob &job, const PipelineOptions &opts,
+                 const PipelineProgress &progress = PipelineProgress() );
+
+#endif
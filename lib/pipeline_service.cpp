@@ -0,0 +1,493 @@
+#include "pipeline_service.h"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace fs = boost::filesystem;
+
+namespace
+{
+
+// A job taken from the spool (spooled is set) or from a socket client
+// (fd is the connection, answered when the job is over).
+struct Request
+{
+  Request() : fd(-1) {}
+
+  std::string name;  // for the log
+  std::string job_fn;
+  fs::path spooled;  // running/<name>
+  int fd;
+};
+
+sockaddr_un socket_address( const std::string &path )
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if ( path.empty() || path.size() >= sizeof(addr.sun_path) )
+    throw std::runtime_error( "invalid socket path " + path );
+  strcpy(addr.sun_path, path.c_str());
+  return addr;
+}
+
+int connect_to( const std::string &path )
+{
+  sockaddr_un addr = socket_address(path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ( fd < 0 )
+    return -1;
+  if ( connect(fd, (sockaddr *) &addr, sizeof(addr)) != 0 )
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int open_listener( const std::string &path )
+{
+  int other = connect_to(path);
+  if ( other >= 0 )
+  {
+    close(other);
+    throw std::runtime_error( "another service is listening on " + path );
+  }
+  // the socket of a service that died
+  unlink(path.c_str());
+
+  sockaddr_un addr = socket_address(path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ( fd < 0 || bind(fd, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 64) != 0 )
+  {
+    std::string error = strerror(errno);
+    if ( fd >= 0 )
+      close(fd);
+    throw std::runtime_error( "could not listen on " + path + ": " + error );
+  }
+  return fd;
+}
+
+void send_line( int fd, const std::string &line )
+{
+  std::string data = line + "\n";
+  size_t sent = 0;
+  while ( sent < data.size() )
+  {
+    // a client that went away must not take the service down with SIGPIPE
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if ( n <= 0 )
+      return;
+    sent += n;
+  }
+}
+
+// A socket client whose job line has not all arrived yet. The lines are
+// read as they come on the service's loop, so a slow client holds up no
+// one; one that sends nothing for CLIENT_TIMEOUT_MS is dropped.
+struct Client
+{
+  int fd;
+  std::string line;
+  std::chrono::steady_clock::time_point deadline;
+};
+
+const int CLIENT_TIMEOUT_MS = 5000;
+
+void set_blocking( int fd, bool blocking )
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+
+// Reads what client sent so far. Returns false when the client is done
+// with: its line is complete (a non-empty line) or it closed or failed (an
+// empty one).
+bool read_some( Client &client )
+{
+  char buf[512];
+  while ( true )
+  {
+    ssize_t n = recv(client.fd, buf, sizeof(buf), 0);
+    if ( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+      return true;
+    if ( n <= 0 )
+    {
+      client.line.clear();
+      return false;
+    }
+    client.line.append(buf, n);
+    size_t end = client.line.find('\n');
+    if ( end != std::string::npos )
+    {
+      client.line.resize(end);
+      return false;
+    }
+  }
+}
+
+// False when the peer closed the connection before a newline.
+bool read_line( int fd, std::string &line )
+{
+  line.clear();
+  char c;
+  while ( recv(fd, &c, 1, 0) == 1 )
+  {
+    if ( c == '\n' )
+      return true;
+    line += c;
+  }
+  return false;
+}
+
+std::string one_line( std::string s )
+{
+  std::replace(s.begin(), s.end(), '\n', ' ');
+  return s;
+}
+
+// Claims up to max jobs of the spool, oldest name first, by moving them
+// from incoming/ to running/. A job another service renamed first is
+// simply gone.
+std::vector<Request> claim_spooled( const fs::path &spool, size_t max )
+{
+  std::vector<std::string> names;
+  boost::system::error_code ec;
+  for ( fs::directory_iterator it(spool / "incoming", ec), end; !ec && it != end; it.increment(ec) )
+  {
+    std::string name = it->path().filename().string();
+    if ( name[0] != '.' && fs::is_regular_file(it->status()) )
+      names.push_back(name);
+  }
+  std::sort(names.begin(), names.end());
+
+  std::vector<Request> claimed;
+  for ( size_t i = 0; i < names.size() && claimed.size() < max; ++i )
+  {
+    Request request;
+    request.name = names[i];
+    request.spooled = spool / "running" / names[i];
+    fs::rename(spool / "incoming" / names[i], request.spooled, ec);
+    if ( ec )
+      continue;
+    // a rename keeps the time of the job file, the claim starts now
+    fs::last_write_time(request.spooled, std::time(0), ec);
+    request.job_fn = request.spooled.string();
+    claimed.push_back(request);
+  }
+  return claimed;
+}
+
+// Touches the claims in running/ of this service's jobs and moves the ones
+// no service touched for stale_secs back to incoming/. Returns their names.
+std::vector<std::string> refresh_claims( const fs::path &spool, const std::set<std::string> &own, int stale_secs )
+{
+  std::vector<std::string> requeued;
+  std::time_t now = std::time(0);
+  boost::system::error_code ec;
+  for ( fs::directory_iterator it(spool / "running", ec), end; !ec && it != end; it.increment(ec) )
+  {
+    std::string name = it->path().filename().string();
+    boost::system::error_code file_ec;
+    if ( own.count(name) )
+    {
+      fs::last_write_time(it->path(), now, file_ec);
+      continue;
+    }
+    std::time_t touched = fs::last_write_time(it->path(), file_ec);
+    if ( file_ec || now - touched < stale_secs )
+      continue;
+    // another service may be requeuing it too, only one rename succeeds
+    fs::rename(it->path(), spool / "incoming" / name, file_ec);
+    if ( !file_ec )
+      requeued.push_back(name);
+  }
+  return requeued;
+}
+
+// Runs one request and reports it to its spool or client. Returns whether
+// the job succeeded.
+bool run_request( const Request &request, const PipelineOptions &opts, int job_threads, std::string &reply )
+{
+  bool ok = false;
+  int64 t0 = cv::getTickCount();
+  try
+  {
+    PipelineJob job = readPipelineJob(request.job_fn);
+    // the job's share of the budget, for its decoder and for its encoders
+    // together, unless the options set them
+    PipelineOptions job_opts = opts;
+    if ( job_opts.decode.decode_threads <= 0 )
+      job_opts.decode.decode_threads = job_threads;
+    if ( job_opts.encode.encode_threads <= 0 )
+    {
+      int tiles = (job.tile_x < 0 ? job.numx : 1) * (job.tile_y < 0 ? job.numy : 1);
+      int streams = tiles * std::max(job_opts.encode.segments, 1);
+      job_opts.encode.encode_threads = std::max(job_threads / streams, 1);
+    }
+    int frames = runPipeline(job, job_opts);
+    std::stringstream done;
+    done << "done " << frames << " " << (cv::getTickCount() - t0) / cv::getTickFrequency();
+    reply = done.str();
+    ok = true;
+  }
+  catch ( std::exception &e )
+  {
+    reply = "failed " + one_line(e.what());
+  }
+
+  if ( !request.spooled.empty() )
+  {
+    fs::path dir = request.spooled.parent_path().parent_path() / (ok ? "done" : "failed");
+    fs::path moved = dir / request.name;
+    boost::system::error_code ec;
+    fs::rename(request.spooled, moved, ec);
+    if ( !ok )
+      std::ofstream(moved.string() + ".error") << reply.substr(7) << std::endl;
+  }
+  if ( request.fd >= 0 )
+  {
+    send_line(request.fd, reply);
+    close(request.fd);
+  }
+  return ok;
+}
+
+}
+
+ServiceStats runService( const ServiceOptions &service_opts, PipelineOptions opts,
+                         const std::atomic<bool> &stop, std::ostream &log )
+{
+  if ( service_opts.spool_dir.empty() && service_opts.socket_path.empty() )
+    throw std::invalid_argument( "the service needs a spool directory or a socket" );
+
+  PipelineResources resources(opts.warp_threads, opts.tile_threads, service_opts.max_maps);
+  opts.resources = &resources;
+  const size_t slots = std::max(service_opts.jobs, 1);
+  const int job_threads = std::max(ThreadPool::resolveThreads(service_opts.threads) / (int) slots, 1);
+  // and so are the segments' queues
+  opts.encode.segment_mb = std::max(opts.encode.segment_mb / (int) slots, 1);
+
+  fs::path spool(service_opts.spool_dir);
+  if ( !spool.empty() )
+  {
+    const char *dirs[] = { "incoming", "running", "done", "failed" };
+    for ( size_t i = 0; i < 4; ++i )
+      fs::create_directories(spool / dirs[i]);
+  }
+  int listener = service_opts.socket_path.empty() ? -1 : open_listener(service_opts.socket_path);
+  if ( listener >= 0 )
+    set_blocking(listener, false);
+  std::vector<Client> clients;
+
+  std::deque<Request> queue;
+  std::mutex mtx;
+  std::condition_variable cond;
+  bool closing = false;
+  size_t busy = 0;
+  std::set<std::string> own;  // names of the spooled jobs taken
+  ServiceStats stats;
+  const int refresh_secs = std::max(service_opts.stale_secs / 4, 1);
+  std::time_t refreshed = 0;
+
+  auto work = [&]() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while ( true )
+    {
+      cond.wait(lock, [&] { return closing || !queue.empty(); });
+      if ( queue.empty() )
+        return;
+      Request request = queue.front();
+      queue.pop_front();
+      busy++;
+      lock.unlock();
+
+      std::string reply;
+      bool ok = run_request(request, opts, job_threads, reply);
+
+      lock.lock();
+      busy--;
+      if ( !request.spooled.empty() )
+        own.erase(request.name);
+      ok ? stats.completed++ : stats.failed++;
+      log << "Job " << request.name << ": " << reply << std::endl;
+    }
+  };
+  auto refresh = [&]() {
+    if ( spool.empty() || std::time(0) - refreshed < refresh_secs )
+      return;
+    refreshed = std::time(0);
+    std::set<std::string> taking;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      taking = own;
+    }
+    std::vector<std::string> requeued = refresh_claims(spool, taking, service_opts.stale_secs);
+    std::lock_guard<std::mutex> lock(mtx);
+    for ( size_t i = 0; i < requeued.size(); ++i )
+      log << "Job " << requeued[i] << ": abandoned by its service, back in incoming" << std::endl;
+  };
+  std::vector<std::thread> workers;
+  for ( size_t i = 0; i < slots; ++i )
+    workers.push_back(std::thread(work));
+
+  log << "Serving with " << slots << " job slots of " << job_threads << " decoding and encoding threads";
+  if ( !spool.empty() )
+    log << ", spool " << spool.string();
+  if ( listener >= 0 )
+    log << ", socket " << service_opts.socket_path;
+  log << std::endl;
+
+  while ( !stop )
+  {
+    // spooled jobs are only taken while a slot is free, so that services
+    // sharing the spool share its jobs
+    if ( !spool.empty() )
+    {
+      size_t taken;
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        taken = busy + queue.size();
+      }
+      if ( taken < slots )
+      {
+        std::vector<Request> claimed = claim_spooled(spool, slots - taken);
+        std::lock_guard<std::mutex> lock(mtx);
+        for ( size_t i = 0; i < claimed.size(); ++i )
+        {
+          log << "Job " << claimed[i].name << ": queued" << std::endl;
+          own.insert(claimed[i].name);
+          queue.push_back(claimed[i]);
+        }
+        cond.notify_all();
+      }
+      refresh();
+    }
+
+    if ( listener < 0 )
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(service_opts.poll_ms));
+      continue;
+    }
+    // waits for new clients and the lines of the connected ones until the
+    // next spool scan; a signal ends the wait early
+    std::vector<pollfd> fds(clients.size() + 1);
+    fds[0].fd = listener;
+    for ( size_t i = 0; i < clients.size(); ++i )
+      fds[i + 1].fd = clients[i].fd;
+    for ( size_t i = 0; i < fds.size(); ++i )
+    {
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    if ( poll(&fds[0], fds.size(), service_opts.poll_ms) < 0 )
+      continue;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::vector<Client> waiting;
+    for ( size_t i = 0; i < clients.size(); ++i )
+    {
+      Client &client = clients[i];
+      bool reading = fds[i + 1].revents ? read_some(client) : true;
+      if ( reading && now < client.deadline )
+      {
+        waiting.push_back(client);
+        continue;
+      }
+      // timed out, gone, or sent an empty line
+      if ( reading || client.line.empty() )
+      {
+        close(client.fd);
+        continue;
+      }
+      // the reply is written by the job's worker, in one go
+      set_blocking(client.fd, true);
+      Request request;
+      request.job_fn = client.line;
+      request.name = fs::path(request.job_fn).filename().string();
+      request.fd = client.fd;
+      std::lock_guard<std::mutex> lock(mtx);
+      log << "Job " << request.name << ": queued from the socket" << std::endl;
+      queue.push_back(request);
+      cond.notify_all();
+    }
+    clients.swap(waiting);
+
+    if ( fds[0].revents & POLLIN )
+    {
+      int fd;
+      while ( (fd = accept(listener, NULL, NULL)) >= 0 )
+      {
+        set_blocking(fd, false);
+        Client client;
+        client.fd = fd;
+        client.deadline = now + std::chrono::milliseconds(CLIENT_TIMEOUT_MS);
+        clients.push_back(client);
+      }
+    }
+  }
+
+  // the jobs already taken are finished, their clients are waiting; the
+  // ones that had not sent their job yet are turned away
+  if ( listener >= 0 )
+  {
+    for ( size_t i = 0; i < clients.size(); ++i )
+      close(clients[i].fd);
+    close(listener);
+    unlink(service_opts.socket_path.c_str());
+  }
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    closing = true;
+  }
+  cond.notify_all();
+  // the claims of the jobs still running are kept fresh until they are over
+  while ( true )
+  {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      if ( own.empty() )
+        break;
+    }
+    refresh();
+    std::this_thread::sleep_for(std::chrono::milliseconds(service_opts.poll_ms));
+  }
+  for ( size_t i = 0; i < workers.size(); ++i )
+    workers[i].join();
+  log << "Undistortion maps: " << resources.mapLoads() << " loaded, " << resources.mapHits() << " reused" << std::endl;
+  return stats;
+}
+
+std::string submitJob( const std::string &socket_path, const std::string &job_fn )
+{
+  int fd = connect_to(socket_path);
+  if ( fd < 0 )
+    throw std::runtime_error( "could not reach a service at " + socket_path );
+  send_line(fd, fs::absolute(job_fn).string());
+  std::string reply;
+  bool answered = read_line(fd, reply);
+  close(fd);
+  if ( !answered )
+    throw std::runtime_error( "the service at " + socket_path + " closed the connection" );
+  return reply;
+}
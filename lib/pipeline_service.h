@@ -0,0 +1,71 @@
+//
+//  pipeline_service.h
+//  Footage_Manipulation
+//
+//  Long-running pipeline service. Scripts that stabilize thousands of short
+//  clips otherwise pay for a process start, the library and codec set-up,
+//  the thread pools and the calibration and undistortion maps of every clip
+//  all over again. The service pays for them once: it takes job files (see
+//  readPipelineJob) from a spool directory and from a local Unix socket,
+//  and runs a few of them at a time. The jobs share one warp engine, one
+//  tile encoding pool and the undistortion maps (PipelineResources). The
+//  codec threads come from a budget split between the job slots: a job
+//  decodes with its share and its tile streams encode with a part of it
+//  each (at least one thread). Besides, every job has its decoder and one
+//  queue thread per tile stream, which mostly wait.
+//
+//  The spool directory holds:
+//    incoming/<name>   jobs to run; write them elsewhere and rename them in
+//    running/<name>    claimed by a service (claims are renames, so several
+//                      services can share a spool); the service keeps
+//                      touching its claims, and a claim left untouched for
+//                      stale_secs (its service died) goes back to incoming/
+//    done/<name>       finished
+//    failed/<name>     failed, with the error in failed/<name>.error
+//
+//  A socket client sends the path of a job file on one line and gets one
+//  line back when the job is over: "done <frames> <seconds>" or
+//  "failed <error>". Paths in served jobs are relative to the service's
+//  working directory, so clients best use absolute ones.
+
+#ifndef __pipeline_service_h
+#define __pipeline_service_h
+
+#include <atomic>
+#include <ostream>
+#include <string>
+
+#include "pipeline.h"
+
+struct ServiceOptions
+{
+  ServiceOptions() : jobs(2), threads(0), poll_ms(500), stale_secs(600), max_maps(8) {}
+
+  std::string spool_dir;    // empty = no spool
+  std::string socket_path;  // empty = no socket
+  int jobs;                 // jobs run at once
+  int threads;              // codec threads of all jobs together, 0 = one per core
+  int poll_ms;              // interval of the spool scans
+  int stale_secs;           // an untouched claim older than this is run again
+  int max_maps;             // undistortion maps kept
+};
+
+struct ServiceStats
+{
+  ServiceStats() : completed(0), failed(0) {}
+
+  int completed;
+  int failed;
+};
+
+// Runs the jobs of the spool and the socket with opts (whose resources it
+// sets up itself) until stop is set, then finishes the jobs it has taken.
+ServiceStats runService( const ServiceOptions &service_opts, PipelineOptions opts,
+                         const std::atomic<bool> &stop, std::ostream &log );
+
+// Submits job_fn to the service listening on socket_path and waits for the
+// job to finish. Returns the service's reply; throws std::runtime_error
+// when the service can not be reached.
+std::string submitJob( const std::string &socket_path, const std::string &job_fn );
+
+#endif
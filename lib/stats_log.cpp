@@ -0,0 +1,119 @@
+#include "stats_log.h"
+
+#include <stdint.h>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+
+const char MAGIC[4] = { 'F', 'M', 'S', 'L' };
+const uint32_t VERSION = 1;
+const uint32_t RECORD_SIZE = 40;
+
+void put_u32( unsigned char *p, uint32_t v )
+{
+  p[0] = (unsigned char) v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
+}
+
+uint32_t get_u32( const unsigned char *p )
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+void put_f32( unsigned char *p, double v )
+{
+  float f = (float) v;
+  uint32_t u;
+  memcpy(&u, &f, 4);
+  put_u32(p, u);
+}
+
+double get_f32( const unsigned char *p )
+{
+  uint32_t u = get_u32(p);
+  float f;
+  memcpy(&f, &u, 4);
+  return f;
+}
+
+}
+
+StatsLog::StatsLog( const std::string &path, const std::string &source )
+  : out(path.c_str(), std::ios::binary | std::ios::trunc)
+{
+  if ( !out )
+    throw std::runtime_error( "could not open " + path + " for writing" );
+
+  // magic, version, record size, source length, source
+  unsigned char header[16];
+  memcpy(header, MAGIC, 4);
+  put_u32(header + 4, VERSION);
+  put_u32(header + 8, RECORD_SIZE);
+  put_u32(header + 12, (uint32_t) source.size());
+  out.write((const char *) header, sizeof(header));
+  out.write(source.data(), source.size());
+  out.flush();
+}
+
+void StatsLog::write( const FrameStats &s )
+{
+  // frame, flags, result, 2 reserved bytes, points, inliers, best inliers,
+  // iterations, then as float: residual, threshold, RANSAC ms, track ms
+  unsigned char r[RECORD_SIZE] = { 0 };
+  put_u32(r, (uint32_t) s.frame);
+  r[4] = (unsigned char) s.flags;
+  r[5] = (unsigned char) s.ransac.result;
+  put_u32(r + 8, (uint32_t) s.ransac.points);
+  put_u32(r + 12, (uint32_t) s.ransac.inliers);
+  put_u32(r + 16, (uint32_t) s.ransac.best_inliers);
+  put_u32(r + 20, (uint32_t) s.ransac.iterations);
+  put_f32(r + 24, s.ransac.residual);
+  put_f32(r + 28, s.ransac.threshold);
+  put_f32(r + 32, s.ransac.ms);
+  put_f32(r + 36, s.track_ms);
+  out.write((const char *) r, sizeof(r));
+}
+
+std::vector<FrameStats> readStatsLog( const std::string &path, std::string *source )
+{
+  std::ifstream in(path.c_str(), std::ios::binary);
+  unsigned char header[16];
+  if ( !in.read((char *) header, sizeof(header)) || memcmp(header, MAGIC, 4) != 0 )
+    throw std::runtime_error( path + " is not a stats log" );
+  if ( get_u32(header + 4) != VERSION )
+    throw std::runtime_error( path + ": unsupported stats log version" );
+  uint32_t record_size = get_u32(header + 8);
+  if ( record_size < RECORD_SIZE )
+    throw std::runtime_error( path + ": stats log records too small" );
+
+  std::string name(get_u32(header + 12), '\0');
+  if ( !name.empty() && !in.read(&name[0], name.size()) )
+    throw std::runtime_error( path + ": truncated stats log header" );
+  if ( source )
+    *source = name;
+
+  // later versions may append fields to the records; they are skipped
+  std::vector<FrameStats> records;
+  std::vector<unsigned char> r(record_size);
+  while ( in.read((char *) &r[0], record_size) )
+  {
+    FrameStats s;
+    s.frame = (int) get_u32(&r[0]);
+    s.flags = r[4];
+    s.ransac.result = r[5];
+    s.ransac.points = (int) get_u32(&r[8]);
+    s.ransac.inliers = (int) get_u32(&r[12]);
+    s.ransac.best_inliers = (int) get_u32(&r[16]);
+    s.ransac.iterations = (int) get_u32(&r[20]);
+    s.ransac.residual = get_f32(&r[24]);
+    s.ransac.threshold = get_f32(&r[28]);
+    s.ransac.ms = get_f32(&r[32]);
+    s.track_ms = get_f32(&r[36]);
+    records.push_back(s);
+  }
+  return records;
+}
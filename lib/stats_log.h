@@ -0,0 +1,58 @@
+//
+//  stats_log.h
+//  Footage_Manipulation
+//
+//  Compact binary log of the per-frame motion estimation statistics, which
+//  the tools write with --stats-log and stats_report reads back to find the
+//  slow frames and badly tracked segments of a whole archive. A log is a
+//  header (magic, version, record size, source name) followed by one fixed
+//  size little endian record per frame, so a tool that dies mid-video
+//  leaves a readable log of the frames it did.
+
+#ifndef __stats_log_h
+#define __stats_log_h
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ert.h"
+
+struct FrameStats
+{
+  FrameStats() : frame(-1), flags(0), track_ms(0) {}
+
+  // flags
+  enum
+  {
+    REUSED = 1,        // no estimate, the previous transform was used
+    PHASE = 2,         // estimated by phase correlation, ransac is empty
+    HIERARCHICAL = 4,  // points refined by the HierarchicalEstimator
+    VECTORS = 8        // fitted to the codec's motion vectors
+  };
+
+  int frame;          // frame number in the video
+  int flags;
+  RansacStats ransac;
+  double track_ms;    // the whole estimate of the frame: tracking and RANSAC
+};
+
+class StatsLog
+{
+public:
+  // Creates path, recording source (usually the footage) in the header.
+  // Throws std::runtime_error when it cannot be written.
+  StatsLog( const std::string &path, const std::string &source );
+
+  void write( const FrameStats &s );
+
+private:
+  std::ofstream out;
+};
+
+// The records of the log at path, and its source when not NULL. A truncated
+// last record is ignored. Throws std::runtime_error on files that are not
+// stats logs.
+std::vector<FrameStats> readStatsLog( const std::string &path, std::string *source = 0 );
+
+#endif
@@ -0,0 +1,127 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+ThreadPool::ThreadPool( int num_threads )
+  : stopping(false)
+{
+  for ( int i = 0; i < num_threads; ++i )
+    threads.push_back(std::thread(&ThreadPool::worker, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = true;
+  }
+  cond.notify_all();
+  for ( size_t i = 0; i < threads.size(); ++i )
+    threads[i].join();
+}
+
+int ThreadPool::resolveThreads( int requested )
+{
+  if ( requested > 0 )
+    return requested;
+  int hw = (int) std::thread::hardware_concurrency();
+  return hw > 0 ? hw : 1;
+}
+
+std::future<void> ThreadPool::submit( std::function<void()> task )
+{
+  std::packaged_task<void()> packaged(task);
+  std::future<void> result = packaged.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    tasks.push(std::move(packaged));
+  }
+  cond.notify_one();
+  return result;
+}
+
+void ThreadPool::worker()
+{
+  while ( true )
+  {
+    std::packaged_task<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cond.wait(lock, [this] { return stopping || !tasks.empty(); });
+      if ( tasks.empty() )
+        return;
+      task = std::move(tasks.front());
+      tasks.pop();
+    }
+    task();
+  }
+}
+
+namespace
+{
+  // Shared between the caller of parallelFor and the helpers it queued, so
+  // helpers that only get to run after the loop finished find nothing to do.
+  struct ParallelForState
+  {
+    ParallelForState( int _n, const std::function<void(int)> &_body )
+      : n(_n), body(_body), next(0), done(0) {}
+
+    void run()
+    {
+      int i;
+      while ( (i = next.fetch_add(1)) < n )
+      {
+        try
+        {
+          body(i);
+        }
+        catch ( ... )
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          if ( !error )
+            error = std::current_exception();
+        }
+        if ( done.fetch_add(1) + 1 == n )
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          cond.notify_all();
+        }
+      }
+    }
+
+    int n;
+    std::function<void(int)> body;
+    std::atomic<int> next;
+    std::atomic<int> done;
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::exception_ptr error;
+  };
+}
+
+void ThreadPool::parallelFor( int n, const std::function<void(int)> &body )
+{
+  if ( n <= 0 )
+    return;
+  if ( n == 1 || threads.empty() )
+  {
+    for ( int i = 0; i < n; ++i )
+      body(i);
+    return;
+  }
+
+  std::shared_ptr<ParallelForState> state = std::make_shared<ParallelForState>(n, body);
+  int helpers = std::min(n - 1, size());
+  for ( int h = 0; h < helpers; ++h )
+    submit([state] { state->run(); });
+
+  state->run();
+
+  std::unique_lock<std::mutex> lock(state->mtx);
+  state->cond.wait(lock, [&state] { return state->done.load() == state->n; });
+  if ( state->error )
+    std::rethrow_exception(state->error);
+}
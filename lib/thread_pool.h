@@ -0,0 +1,52 @@
+//
+//  thread_pool.h
+//  Footage_Manipulation
+//
+//  Fixed size pool of worker threads shared by the tools for intra-frame
+//  (stripes, tiles) and frame-level parallelism.
+
+#ifndef __thread_pool_h
+#define __thread_pool_h
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+  // Starts exactly num_threads workers; pass resolveThreads(n) to turn a
+  // "0 means all cores" option into a count.
+  explicit ThreadPool( int num_threads );
+  ~ThreadPool();
+
+  ThreadPool( const ThreadPool& ) = delete;
+  ThreadPool& operator=( const ThreadPool& ) = delete;
+
+  int size() const { return (int) threads.size(); }
+
+  // Queues a task; the future reports completion and rethrows its exceptions.
+  std::future<void> submit( std::function<void()> task );
+
+  // Calls body(i) for every i in [0, n) on the pool and the calling thread
+  // and returns once all calls are done. Safe to call from a pool thread.
+  void parallelFor( int n, const std::function<void(int)> &body );
+
+  // Number of threads for a "--threads"-style option value (<= 0: one per core).
+  static int resolveThreads( int requested );
+
+private:
+  void worker();
+
+  std::vector<std::thread> threads;
+  std::queue<std::packaged_task<void()> > tasks;
+  std::mutex mtx;
+  std::condition_variable cond;
+  bool stopping;
+};
+
+#endif
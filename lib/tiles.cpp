@@ -0,0 +1,71 @@
+#include "tiles.h"
+
+#include "lens.h"
+#include "trace.h"
+#include "warp_kernel.h"
+
+#include <algorithm>
+
+cv::Rect tileRect( cv::Size frame, int x, int y, int numx, int numy, int overlap )
+{
+  int rect_width = frame.width / numx;
+  int rect_height = frame.height / numy;
+  cv::Rect r(x * rect_width, y * rect_height, rect_width, rect_height);
+  if ( x > 0 )
+  {
+    r.x -= overlap;
+    r.width += overlap;
+  }
+  if ( y > 0 )
+  {
+    r.y -= overlap;
+    r.height += overlap;
+  }
+  if ( x != numx - 1 )
+    r.width += overlap;
+  if ( y != numy - 1 )
+    r.height += overlap;
+  return r;
+}
+
+cv::Mat tileAffine( const cv::Mat &A, cv::Rect tile )
+{
+  cv::Mat At;
+  A.convertTo(At, CV_64F);
+  At.at<double>(0,2) += At.at<double>(0,0) * tile.x + At.at<double>(0,1) * tile.y;
+  At.at<double>(1,2) += At.at<double>(1,0) * tile.x + At.at<double>(1,1) * tile.y;
+  return At;
+}
+
+TileRenderer::TileRenderer( const std::vector<cv::Rect> &tiles, const cv::Mat &_undist_map, int threads )
+  : rects(tiles), undist_map(_undist_map), outs(tiles.size()), maps(tiles.size()),
+    pool(std::min(ThreadPool::resolveThreads(threads), std::max((int) tiles.size(), 1)) - 1)
+{
+}
+
+void TileRenderer::render( const cv::Mat &frame, const cv::Mat &A,
+                           const std::function<void(int, const cv::Mat &)> &consume )
+{
+  TRACE_SCOPE("render_tiles");
+  pool.parallelFor((int) rects.size(), [&](int i) {
+    cv::Mat At = tileAffine(A, rects[i]);
+    {
+      TRACE_SCOPE("warp_tile");
+      if ( undist_map.empty() && nearIdentityWarpable(frame, At) )
+      {
+        outs[i].create(rects[i].size(), frame.type());
+        warpNearIdentity(frame, outs[i], At);
+      }
+      else if ( undist_map.empty() )
+      {
+        cv::warpAffine(frame, outs[i], At, rects[i].size(), cv::INTER_LINEAR | cv::WARP_INVERSE_MAP);
+      }
+      else
+      {
+        composeUndistortAffine(undist_map, At, rects[i].size(), maps[i]);
+        cv::remap(frame, outs[i], maps[i], cv::Mat(), cv::INTER_LINEAR);
+      }
+    }
+    consume(i, outs[i]);
+  });
+}
@@ -0,0 +1,54 @@
+//
+//  tiles.h
+//  Footage_Manipulation
+//
+//  The split_vid tiling, and rendering a warped frame tile by tile: each
+//  tile is warped on its own with the frame's affine shifted to the tile,
+//  so the full output frame never exists and every tile can go straight to
+//  its own encoder from the thread that rendered it.
+
+#ifndef __tiles_h
+#define __tiles_h
+
+#include <opencv2/opencv.hpp>
+
+#include <functional>
+#include <vector>
+
+#include "thread_pool.h"
+
+// Tile (x, y) of a numx x numy split of frame: equal tiles, grown by
+// overlap towards every neighbouring tile, as split_vid cuts them.
+cv::Rect tileRect( cv::Size frame, int x, int y, int numx, int numy, int overlap );
+
+// Inverse (output to source) affine A of a whole output frame, restricted
+// to the output pixels of tile: tile pixel (0,0) is output pixel tile.tl().
+cv::Mat tileAffine( const cv::Mat &A, cv::Rect tile );
+
+class TileRenderer
+{
+public:
+  // tiles are rectangles of the output frame. With an undist_map (see
+  // undistortFloatMap) the source frames are distorted and the lens is
+  // undone in the same remap. threads <= 0 uses one thread per core, at
+  // most one per tile.
+  TileRenderer( const std::vector<cv::Rect> &tiles, const cv::Mat &undist_map = cv::Mat(),
+                int threads = 0 );
+
+  // Warps frame by A (output to source, INTER_LINEAR) into every tile and
+  // calls consume(i, pixels) for tile i on the thread that rendered it;
+  // the pixels are reused by the next call. Returns once all tiles are
+  // consumed.
+  void render( const cv::Mat &frame, const cv::Mat &A,
+               const std::function<void(int, const cv::Mat &)> &consume );
+
+  const std::vector<cv::Rect> &tiles() const { return rects; }
+
+private:
+  std::vector<cv::Rect> rects;
+  cv::Mat undist_map;
+  std::vector<cv::Mat> outs, maps;  // per tile, kept between frames
+  ThreadPool pool;
+};
+
+#endif
@@ -0,0 +1,275 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace po = boost::program_options;
+
+std::atomic<bool> trace_enabled(false);
+
+namespace
+{
+
+struct TraceEvent
+{
+  const char *name;
+  int64_t start_ns;
+  int64_t end_ns;
+};
+
+// One per thread. The owner appends, the writer reads at exit; the mutex is
+// uncontended until then.
+struct ThreadBuffer
+{
+  ThreadBuffer() : tid(0) {}
+  std::mutex mtx;
+  std::vector<TraceEvent> events;
+  std::string name;
+  int tid;
+};
+
+// Buffers outlive their threads so that events of finished threads are kept.
+struct Registry
+{
+  Registry() : epoch(traceNow()), finished(false), at_exit(false) {}
+  std::mutex mtx;
+  std::vector<std::shared_ptr<ThreadBuffer> > buffers;
+  TraceOptions opts;
+  int64_t epoch;
+  bool finished;
+  bool at_exit;
+};
+
+Registry &registry()
+{
+  static Registry reg;
+  return reg;
+}
+
+ThreadBuffer &thread_buffer()
+{
+  thread_local std::shared_ptr<ThreadBuffer> buffer;
+  if ( !buffer )
+  {
+    buffer = std::make_shared<ThreadBuffer>();
+    buffer->events.reserve(4096);
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mtx);
+    buffer->tid = (int) reg.buffers.size() + 1;
+    reg.buffers.push_back(buffer);
+  }
+  return *buffer;
+}
+
+void write_json_string( std::ostream &out, const std::string &s )
+{
+  out << '"';
+  for ( size_t i = 0; i < s.size(); ++i )
+  {
+    if ( s[i] == '"' || s[i] == '\\' )
+      out << '\\';
+    out << s[i];
+  }
+  out << '"';
+}
+
+// Copies of every buffer, so the writers don't hold the locks while formatting.
+std::vector<std::shared_ptr<ThreadBuffer> > snapshot()
+{
+  Registry &reg = registry();
+  std::vector<std::shared_ptr<ThreadBuffer> > copies;
+  std::lock_guard<std::mutex> lock(reg.mtx);
+  for ( size_t i = 0; i < reg.buffers.size(); ++i )
+  {
+    std::shared_ptr<ThreadBuffer> copy = std::make_shared<ThreadBuffer>();
+    std::lock_guard<std::mutex> buffer_lock(reg.buffers[i]->mtx);
+    copy->events = reg.buffers[i]->events;
+    copy->name = reg.buffers[i]->name;
+    copy->tid = reg.buffers[i]->tid;
+    copies.push_back(copy);
+  }
+  return copies;
+}
+
+double percentile( const std::vector<int64_t> &sorted, double p )
+{
+  size_t i = (size_t) (p * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(i, sorted.size() - 1)] / 1e6;
+}
+
+}
+
+po::options_description traceOptions( TraceOptions &opts )
+{
+  po::options_description desc("Tracing");
+  desc.add_options()
+    ("trace", po::value<std::string>(&opts.trace_fn), "write a Chrome/Perfetto trace of the processing stages to this file")
+    ("trace-summary", po::bool_switch(&opts.summary), "print per-stage latencies at exit");
+  return desc;
+}
+
+int64_t traceNow()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void traceStart( const TraceOptions &opts )
+{
+  if ( opts.trace_fn.empty() && !opts.summary )
+    return;
+
+  Registry &reg = registry();
+  {
+    std::lock_guard<std::mutex> lock(reg.mtx);
+    reg.opts = opts;
+    reg.finished = false;
+    if ( !reg.at_exit )
+    {
+      reg.at_exit = true;
+      std::atexit(traceFinish);
+    }
+  }
+  traceThreadName("main");
+  trace_enabled.store(true);
+}
+
+void traceFinish()
+{
+  Registry &reg = registry();
+  TraceOptions opts;
+  {
+    std::lock_guard<std::mutex> lock(reg.mtx);
+    if ( reg.finished || !trace_enabled.load() )
+      return;
+    reg.finished = true;
+    opts = reg.opts;
+  }
+  trace_enabled.store(false);
+
+  if ( !opts.trace_fn.empty() )
+  {
+    std::ofstream out(opts.trace_fn.c_str());
+    if ( out.is_open() )
+      traceWriteChrome(out);
+    else
+      std::cerr << "Could not write the trace to " << opts.trace_fn << std::endl;
+  }
+  if ( opts.summary )
+    traceWriteSummary(std::cerr);
+}
+
+void traceThreadName( const char *name )
+{
+  ThreadBuffer &buffer = thread_buffer();
+  std::lock_guard<std::mutex> lock(buffer.mtx);
+  buffer.name = name;
+}
+
+void traceRecord( const char *name, int64_t start_ns, int64_t end_ns )
+{
+  ThreadBuffer &buffer = thread_buffer();
+  TraceEvent event = { name, start_ns, end_ns };
+  std::lock_guard<std::mutex> lock(buffer.mtx);
+  buffer.events.push_back(event);
+}
+
+void traceWriteChrome( std::ostream &out )
+{
+  std::vector<std::shared_ptr<ThreadBuffer> > buffers = snapshot();
+  int64_t epoch = registry().epoch;
+  char num[64];
+
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+  bool first = true;
+  for ( size_t b = 0; b < buffers.size(); ++b )
+  {
+    const ThreadBuffer &buffer = *buffers[b];
+    if ( !buffer.name.empty() )
+    {
+      out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+          << buffer.tid << ", \"args\": {\"name\": ";
+      write_json_string(out, buffer.name);
+      out << "}}";
+      first = false;
+    }
+    for ( size_t i = 0; i < buffer.events.size(); ++i )
+    {
+      const TraceEvent &e = buffer.events[i];
+      out << (first ? "" : ",\n") << "{\"name\": ";
+      write_json_string(out, e.name);
+      snprintf(num, sizeof(num), "%.3f, \"dur\": %.3f", (e.start_ns - epoch) / 1e3, (e.end_ns - e.start_ns) / 1e3);
+      out << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer.tid << ", \"ts\": " << num << "}";
+      first = false;
+    }
+  }
+  out << std::endl << "]}" << std::endl;
+}
+
+void traceWriteSummary( std::ostream &out )
+{
+  std::vector<std::shared_ptr<ThreadBuffer> > buffers = snapshot();
+  std::map<std::string, std::vector<int64_t> > stages;
+  for ( size_t b = 0; b < buffers.size(); ++b )
+    for ( size_t i = 0; i < buffers[b]->events.size(); ++i )
+    {
+      const TraceEvent &e = buffers[b]->events[i];
+      stages[e.name].push_back(e.end_ns - e.start_ns);
+    }
+  if ( stages.empty() )
+    return;
+
+  char line[256];
+  snprintf(line, sizeof(line), "%-24s %8s %10s %9s %9s %9s %9s %9s",
+           "stage", "count", "total ms", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+  out << std::endl << line << std::endl;
+  for ( std::map<std::string, std::vector<int64_t> >::iterator it = stages.begin(); it != stages.end(); ++it )
+  {
+    std::vector<int64_t> &d = it->second;
+    std::sort(d.begin(), d.end());
+    double total = 0;
+    for ( size_t i = 0; i < d.size(); ++i )
+      total += d[i] / 1e6;
+    snprintf(line, sizeof(line), "%-24s %8d %10.1f %9.3f %9.3f %9.3f %9.3f %9.3f",
+             it->first.c_str(), (int) d.size(), total, total / d.size(),
+             percentile(d, 0.5), percentile(d, 0.9), percentile(d, 0.99), d.back() / 1e6);
+    out << line << std::endl;
+
+    // log2 buckets of microseconds: [1,2) [2,4) ...
+    std::vector<int> buckets;
+    for ( size_t i = 0; i < d.size(); ++i )
+    {
+      int64_t us = d[i] / 1000;
+      size_t bucket = 0;
+      while ( us > 1 )
+      {
+        us >>= 1;
+        ++bucket;
+      }
+      if ( buckets.size() <= bucket )
+        buckets.resize(bucket + 1, 0);
+      buckets[bucket]++;
+    }
+    out << "  ";
+    for ( size_t i = 0; i < buckets.size(); ++i )
+    {
+      if ( !buckets[i] )
+        continue;
+      int64_t lo = i ? (int64_t) 1 << i : 0;
+      if ( lo >= 1000 )
+        snprintf(line, sizeof(line), " >=%.3gms:%d", lo / 1e3, buckets[i]);
+      else
+        snprintf(line, sizeof(line), " >=%dus:%d", (int) lo, buckets[i]);
+      out << line;
+    }
+    out << std::endl;
+  }
+}
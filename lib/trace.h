@@ -0,0 +1,88 @@
+//
+//  trace.h
+//  Footage_Manipulation
+//
+//  Scoped-timer tracing of the processing stages. Every thread records its
+//  scopes into its own buffer; with tracing off a scope costs one relaxed
+//  atomic load. At exit the events are written as a Chrome/Perfetto trace
+//  (chrome://tracing, ui.perfetto.dev) and a per-stage latency summary is
+//  printed.
+
+#ifndef __trace_h
+#define __trace_h
+
+#include <boost/program_options.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+struct TraceOptions
+{
+  TraceOptions() : summary(false) {}
+
+  std::string trace_fn;  // Chrome trace JSON written at exit, empty = none
+  bool summary;          // print the per-stage latency summary at exit
+};
+
+// "Tracing" options group for the tools' command lines.
+boost::program_options::options_description traceOptions( TraceOptions &opts );
+
+// Starts recording if opts asks for a trace or a summary; both are written
+// by traceFinish(), which is also registered to run at exit.
+void traceStart( const TraceOptions &opts );
+
+// Writes the trace file and summary once; later calls do nothing.
+void traceFinish();
+
+// Names the calling thread in the trace.
+void traceThreadName( const char *name );
+
+// Chrome trace JSON of everything recorded so far.
+void traceWriteChrome( std::ostream &out );
+
+// Count, mean, percentiles and a log2 histogram of every stage's durations.
+void traceWriteSummary( std::ostream &out );
+
+extern std::atomic<bool> trace_enabled;
+
+inline bool traceEnabled()
+{
+  return trace_enabled.load(std::memory_order_relaxed);
+}
+
+// Nanoseconds on a monotonic clock.
+int64_t traceNow();
+
+// name must outlive the trace, i.e. be a string literal.
+void traceRecord( const char *name, int64_t start_ns, int64_t end_ns );
+
+// Records the time between construction and destruction as one event.
+class TraceScope
+{
+public:
+  explicit TraceScope( const char *name )
+    : name(traceEnabled() ? name : 0), start(this->name ? traceNow() : 0) {}
+
+  ~TraceScope()
+  {
+    if ( name )
+      traceRecord(name, start, traceNow());
+  }
+
+private:
+  TraceScope( const TraceScope & );
+  TraceScope &operator=( const TraceScope & );
+
+  const char *name;
+  int64_t start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Traces the rest of the enclosing block as stage `name`.
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#endif
@@ -0,0 +1,145 @@
+#include "warp.h"
+
+#include "lens.h"
+#include "trace.h"
+#include "warp_kernel.h"
+
+#include <algorithm>
+
+cv::Mat cropAffine( cv::Size sz, int hcrop, int vcrop )
+{
+  double sx = (double)(sz.width - 2*hcrop) / sz.width;
+  double sy = (double)(sz.height - 2*vcrop) / sz.height;
+  // resize() maps pixel centres, hence the half pixel terms
+  cv::Mat C = (cv::Mat_<double>(2,3) << sx, 0, 0.5*sx - 0.5 + hcrop,
+                                        0, sy, 0.5*sy - 0.5 + vcrop);
+  return C;
+}
+
+cv::Mat composeAffine( const cv::Mat &A, const cv::Mat &B )
+{
+  cv::Mat A3 = cv::Mat::eye(3, 3, CV_64F), B3 = cv::Mat::eye(3, 3, CV_64F);
+  cv::Mat top = A3.rowRange(0, 2);
+  A.convertTo(top, CV_64F);
+  top = B3.rowRange(0, 2);
+  B.convertTo(top, CV_64F);
+  cv::Mat AB = A3 * B3;
+  return AB.rowRange(0, 2).clone();
+}
+
+// Shifts an inverse (output to source) affine so that it maps the rows of a
+// stripe starting at output row r0.
+static cv::Mat stripe_affine( const cv::Mat &M_inv, int r0 )
+{
+  cv::Mat Ms = M_inv.clone();
+  Ms.at<double>(0,2) += M_inv.at<double>(0,1) * r0;
+  Ms.at<double>(1,2) += M_inv.at<double>(1,1) * r0;
+  return Ms;
+}
+
+WarpEngine::WarpEngine( int num_threads, size_t _stripe_bytes )
+  : pool(ThreadPool::resolveThreads(num_threads) - 1), stripe_bytes(_stripe_bytes), near_identity(true)
+{
+}
+
+int WarpEngine::stripeRows( size_t row_bytes, int rows ) const
+{
+  int stripe = (int)(stripe_bytes / std::max<size_t>(row_bytes, 1));
+  return std::min(std::max(stripe, 8), std::max(rows, 1));
+}
+
+void WarpEngine::runStripes( int rows, size_t row_bytes, const std::function<void(int, int)> &body )
+{
+  int64 t0 = cv::getTickCount();
+  int stripe = stripeRows(row_bytes, rows);
+  int n = (rows + stripe - 1) / stripe;
+  if ( pool.size() == 0 )
+  {
+    body(0, rows);
+  }
+  else
+  {
+    pool.parallelFor(n, [&](int i) {
+      TRACE_SCOPE("warp_stripe");
+      int r0 = i * stripe;
+      body(r0, std::min(r0 + stripe, rows));
+    });
+  }
+  std::lock_guard<std::mutex> lock(stats_mtx);
+  totals.calls++;
+  totals.total_ms += 1000.0 * (cv::getTickCount() - t0) / cv::getTickFrequency();
+}
+
+void WarpEngine::warpAffine( const cv::Mat &src, cv::Mat &dst, const cv::Mat &M, cv::Size dsize,
+                             int flags, int border_mode, const cv::Scalar &border_value )
+{
+  CV_Assert( !src.empty() && M.rows == 2 && M.cols == 3 );
+  if ( dsize.area() == 0 )
+    dsize = src.size();
+
+  cv::Mat M_inv;
+  M.convertTo(M_inv, CV_64F);
+  if ( !(flags & cv::WARP_INVERSE_MAP) )
+    cv::invertAffineTransform(M_inv, M_inv);
+  int interpolation = (flags & cv::INTER_MAX) | cv::WARP_INVERSE_MAP;
+  bool kernel = near_identity && (flags & cv::INTER_MAX) == cv::INTER_LINEAR &&
+                border_mode == cv::BORDER_CONSTANT && nearIdentityWarpable(src, M_inv);
+
+  // the stripes write into views of dst, so it must not alias src
+  if ( dst.data == src.data )
+    dst = cv::Mat();
+  dst.create(dsize, src.type());
+  cv::Mat out = dst;
+
+  runStripes(dsize.height, dsize.width * src.elemSize(), [&](int r0, int r1) {
+    cv::Mat stripe = out.rowRange(r0, r1);
+    if ( kernel )
+      warpNearIdentity(src, stripe, stripe_affine(M_inv, r0), border_value);
+    else
+      cv::warpAffine(src, stripe, stripe_affine(M_inv, r0), stripe.size(), interpolation,
+                     border_mode, border_value);
+  });
+  if ( kernel )
+  {
+    std::lock_guard<std::mutex> lock(stats_mtx);
+    totals.kernel_calls++;
+  }
+}
+
+void WarpEngine::remap( const cv::Mat &src, cv::Mat &dst, const cv::Mat &map1, const cv::Mat &map2,
+                        int interpolation, int border_mode, const cv::Scalar &border_value )
+{
+  CV_Assert( !src.empty() && !map1.empty() );
+  if ( dst.data == src.data )
+    dst = cv::Mat();
+  dst.create(map1.size(), src.type());
+  cv::Mat out = dst;
+
+  size_t row_bytes = map1.cols * (src.elemSize() + map1.elemSize() + (map2.empty() ? 0 : map2.elemSize()));
+  runStripes(map1.rows, row_bytes, [&](int r0, int r1) {
+    cv::Mat stripe = out.rowRange(r0, r1);
+    cv::remap(src, stripe, map1.rowRange(r0, r1), map2.empty() ? cv::Mat() : map2.rowRange(r0, r1),
+              interpolation, border_mode, border_value);
+  });
+}
+
+void WarpEngine::warpUndistortAffine( const cv::Mat &src, cv::Mat &dst, const cv::Mat &float_map,
+                                      const cv::Mat &A, cv::Size dsize, int interpolation )
+{
+  CV_Assert( !src.empty() && float_map.type() == CV_32FC2 );
+  cv::Mat A64;
+  A.convertTo(A64, CV_64F);
+  if ( dst.data == src.data )
+    dst = cv::Mat();
+  dst.create(dsize, src.type());
+  cv::Mat out = dst;
+
+  size_t row_bytes = dsize.width * (src.elemSize() + float_map.elemSize());
+  runStripes(dsize.height, row_bytes, [&](int r0, int r1) {
+    // the composed table for one stripe stays in cache between the two passes
+    static thread_local cv::Mat composed;
+    cv::Mat stripe = out.rowRange(r0, r1);
+    composeUndistortAffine(float_map, stripe_affine(A64, r0), stripe.size(), composed);
+    cv::remap(src, stripe, composed, cv::Mat(), interpolation, cv::BORDER_CONSTANT);
+  });
+}
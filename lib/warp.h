@@ -0,0 +1,87 @@
+//
+//  warp.h
+//  Footage_Manipulation
+//
+//  Row-striped parallel warping. The output rows are split into stripes
+//  that fit in the L2 cache and the stripes are spread over a thread pool,
+//  so one large frame keeps every core busy without relying on whatever
+//  threading OpenCV was built with. The stripes of stabilizing warps are
+//  rendered by the near-identity kernel of warp_kernel.h.
+
+#ifndef __warp_h
+#define __warp_h
+
+#include <opencv2/opencv.hpp>
+
+#include <memory>
+#include <mutex>
+
+#include "thread_pool.h"
+
+// Affine (2x3, output to cropped frame) equivalent to cropping hcrop/vcrop
+// pixels off the borders and resizing the rest back to the full frame size.
+cv::Mat cropAffine( cv::Size sz, int hcrop, int vcrop );
+
+// A*B for 2x3 affines, i.e. B is applied first.
+cv::Mat composeAffine( const cv::Mat &A, const cv::Mat &B );
+
+struct WarpStats
+{
+  WarpStats() : calls(0), kernel_calls(0), total_ms(0) {}
+  long calls;
+  long kernel_calls;  // warpAffine calls rendered by warpNearIdentity
+  double total_ms;
+};
+
+class WarpEngine
+{
+public:
+  // num_threads <= 0 uses one thread per core. stripe_bytes is the target
+  // size of the output (and remap table) rows handled by one stripe.
+  // Several threads may warp through one engine at once; their stripes
+  // then share its pool. Its stripes call OpenCV, whose own pool competes
+  // for the same cores unless it is set to one thread (cv::setNumThreads,
+  // process-wide) before the engine is used, as the tools do.
+  explicit WarpEngine( int num_threads = 0, size_t stripe_bytes = 256 * 1024 );
+
+  int threads() const { return pool.size() + 1; }
+
+  // Whether warpAffine uses warpNearIdentity where it applies (8-bit 1 or 3
+  // channel frames, INTER_LINEAR, BORDER_CONSTANT, near-identity affines),
+  // which renders the same pixels as cv::warpAffine. On by default.
+  void setNearIdentityKernel( bool on ) { near_identity = on; }
+
+  // Same contract as cv::warpAffine.
+  void warpAffine( const cv::Mat &src, cv::Mat &dst, const cv::Mat &M, cv::Size dsize,
+                   int flags = cv::INTER_LINEAR, int border_mode = cv::BORDER_CONSTANT,
+                   const cv::Scalar &border_value = cv::Scalar() );
+
+  // Same contract as cv::remap.
+  void remap( const cv::Mat &src, cv::Mat &dst, const cv::Mat &map1, const cv::Mat &map2,
+              int interpolation, int border_mode = cv::BORDER_CONSTANT,
+              const cv::Scalar &border_value = cv::Scalar() );
+
+  // Renders dst (dsize) from the distorted frame src: output pixel p is read
+  // from the lens map float_map (see undistortFloatMap) at A*p. The composed
+  // remap table is only ever built one stripe at a time.
+  void warpUndistortAffine( const cv::Mat &src, cv::Mat &dst, const cv::Mat &float_map,
+                            const cv::Mat &A, cv::Size dsize, int interpolation = cv::INTER_LINEAR );
+
+  WarpStats stats() const
+  {
+    std::lock_guard<std::mutex> lock(stats_mtx);
+    return totals;
+  }
+
+private:
+  int stripeRows( size_t row_bytes, int rows ) const;
+  void runStripes( int rows, size_t row_bytes, const std::function<void(int, int)> &body );
+
+  ThreadPool pool;
+  size_t stripe_bytes;
+  bool near_identity;
+  WarpStats totals;
+  mutable std::mutex stats_mtx;
+};
+
+#endif
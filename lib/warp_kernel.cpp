@@ -0,0 +1,402 @@
+#include "warp_kernel.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WARP_KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+// cv::warpAffine's fixed point: source positions in 1/1024 pixel, rounded
+// to 1/32 pixel, and bilinear weights whose four products sum to 1024.
+const int AB_BITS = 10;
+const int INTER_BITS = 5;
+const int INTER_MASK = (1 << INTER_BITS) - 1;
+const int ROUND_DELTA = (1 << AB_BITS) >> (INTER_BITS + 1);
+const int COEF_BITS = 2 * INTER_BITS;
+const int COEF_HALF = 1 << (COEF_BITS - 1);
+
+struct Source
+{
+  const uchar *data;
+  int step;
+  int width, height, cn;
+  uchar border[3];
+};
+
+// Renders output pixels [x0, x1) of a row whose source position (in 1/1024
+// pixel) is (X0 + adx[x], Y0 + ady[x]); every pixel of the span has its
+// four neighbours inside the frame, with columns to spare for the vector
+// loads, which read a little past the right neighbour.
+typedef void (*InteriorFn)( const Source &s, const int *adx, const int *ady, int X0, int Y0,
+                            uchar *d, int x0, int x1 );
+
+template <int CN>
+void interior_scalar( const Source &s, const int *adx, const int *ady, int X0, int Y0,
+                      uchar *d, int x0, int x1 )
+{
+  for ( int x = x0; x < x1; ++x )
+  {
+    int X = (X0 + adx[x]) >> (AB_BITS - INTER_BITS);
+    int Y = (Y0 + ady[x]) >> (AB_BITS - INTER_BITS);
+    int fx = X & INTER_MASK, fy = Y & INTER_MASK;
+    int w00 = (32 - fx) * (32 - fy), w01 = fx * (32 - fy), w10 = (32 - fx) * fy, w11 = fx * fy;
+    const uchar *p = s.data + (Y >> INTER_BITS) * s.step + (X >> INTER_BITS) * CN;
+    uchar *o = d + x * CN;
+    for ( int c = 0; c < CN; ++c )
+      o[c] = (uchar)((p[c] * w00 + p[c + CN] * w01 + p[c + s.step] * w10 + p[c + s.step + CN] * w11
+                      + COEF_HALF) >> COEF_BITS);
+  }
+}
+
+#ifdef WARP_KERNEL_X86
+
+inline int load32( const uchar *p )
+{
+  int v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline long long load64( const uchar *p )
+{
+  long long v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline void store32( uchar *p, int v )
+{
+  std::memcpy(p, &v, sizeof(v));
+}
+
+// Both vector kernels blend in two steps. The horizontal neighbours of a
+// row are multiplied and added by maddubs: the row's bytes are arranged as
+// (left, right) pairs per channel and the weights as (32 - fx, fx) bytes.
+// The two rows are then interleaved as (top, bottom) 16 bit pairs and
+// blended by madd with (32 - fy, fy). A row sum is at most 32 * 255, so
+// neither step saturates.
+
+// BGR of a pixel and its right neighbour, 8 bytes from the pixel, as
+// (left, right) pairs: B B G G R R 0 0, per 64 bit lane
+#define PAIRS3 0, 3, 1, 4, 2, 5, -1, -1, 8, 11, 9, 12, 10, 13, -1, -1
+// the output of 4 pixels, BGR0 per 32 bit lane, without the 0s
+#define PACK3 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+
+// 8 pixels per step, the neighbours are fetched with gathers: for BGR one
+// 8 byte gather per row and 4 pixels, for grey one 4 byte gather per row.
+template <int CN>
+__attribute__((target("avx2")))
+void interior_avx2( const Source &s, const int *adx, const int *ady, int X0, int Y0,
+                    uchar *d, int x0, int x1 )
+{
+  const __m256i vX0 = _mm256_set1_epi32(X0), vY0 = _mm256_set1_epi32(Y0);
+  const __m256i mask = _mm256_set1_epi32(INTER_MASK), full = _mm256_set1_epi32(32);
+  const __m256i step = _mm256_set1_epi32(s.step), cn = _mm256_set1_epi32(CN);
+  const __m256i half = _mm256_set1_epi32(COEF_HALF);
+  const __m256i pairs = _mm256_setr_epi8(PAIRS3, PAIRS3), pack = _mm256_setr_epi8(PACK3, PACK3);
+  int x = x0;
+  for ( ; x + 8 <= x1; x += 8 )
+  {
+    __m256i X = _mm256_srai_epi32(_mm256_add_epi32(vX0, _mm256_loadu_si256((const __m256i *)(adx + x))),
+                                  AB_BITS - INTER_BITS);
+    __m256i Y = _mm256_srai_epi32(_mm256_add_epi32(vY0, _mm256_loadu_si256((const __m256i *)(ady + x))),
+                                  AB_BITS - INTER_BITS);
+    __m256i fx = _mm256_and_si256(X, mask), fy = _mm256_and_si256(Y, mask);
+    // (32 - fx, fx) bytes and (32 - fy, fy) words, per pixel
+    __m256i wx = _mm256_or_si256(_mm256_sub_epi32(full, fx), _mm256_slli_epi32(fx, 8));
+    __m256i wy = _mm256_or_si256(_mm256_sub_epi32(full, fy), _mm256_slli_epi32(fy, 16));
+    __m256i off = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(Y, INTER_BITS), step),
+                                   _mm256_mullo_epi32(_mm256_srai_epi32(X, INTER_BITS), cn));
+
+    if ( CN == 1 )
+    {
+      const int *base = (const int *) s.data;
+      __m256i top = _mm256_maddubs_epi16(_mm256_i32gather_epi32(base, off, 1), wx);
+      __m256i bottom = _mm256_maddubs_epi16(_mm256_i32gather_epi32(base, _mm256_add_epi32(off, step), 1), wx);
+      // the upper words are 0, the weights of the bytes past the neighbours
+      __m256i v = _mm256_madd_epi16(_mm256_or_si256(top, _mm256_slli_epi32(bottom, 16)), wy);
+      v = _mm256_srli_epi32(_mm256_add_epi32(v, half), COEF_BITS);
+      __m128i v16 = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+      _mm_storel_epi64((__m128i *)(d + x), _mm_packus_epi16(v16, v16));
+    }
+    else
+    {
+      const long long *base = (const long long *) s.data;
+      __m256i out[2];
+      for ( int h = 0; h < 2; ++h )
+      {
+        // pixels 4h .. 4h+3, one per 64 bit lane
+        __m128i o = h ? _mm256_extracti128_si256(off, 1) : _mm256_castsi256_si128(off);
+        __m128i w = h ? _mm256_extracti128_si256(wx, 1) : _mm256_castsi256_si128(wx);
+        __m256i w4 = _mm256_cvtepu32_epi64(w);
+        w4 = _mm256_or_si256(w4, _mm256_slli_epi64(w4, 16));
+        w4 = _mm256_or_si256(w4, _mm256_slli_epi64(w4, 32));
+        __m256i top = _mm256_maddubs_epi16(_mm256_shuffle_epi8(_mm256_i32gather_epi64(base, o, 1), pairs), w4);
+        __m256i bottom = _mm256_maddubs_epi16(
+          _mm256_shuffle_epi8(_mm256_i32gather_epi64(base, _mm_add_epi32(o, _mm256_castsi256_si128(step)), 1), pairs), w4);
+        // lane k of lo holds pixel 4h + 2k, of hi pixel 4h + 2k + 1
+        __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(top, bottom),
+                                       _mm256_permutevar8x32_epi32(wy, _mm256_setr_epi32(4*h, 4*h, 4*h, 4*h,
+                                                                                           4*h+2, 4*h+2, 4*h+2, 4*h+2)));
+        __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(top, bottom),
+                                       _mm256_permutevar8x32_epi32(wy, _mm256_setr_epi32(4*h+1, 4*h+1, 4*h+1, 4*h+1,
+                                                                                           4*h+3, 4*h+3, 4*h+3, 4*h+3)));
+        lo = _mm256_srli_epi32(_mm256_add_epi32(lo, half), COEF_BITS);
+        hi = _mm256_srli_epi32(_mm256_add_epi32(hi, half), COEF_BITS);
+        out[h] = _mm256_packs_epi32(lo, hi);
+      }
+      // BGR0 of pixels 0 1 4 5 | 2 3 6 7, back in order and packed
+      __m256i v = _mm256_packus_epi16(out[0], out[1]);
+      v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+      v = _mm256_shuffle_epi8(v, pack);
+      __m128i lo = _mm256_castsi256_si128(v), hi = _mm256_extracti128_si256(v, 1);
+      uchar *o = d + x * 3;
+      _mm_storel_epi64((__m128i *) o, lo);
+      store32(o + 8, _mm_extract_epi32(lo, 2));
+      _mm_storel_epi64((__m128i *)(o + 12), hi);
+      store32(o + 20, _mm_extract_epi32(hi, 2));
+    }
+  }
+  interior_scalar<CN>(s, adx, ady, X0, Y0, d, x, x1);
+}
+
+// 4 pixels per step; SSE4.1 has no gathers, the neighbours are loaded one
+// pixel at a time from the offsets computed in the vector.
+template <int CN>
+__attribute__((target("sse4.1")))
+void interior_sse4( const Source &s, const int *adx, const int *ady, int X0, int Y0,
+                    uchar *d, int x0, int x1 )
+{
+  const __m128i vX0 = _mm_set1_epi32(X0), vY0 = _mm_set1_epi32(Y0);
+  const __m128i mask = _mm_set1_epi32(INTER_MASK), full = _mm_set1_epi32(32);
+  const __m128i step = _mm_set1_epi32(s.step), cn = _mm_set1_epi32(CN);
+  const __m128i half = _mm_set1_epi32(COEF_HALF);
+  const __m128i pairs = _mm_setr_epi8(PAIRS3), pack = _mm_setr_epi8(PACK3);
+  const uchar *p = s.data, *q = s.data + s.step;
+  int x = x0;
+  for ( ; x + 4 <= x1; x += 4 )
+  {
+    __m128i X = _mm_srai_epi32(_mm_add_epi32(vX0, _mm_loadu_si128((const __m128i *)(adx + x))),
+                               AB_BITS - INTER_BITS);
+    __m128i Y = _mm_srai_epi32(_mm_add_epi32(vY0, _mm_loadu_si128((const __m128i *)(ady + x))),
+                               AB_BITS - INTER_BITS);
+    __m128i fx = _mm_and_si128(X, mask), fy = _mm_and_si128(Y, mask);
+    __m128i wx = _mm_or_si128(_mm_sub_epi32(full, fx), _mm_slli_epi32(fx, 8));
+    __m128i wy = _mm_or_si128(_mm_sub_epi32(full, fy), _mm_slli_epi32(fy, 16));
+    __m128i off = _mm_add_epi32(_mm_mullo_epi32(_mm_srai_epi32(Y, INTER_BITS), step),
+                                _mm_mullo_epi32(_mm_srai_epi32(X, INTER_BITS), cn));
+    int o[4];
+    _mm_storeu_si128((__m128i *) o, off);
+
+    if ( CN == 1 )
+    {
+      __m128i top = _mm_maddubs_epi16(_mm_setr_epi32(load32(p + o[0]), load32(p + o[1]),
+                                                     load32(p + o[2]), load32(p + o[3])), wx);
+      __m128i bottom = _mm_maddubs_epi16(_mm_setr_epi32(load32(q + o[0]), load32(q + o[1]),
+                                                        load32(q + o[2]), load32(q + o[3])), wx);
+      __m128i v = _mm_madd_epi16(_mm_or_si128(top, _mm_slli_epi32(bottom, 16)), wy);
+      v = _mm_srli_epi32(_mm_add_epi32(v, half), COEF_BITS);
+      v = _mm_packus_epi32(v, v);
+      store32(d + x, _mm_cvtsi128_si32(_mm_packus_epi16(v, v)));
+    }
+    else
+    {
+      __m128i px[4];
+      for ( int h = 0; h < 2; ++h )
+      {
+        // pixels 2h and 2h+1, one per 64 bit lane
+        __m128i w2 = _mm_cvtepu32_epi64(h ? _mm_srli_si128(wx, 8) : wx);
+        w2 = _mm_or_si128(w2, _mm_slli_epi64(w2, 16));
+        w2 = _mm_or_si128(w2, _mm_slli_epi64(w2, 32));
+        __m128i top = _mm_maddubs_epi16(
+          _mm_shuffle_epi8(_mm_set_epi64x(load64(p + o[2*h+1]), load64(p + o[2*h])), pairs), w2);
+        __m128i bottom = _mm_maddubs_epi16(
+          _mm_shuffle_epi8(_mm_set_epi64x(load64(q + o[2*h+1]), load64(q + o[2*h])), pairs), w2);
+        px[2*h] = _mm_madd_epi16(_mm_unpacklo_epi16(top, bottom),
+                                 h ? _mm_shuffle_epi32(wy, 0xaa) : _mm_shuffle_epi32(wy, 0x00));
+        px[2*h+1] = _mm_madd_epi16(_mm_unpackhi_epi16(top, bottom),
+                                   h ? _mm_shuffle_epi32(wy, 0xff) : _mm_shuffle_epi32(wy, 0x55));
+      }
+      for ( int k = 0; k < 4; ++k )
+        px[k] = _mm_srli_epi32(_mm_add_epi32(px[k], half), COEF_BITS);
+      __m128i v = _mm_packus_epi16(_mm_packs_epi32(px[0], px[1]), _mm_packs_epi32(px[2], px[3]));
+      v = _mm_shuffle_epi8(v, pack);
+      uchar *o3 = d + x * 3;
+      _mm_storel_epi64((__m128i *) o3, v);
+      store32(o3 + 8, _mm_extract_epi32(v, 2));
+    }
+  }
+  interior_scalar<CN>(s, adx, ady, X0, Y0, d, x, x1);
+}
+
+#undef PAIRS3
+#undef PACK3
+
+#endif
+
+enum KernelIsa { ISA_SCALAR, ISA_SSE4, ISA_AVX2 };
+
+KernelIsa kernel_isa()
+{
+#ifdef WARP_KERNEL_X86
+  static const KernelIsa isa = __builtin_cpu_supports("avx2") ? ISA_AVX2 :
+                               __builtin_cpu_supports("sse4.1") ? ISA_SSE4 : ISA_SCALAR;
+  return isa;
+#else
+  return ISA_SCALAR;
+#endif
+}
+
+InteriorFn interior_fn( int cn )
+{
+  switch ( kernel_isa() )
+  {
+#ifdef WARP_KERNEL_X86
+    case ISA_AVX2:
+      return cn == 1 ? interior_avx2<1> : interior_avx2<3>;
+    case ISA_SSE4:
+      return cn == 1 ? interior_sse4<1> : interior_sse4<3>;
+#endif
+    default:
+      return cn == 1 ? interior_scalar<1> : interior_scalar<3>;
+  }
+}
+
+// Any output pixel, with cv::remap's BORDER_CONSTANT rules: neighbours
+// outside the frame count as the border colour, and a pixel with none
+// inside is the border colour.
+void border_pixel( const Source &s, int X, int Y, uchar *o )
+{
+  int sx = X >> INTER_BITS, sy = Y >> INTER_BITS;
+  if ( sx >= s.width || sx + 1 < 0 || sy >= s.height || sy + 1 < 0 )
+  {
+    for ( int c = 0; c < s.cn; ++c )
+      o[c] = s.border[c];
+    return;
+  }
+  int fx = X & INTER_MASK, fy = Y & INTER_MASK;
+  int w[4] = { (32 - fx) * (32 - fy), fx * (32 - fy), (32 - fx) * fy, fx * fy };
+  const uchar *p[4];
+  for ( int k = 0; k < 4; ++k )
+  {
+    int px = sx + (k & 1), py = sy + (k >> 1);
+    bool inside = px >= 0 && px < s.width && py >= 0 && py < s.height;
+    p[k] = inside ? s.data + py * s.step + px * s.cn : s.border;
+  }
+  for ( int c = 0; c < s.cn; ++c )
+    o[c] = (uchar)((p[0][c] * w[0] + p[1][c] * w[1] + p[2][c] * w[2] + p[3][c] * w[3] + COEF_HALF) >> COEF_BITS);
+}
+
+// Narrows [lo, hi) to the x where a <= k*x + c <= b.
+void clip_span( double k, double c, double a, double b, double &lo, double &hi )
+{
+  if ( std::fabs(k) < 1e-12 )
+  {
+    if ( c < a || c > b )
+      hi = lo;
+    return;
+  }
+  double x0 = (a - c) / k, x1 = (b - c) / k;
+  if ( x0 > x1 )
+    std::swap(x0, x1);
+  lo = std::max(lo, std::ceil(x0));
+  hi = std::min(hi, std::floor(x1) + 1);
+}
+
+}
+
+bool nearIdentityWarpable( const cv::Mat &src, const cv::Mat &M_inv )
+{
+  if ( src.depth() != CV_8U || (src.channels() != 1 && src.channels() != 3) )
+    return false;
+  if ( (double) src.step * src.rows >= INT_MAX || M_inv.type() != CV_64F || M_inv.rows != 2 || M_inv.cols != 3 )
+    return false;
+  const double limit = 0.25;
+  return std::fabs(M_inv.at<double>(0,0) - 1) <= limit && std::fabs(M_inv.at<double>(1,1) - 1) <= limit &&
+         std::fabs(M_inv.at<double>(0,1)) <= limit && std::fabs(M_inv.at<double>(1,0)) <= limit &&
+         std::fabs(M_inv.at<double>(0,2)) < 1e5 && std::fabs(M_inv.at<double>(1,2)) < 1e5;
+}
+
+void warpNearIdentity( const cv::Mat &src, cv::Mat &dst, const cv::Mat &M_inv, const cv::Scalar &border )
+{
+  CV_Assert( nearIdentityWarpable(src, M_inv) && dst.type() == src.type() && dst.data != src.data );
+  double m[6];
+  for ( int i = 0; i < 6; ++i )
+    m[i] = M_inv.at<double>(i / 3, i % 3);
+
+  Source s;
+  s.data = src.data;
+  s.step = (int) src.step;
+  s.width = src.cols;
+  s.height = src.rows;
+  s.cn = src.channels();
+  for ( int c = 0; c < 3; ++c )
+    s.border[c] = cv::saturate_cast<uchar>(border[c]);
+
+  // the column part of the source positions, shared by all rows
+  static thread_local std::vector<int> adx, ady;
+  adx.resize(dst.cols);
+  ady.resize(dst.cols);
+  const double scale = 1 << AB_BITS;
+  for ( int x = 0; x < dst.cols; ++x )
+  {
+    adx[x] = cvRound(m[0] * x * scale);
+    ady[x] = cvRound(m[3] * x * scale);
+  }
+
+  InteriorFn interior = interior_fn(s.cn);
+  // the interior leaves room for the 4 and 8 byte loads
+  const int max_x = s.width - 4, max_y = s.height - 2;
+  auto inside = [&]( int X0, int Y0, int x ) {
+    int sx = (X0 + adx[x]) >> AB_BITS, sy = (Y0 + ady[x]) >> AB_BITS;
+    return sx >= 0 && sx <= max_x && sy >= 0 && sy <= max_y;
+  };
+
+  for ( int y = 0; y < dst.rows; ++y )
+  {
+    uchar *d = dst.ptr<uchar>(y);
+    int X0 = cvRound((m[1] * y + m[2]) * scale) + ROUND_DELTA;
+    int Y0 = cvRound((m[4] * y + m[5]) * scale) + ROUND_DELTA;
+
+    // The source position is monotonic along the row, so the interior is
+    // one span: guessed with a pixel to spare, then its ends are checked.
+    double lo = 0, hi = dst.cols;
+    clip_span(m[0], m[1] * y + m[2], 1, max_x - 1, lo, hi);
+    clip_span(m[3], m[4] * y + m[5], 1, max_y - 1, lo, hi);
+    int a = (int) std::max(lo, 0.0), b = (int) std::min(hi, (double) dst.cols);
+    while ( a < b && !inside(X0, Y0, a) )
+      a++;
+    while ( a < b && !inside(X0, Y0, b - 1) )
+      b--;
+    if ( a >= b )
+      a = b = dst.cols;
+
+    const int shift = AB_BITS - INTER_BITS;
+    for ( int x = 0; x < a; ++x )
+      border_pixel(s, (X0 + adx[x]) >> shift, (Y0 + ady[x]) >> shift, d + x * s.cn);
+    interior(s, &adx[0], &ady[0], X0, Y0, d, a, b);
+    for ( int x = b; x < dst.cols; ++x )
+      border_pixel(s, (X0 + adx[x]) >> shift, (Y0 + ady[x]) >> shift, d + x * s.cn);
+  }
+}
+
+const char *nearIdentityKernel()
+{
+  switch ( kernel_isa() )
+  {
+    case ISA_AVX2:
+      return "avx2";
+    case ISA_SSE4:
+      return "sse4.1";
+    default:
+      return "scalar";
+  }
+}
@@ -0,0 +1,35 @@
+//
+//  warp_kernel.h
+//  Footage_Manipulation
+//
+//  Bilinear warp specialised for the transforms of stabilization, which
+//  are almost always tiny rotations and translations. The source position
+//  of every output pixel is computed in fixed point from a per row offset
+//  and a per column table, the span of each row whose four neighbours are
+//  all inside the frame is found up front, and that span is rendered with
+//  AVX2 gathers (or SSE4.1, or plain C++ on other CPUs) without any border
+//  checks. Only the few pixels near the frame border take the slow path.
+//  The pixels are the same as cv::warpAffine's: the same 1/32 pixel
+//  positions and the same integer weights.
+
+#ifndef __warp_kernel_h
+#define __warp_kernel_h
+
+#include <opencv2/opencv.hpp>
+
+// Whether warpNearIdentity handles src (8-bit, 1 or 3 channels, smaller
+// than 2 GB) with M_inv (2x3 CV_64F, output to source), whose linear part
+// has to be within 0.25 of the identity.
+bool nearIdentityWarpable( const cv::Mat &src, const cv::Mat &M_inv );
+
+// Renders dst, which the caller has created with src's type, like
+// cv::warpAffine(src, dst, M_inv, dst.size(), INTER_LINEAR | WARP_INVERSE_MAP,
+// BORDER_CONSTANT, border).
+void warpNearIdentity( const cv::Mat &src, cv::Mat &dst, const cv::Mat &M_inv,
+                       const cv::Scalar &border = cv::Scalar() );
+
+// The instruction set the kernel runs with on this CPU: "avx2", "sse4.1"
+// or "scalar".
+const char *nearIdentityKernel();
+
+#endif
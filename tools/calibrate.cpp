@@ -11,10 +11,18 @@
 #include <boost/filesystem.hpp>
 
 // General C++ includes
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <set>
+#include <sstream>
 #include <string>
 #include <vector>
 
+//relative files
+#include "thread_pool.h"
+#include "trace.h"
+
 // Defines
 #define SCALE 0.2
 
@@ -24,13 +32,226 @@ using namespace cv;
 namespace po = boost::program_options;
 namespace fs = boost::filesystem;
 
+// Coverage grid used to pick video frames
+#define GRID_COLS 8
+#define GRID_ROWS 6
+// Frames read ahead and searched in parallel when calibrating from video
+#define FRAMES_PER_THREAD 2
+// Below this stride frames are skipped with grab() instead of seeking
+#define SEEK_STRIDE 30
+
+struct Detection
+{
+  Detection() : found(false) {}
+  bool found;
+  Size img_size;
+  vector<Point2f> corners;
+  Mat thumb; // small copy for display, video input only
+};
+
+// Tracks which parts of the image and which board poses the views kept so
+// far already cover, so that only frames adding something new are used.
+class Coverage
+{
+public:
+  Coverage( Size _img_size, Size _board_sz )
+    : img_size(_img_size), board_sz(_board_sz), cells(GRID_COLS * GRID_ROWS, false) {}
+
+  // Adds the view and returns true if it covers a new grid cell or a pose
+  // bin that no earlier view had.
+  bool addIfNew( const vector<Point2f> &corners )
+  {
+    int w = board_sz.width, n = board_sz.area();
+    vector<Point2f> quad;
+    quad.push_back(corners[0]);
+    quad.push_back(corners[w-1]);
+    quad.push_back(corners[n-1]);
+    quad.push_back(corners[n-w]);
+
+    vector<int> new_cells;
+    for ( int cy = 0; cy < GRID_ROWS; ++cy )
+    {
+      for ( int cx = 0; cx < GRID_COLS; ++cx )
+      {
+        Point2f centre((cx + 0.5f) * img_size.width / GRID_COLS, (cy + 0.5f) * img_size.height / GRID_ROWS);
+        int cell = cy * GRID_COLS + cx;
+        if ( !cells[cell] && pointPolygonTest(quad, centre, false) >= 0 )
+          new_cells.push_back(cell);
+      }
+    }
+
+    int pose = pose_bin(quad);
+    bool new_pose = poses.count(pose) == 0;
+    if ( new_cells.empty() && !new_pose )
+      return false;
+
+    for ( size_t i = 0; i < new_cells.size(); ++i )
+      cells[new_cells[i]] = true;
+    poses.insert(pose);
+    return true;
+  }
+
+  int coveredCells() const { return (int) count(cells.begin(), cells.end(), true); }
+
+private:
+  // Coarse pose of the board from its outer corners: in-plane angle,
+  // apparent size and the foreshortening along both board axes.
+  int pose_bin( const vector<Point2f> &quad ) const
+  {
+    Point2f top = quad[1] - quad[0], bottom = quad[2] - quad[3];
+    Point2f left = quad[3] - quad[0], right = quad[2] - quad[1];
+    double angle = atan2(top.y, top.x);
+    int angle_bin = (int) floor((angle + CV_PI) / (CV_PI / 4)) % 8;
+
+    double area = fabs(contourArea(quad));
+    int size_bin = min(4, (int)(sqrt(area / img_size.area()) / 0.2));
+
+    double tilt_x = log((norm(left) + 1e-6) / (norm(right) + 1e-6));
+    double tilt_y = log((norm(top) + 1e-6) / (norm(bottom) + 1e-6));
+    int tx_bin = max(-2, min(2, (int) cvRound(tilt_x / 0.15))) + 2;
+    int ty_bin = max(-2, min(2, (int) cvRound(tilt_y / 0.15))) + 2;
+
+    return ((angle_bin * 5 + size_bin) * 5 + tx_bin) * 5 + ty_bin;
+  }
+
+  Size img_size;
+  Size board_sz;
+  vector<bool> cells;
+  set<int> poses;
+};
+
+// Looks for the board on a copy downscaled to at most detect_size pixels on
+// its long side and, only when it is found there, refines the corners on the
+// full resolution image.
+Detection detect_board( const Mat &img, Size board_sz, int detect_size )
+{
+  Detection det;
+  det.img_size = img.size();
+  if ( img.empty() )
+    return det;
+
+  double scale = 1.0;
+  int long_side = max(img.cols, img.rows);
+  if ( detect_size > 0 && long_side > detect_size )
+    scale = (double) detect_size / long_side;
+
+  Mat proxy = img;
+  if ( scale < 1.0 )
+    resize(img, proxy, Size(), scale, scale, INTER_AREA);
+
+  {
+    TRACE_SCOPE("findChessboardCorners");
+    det.found = findChessboardCorners(proxy, board_sz, det.corners,
+        CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FILTER_QUADS);
+  }
+  if ( !det.found )
+    return det;
+
+  for ( size_t i = 0; i < det.corners.size(); ++i )
+    det.corners[i] = (det.corners[i] + Point2f(0.5f, 0.5f)) * (1.0 / scale) - Point2f(0.5f, 0.5f);
+
+  TRACE_SCOPE("cornerSubPix");
+  cornerSubPix(img, det.corners, Size(11,11), Size(-1,-1),
+      TermCriteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, 30, 0.1));
+  return det;
+}
+
+// Reads every stride-th frame of the video in batches, searches the batch
+// for the board in parallel and keeps, in frame order, the views that add
+// coverage, until max_views are kept or the video ends.
+void sample_video( const string &fn, Size board_sz, int stride, int max_views, int detect_size,
+                   bool keep_thumbs, ThreadPool &pool, vector<string> &labels, vector<Detection> &kept )
+{
+  VideoCapture capture(fn);
+  if ( !capture.isOpened() )
+  {
+    throw runtime_error( "could not open " + fn );
+  }
+  int max_frames = capture.get(CV_CAP_PROP_FRAME_COUNT);
+  Size img_size((int) capture.get(CV_CAP_PROP_FRAME_WIDTH), (int) capture.get(CV_CAP_PROP_FRAME_HEIGHT));
+  Coverage coverage(img_size, board_sz);
+  stride = max(stride, 1);
+  int batch_size = (pool.size() + 1) * FRAMES_PER_THREAD;
+
+  int pos = 0;
+  bool done = false;
+  while ( !done && (int) kept.size() < max_views )
+  {
+    vector<Mat> batch;
+    vector<int> batch_pos;
+    Mat frame;
+    while ( (int) batch.size() < batch_size )
+    {
+      if ( max_frames > 0 && pos >= max_frames )
+      {
+        done = true;
+        break;
+      }
+      bool got_frame;
+      {
+        TRACE_SCOPE("decode");
+        got_frame = capture.read(frame);
+      }
+      if ( !got_frame )
+      {
+        done = true;
+        break;
+      }
+      Mat grey;
+      cvtColor(frame, grey, COLOR_BGR2GRAY);
+      batch.push_back(grey);
+      batch_pos.push_back(pos);
+
+      // move on to the next sampled frame
+      pos += stride;
+      if ( stride >= SEEK_STRIDE )
+      {
+        capture.set(CV_CAP_PROP_POS_FRAMES, pos);
+      }
+      else
+      {
+        for ( int s = 1; s < stride && capture.grab(); ++s ) {}
+      }
+    }
+
+    vector<Detection> detections(batch.size());
+    pool.parallelFor((int) batch.size(), [&](int i) {
+      detections[i] = detect_board(batch[i], board_sz, detect_size);
+    });
+
+    for ( size_t i = 0; i < batch.size() && (int) kept.size() < max_views; ++i )
+    {
+      if ( !detections[i].found || !coverage.addIfNew(detections[i].corners) )
+      {
+        continue;
+      }
+      if ( keep_thumbs )
+      {
+        resize(batch[i], detections[i].thumb, Size(), SCALE, SCALE);
+      }
+      stringstream label;
+      label << fn << " frame " << batch_pos[i];
+      labels.push_back(label.str());
+      kept.push_back(detections[i]);
+    }
+    cout << "Frame " << pos << "/" << max_frames << ": " << kept.size() << " views, "
+         << coverage.coveredCells() << "/" << GRID_COLS * GRID_ROWS << " cells covered" << endl;
+  }
+}
+
 int main( int argc, char **argv ) {
 
   // Argument variables
   int board_w; // num of horizontal corners
   int board_h; // num of vertical corners
   string calib_fn; // calibration file name
-  string input_dir; // input directory
+  string input_dir; // input directory or video
+  int stride; // frame stride for video input
+  int max_views; // views kept from video input
+  int kthreads; // detection threads
+  int detect_size; // long side of the detection proxy
+  bool no_display;
+  TraceOptions trace_opts;
 
   try
   {
@@ -39,8 +260,15 @@ int main( int argc, char **argv ) {
       ("help,h", "Print help messages")
       ("horiz", po::value<int>(&board_w)->required(), "Number of horizontal corners")
       ("vert", po::value<int>(&board_h)->required(), "Number of vertical corners")
-      ("input,i", po::value<string>(&input_dir)->required(), "Input directory")
-      ("calibfn,c", po::value<string>(&calib_fn)->default_value("calib.yml"), "calibration filename");
+      ("input,i", po::value<string>(&input_dir)->required(), "Input directory or video file")
+      ("stride,s", po::value<int>(&stride)->default_value(15), "for video input, only every stride-th frame is looked at")
+      ("max-views,m", po::value<int>(&max_views)->default_value(60), "for video input, maximum number of views used for calibration")
+      ("calibfn,c", po::value<string>(&calib_fn)->default_value("calib.yml"), "calibration filename")
+      ("threads,t", po::value<int>(&kthreads)->default_value(0), "number of detection threads (0 = one per core)")
+      ("detect-size", po::value<int>(&detect_size)->default_value(1000), "long side in pixels of the copy the board is searched in (0 = full resolution)")
+      ("no-display", po::bool_switch(&no_display), "do not show the detected boards");
+
+    desc.add(traceOptions(trace_opts));
 
     po::positional_options_description positionalOptions; 
     positionalOptions.add("horiz", 1);
@@ -58,11 +286,13 @@ int main( int argc, char **argv ) {
       {
         cout << "This is the calibration software for the gopro camera. " << endl << endl; 
         cout << "Usage: " << argv[0] << " [options] <horiz> <vert> <input> " << endl  << endl << desc << endl;
+        cout << "<input> is either a directory of images or a video file." << endl;
 
         return 0;
       }
       
       po::notify(vm);
+      traceStart(trace_opts);
     }
     catch ( po::error& e )
     {
@@ -86,44 +316,80 @@ int main( int argc, char **argv ) {
 
     // location of the detected corners in the image.
     vector<vector<Point2f> > imagePoints; 
-    
-    // corners found from chessboard calibration
-    vector<Point2f> corners;
 
-    Mat src;
+    ThreadPool pool(ThreadPool::resolveThreads(kthreads) - 1);
+    vector<string> images;
+    vector<Detection> detections;
+
+    if ( fs::is_directory(input_dir) )
+    {
+      // Sorted so that the views, and thus the calibration, do not depend
+      // on the directory order.
+      fs::directory_iterator end_iter;
+      for ( fs::directory_iterator iter(input_dir); iter != end_iter; ++iter )
+      {
+        // If it's not a directory, use it.
+        if ( is_regular_file(iter->path()) )
+        {
+          images.push_back(iter->path().string());
+        }
+      }
+      sort(images.begin(), images.end());
+
+      // Detect on all images in parallel; each worker writes its own slot.
+      detections.resize(images.size());
+      pool.parallelFor((int) images.size(), [&](int i) {
+        detections[i] = detect_board(imread(images[i], CV_LOAD_IMAGE_GRAYSCALE), board_sz, detect_size);
+      });
+    }
+    else
+    {
+      sample_video(input_dir, board_sz, stride, max_views, detect_size, !no_display, pool, images, detections);
+    }
 
     char key; // Escape key
     int success = 0; // number of successful chessboard captures
+    Size img_size;
 
-    fs::directory_iterator end_iter;
-
-    namedWindow( "Calibration", WINDOW_AUTOSIZE );
-    for ( fs::directory_iterator iter(input_dir); iter != end_iter; ++iter )
+    if ( !no_display )
+    {
+      namedWindow( "Calibration", WINDOW_AUTOSIZE );
+    }
+    for ( size_t i = 0; i < images.size(); ++i )
     {
-      // If it's not a directory, use it.
-      if ( is_regular_file(iter->path()) )
+      const Detection &det = detections[i];
+      cout << images[i] << endl;
+      if ( !det.found )
       {
-        string curr_img = iter->path().string();
-        cout << curr_img << endl;
-        src = imread(curr_img, CV_LOAD_IMAGE_GRAYSCALE);
+        continue;
+      }
 
-        bool found = findChessboardCorners(src, board_sz, corners,
-            CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_FILTER_QUADS);
+      img_size = det.img_size;
+      imagePoints.push_back(det.corners);
+      objectPoints.push_back(obj);
+      success++;
+      cout << success << " poses with corners stored." << endl;
 
-        if ( found )
-        {
-          cornerSubPix(src, corners, Size(11,11), Size(-1,-1),
-              TermCriteria(CV_TERMCRIT_EPS | CV_TERMCRIT_ITER, 30, 0.1));
-
-          drawChessboardCorners(src, board_sz, corners, found);
-          imagePoints.push_back(corners);
-          objectPoints.push_back(obj);
-          success++;
-          cout << success << " poses with corners stored." << endl;
-        }
+      if ( !no_display )
+      {
         // Resize for display
         Mat vis;
-        resize(src, vis, Size(), SCALE, SCALE);
+        if ( det.thumb.empty() )
+        {
+          Mat src = imread(images[i], CV_LOAD_IMAGE_GRAYSCALE);
+          drawChessboardCorners(src, board_sz, det.corners, det.found);
+          resize(src, vis, Size(), SCALE, SCALE);
+        }
+        else
+        {
+          vector<Point2f> small_corners;
+          for ( size_t c = 0; c < det.corners.size(); ++c )
+          {
+            small_corners.push_back(det.corners[c] * SCALE);
+          }
+          vis = det.thumb.clone();
+          drawChessboardCorners(vis, board_sz, small_corners, det.found);
+        }
         imshow("Calibration", vis);
 
         // <esc> key to exit
@@ -136,7 +402,15 @@ int main( int argc, char **argv ) {
       }
     }
 
-    destroyAllWindows();
+    if ( !no_display )
+    {
+      destroyAllWindows();
+    }
+
+    if ( success == 0 )
+    {
+      throw runtime_error( "no chessboard found in " + input_dir );
+    }
 
     cout << "Starting Calibration..." << endl;
 
@@ -152,7 +426,10 @@ int main( int argc, char **argv ) {
     intrinsic.at<float>(0,0) = 1;
     intrinsic.at<float>(1,1) = 1;
 
-    calibrateCamera(objectPoints, imagePoints, src.size(), intrinsic, distcoeffs, rvecs, tvecs);
+    {
+      TRACE_SCOPE("calibrateCamera");
+      calibrateCamera(objectPoints, imagePoints, img_size, intrinsic, distcoeffs, rvecs, tvecs);
+    }
 
     FileStorage fs(calib_fn, FileStorage::WRITE);
     fs << "intrinsic" << intrinsic;
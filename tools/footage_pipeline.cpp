@@ -0,0 +1,220 @@
+// OpenCV
+#include <opencv2/opencv.hpp>
+
+// Boost includes
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+// General C++ includes
+#include <atomic>
+#include <csignal>
+#include <iostream>
+#include <string>
+
+//relative files
+#include "manifest.h"
+#include "pipeline.h"
+#include "pipeline_service.h"
+#include "trace.h"
+
+// namespaces
+using namespace std;
+using namespace cv;
+namespace po = boost::program_options;
+
+// set by SIGINT and SIGTERM: the service finishes the jobs it took and exits
+static std::atomic<bool> stop_requested(false);
+
+void request_stop(int)
+{
+  stop_requested = true;
+}
+
+void disp_progress(float progress, int bar_width)
+{
+  cout << "[";
+  int pos = bar_width * progress;
+  for ( int i = 0; i < bar_width; ++i )
+  {
+    if ( i < pos )
+    {
+      cout << "=";
+    }
+    else if ( i == pos )
+    {
+      cout << ">";
+    }
+    else
+    {
+      cout << " ";
+    }
+  }
+  cout << "] " << int(progress * 100.0) << "%\r" ;
+  cout.flush();
+}
+
+int main( int argc, char **argv ) {
+  string job_fn, manifest_out, manifest_fn;
+  bool shard_tiles, serve, submit;
+  PipelineOptions opts;
+  WorkerOptions worker_opts;
+  ServiceOptions service_opts;
+  TraceOptions trace_opts;
+  try
+  {
+    po::options_description desc("Options");
+    desc.add_options()
+      ("help,h", "Print help messages")
+      ("job,j", po::value<string>(&job_fn), "job file (YAML) describing the input, the stages and the tiles")
+      ("warp-threads", po::value<int>(&opts.warp_threads)->default_value(0), "threads for the striped warp engine, 0 leaves warping to OpenCV")
+      ("tile-threads", po::value<int>(&opts.tile_threads)->default_value(0), "tiles encoded in parallel (0 = one per core)");
+
+    po::options_description sharding("Sharding");
+    sharding.add_options()
+      ("make-manifest", po::value<string>(&manifest_out), "instead of running the job, write a manifest with one shard per time segment to this file")
+      ("shard-tiles", po::bool_switch(&shard_tiles), "with --make-manifest, one shard per tile and time segment")
+      ("worker,w", po::value<string>(&manifest_fn), "process the shards of this manifest, in parallel with any other workers")
+      ("lock-dir", po::value<string>(&worker_opts.lock_dir), "directory shared by the workers for claims and markers (default: <manifest>.locks)")
+      ("stale-after", po::value<int>(&worker_opts.stale_secs)->default_value(600), "seconds after which a claim that is not refreshed is retried")
+      ("max-attempts", po::value<int>(&worker_opts.max_attempts)->default_value(3), "attempts per shard before it is given up")
+      ("poll", po::value<int>(&worker_opts.poll_secs)->default_value(10), "seconds between checks while other workers hold the remaining shards");
+
+    po::options_description service("Service");
+    service.add_options()
+      ("serve", po::bool_switch(&serve), "keep running and process the jobs of --spool and --socket, keeping the thread pools and undistortion maps between jobs")
+      ("spool", po::value<string>(&service_opts.spool_dir), "with --serve, run the job files renamed into <spool>/incoming")
+      ("socket", po::value<string>(&service_opts.socket_path), "with --serve, take job files from clients of this Unix socket; with --submit, the service to send the job to")
+      ("jobs", po::value<int>(&service_opts.jobs)->default_value(2), "with --serve, jobs run at once; they share the warp and tile threads")
+      ("threads", po::value<int>(&service_opts.threads)->default_value(0), "with --serve, decoder and encoder threads of all jobs together, split between them (0 = one per core); --decode-threads and --encode-threads override the split")
+      ("spool-poll", po::value<int>(&service_opts.poll_ms)->default_value(500), "with --serve, milliseconds between scans of the spool")
+      ("spool-stale", po::value<int>(&service_opts.stale_secs)->default_value(600), "with --serve, seconds after which a spooled job whose service stopped touching it is run again")
+      ("cached-maps", po::value<int>(&service_opts.max_maps)->default_value(8), "with --serve, undistortion maps kept in memory")
+      ("submit", po::bool_switch(&submit), "hand the job to the service at --socket and wait for it instead of running it here");
+
+    desc.add(sharding);
+    desc.add(service);
+    desc.add(frameSourceOptions(opts.decode));
+    desc.add(frameSinkOptions(opts.encode));
+    desc.add(traceOptions(trace_opts));
+
+    po::positional_options_description positionalOptions;
+    positionalOptions.add("job", 1);
+
+    po::variables_map vm;
+
+    // Parse command line arguments
+    try
+    {
+      po::store(po::command_line_parser(argc, argv).options(desc).positional(positionalOptions).run(), vm);
+
+      if ( vm.count( "help" ) )
+      {
+        cout << "Undistorts, stabilizes and splits footage in one pass over a single decode. " << endl << endl;
+        cout << "Usage: " << argv[0] << " [options] <job>" << endl;
+        cout << "       " << argv[0] << " <job> --make-manifest <manifest>" << endl;
+        cout << "       " << argv[0] << " [options] --worker <manifest>" << endl;
+        cout << "       " << argv[0] << " [options] --serve [--spool <dir>] [--socket <path>]" << endl;
+        cout << "       " << argv[0] << " --submit --socket <path> <job>" << endl << endl << desc << endl;
+
+        return 0;
+      }
+
+      po::notify(vm);
+      if ( serve )
+      {
+        if ( !job_fn.empty() || !manifest_fn.empty() )
+        {
+          throw po::error( "--serve takes its jobs from --spool and --socket" );
+        }
+        if ( service_opts.spool_dir.empty() && service_opts.socket_path.empty() )
+        {
+          throw po::error( "--serve needs --spool or --socket" );
+        }
+      }
+      else if ( job_fn.empty() == manifest_fn.empty() )
+      {
+        throw po::error( "give either a job or --worker <manifest>" );
+      }
+      if ( submit && (job_fn.empty() || service_opts.socket_path.empty()) )
+      {
+        throw po::error( "--submit needs a job and --socket" );
+      }
+      traceStart(trace_opts);
+    }
+    catch ( po::error& e )
+    {
+      cerr << "ERROR: " << e.what() << endl << endl;
+      cerr << desc << endl;
+      return 1;
+    }
+
+    if ( submit )
+    {
+      string reply = submitJob(service_opts.socket_path, job_fn);
+      cout << reply << endl;
+      return reply.compare(0, 5, "done ") == 0 ? 0 : 1;
+    }
+
+    // The warp engine's threads (shared by all jobs of a service) take the
+    // cores, so OpenCV's process-wide pool is set to one thread once, before
+    // any job runs; decoding conversions and tracking then run serially.
+    if ( opts.warp_threads > 0 )
+    {
+      setNumThreads(1);
+    }
+
+    if ( serve )
+    {
+      signal(SIGINT, request_stop);
+      signal(SIGTERM, request_stop);
+      ServiceStats stats = runService(service_opts, opts, stop_requested, cout);
+      cout << stats.completed << " jobs done, " << stats.failed << " failed" << endl;
+      return 0;
+    }
+
+    if ( !manifest_fn.empty() )
+    {
+      vector<Shard> shards = readManifest(manifest_fn);
+      if ( worker_opts.lock_dir.empty() )
+      {
+        worker_opts.lock_dir = manifest_fn + ".locks";
+      }
+      cout << shards.size() << " shards in " << manifest_fn << ", locks in " << worker_opts.lock_dir << endl;
+      WorkerStats stats = runWorker(shards, worker_opts, [&opts]( const Shard &shard ) {
+        runPipeline(shard.job, opts);
+      }, cout);
+      cout << stats.completed << " shards done here, " << stats.failed << " failed attempts, "
+           << stats.abandoned << " shards given up" << endl;
+      return stats.abandoned > 0 ? 1 : 0;
+    }
+
+    PipelineJob job = readPipelineJob(job_fn);
+    if ( !manifest_out.empty() )
+    {
+      int total = FrameSource::probeFrameCount(job.input, opts.decode.exact_count, opts.decode.backend);
+      string prefix = boost::filesystem::path(job.input).stem().string();
+      vector<Shard> shards = shardJob(job, total, shard_tiles, prefix);
+      writeManifest(manifest_out, shards);
+      cout << shards.size() << " shards written to " << manifest_out << endl;
+      return 0;
+    }
+
+    cout << "Processing " << job.input << " into " << job.numx << "x" << job.numy << "x" << job.timesplit
+         << " tiles in " << job.output_dir << endl;
+    int64 t0 = getTickCount();
+    int frames = runPipeline(job, opts, [](int done, int total) {
+      if ( total > 0 )
+      {
+        disp_progress(min((float) done / total, 1.0f), 50);
+      }
+    });
+    double secs = (getTickCount() - t0) / getTickFrequency();
+    cout << endl << frames << " frames in " << secs << " s (" << (secs > 0 ? frames / secs : 0.0) << " fps)" << endl;
+  }
+  catch ( exception& e )
+  {
+    cerr << "Unhandled Exception reached the top of main: " << e.what() << ", application will now exit." << endl;
+    return 2;
+  }
+  return 0;
+}
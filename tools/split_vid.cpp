@@ -13,6 +13,13 @@
 #include <sstream>
 #include <thread>
 #include <mutex>
+#include <memory>
+
+//relative files
+#include "frame_source.h"
+#include "frame_sink.h"
+#include "tiles.h"
+#include "trace.h"
 
 // Defines
 #define SCALE 0.4
@@ -48,60 +55,30 @@ void disp_progress(float progress, int bar_width)
   cout.flush();
 }
 
-void split_img( int split_num, int x, int y, int num_x, int num_y, int time_split, string fn, string out_dir, int overlap) {
+void split_img( int split_num, int x, int y, int num_x, int num_y, int time_split, string fn, string out_dir, int overlap, int max_frames, FrameSourceOptions src_opts, FrameSinkOptions sink_opts) {
   mtx.lock();
   cout << "worker " << x << "-" << y << "-" << split_num << " running." << endl;
   mtx.unlock();
-  VideoCapture capture(fn);
-  int max_frames = capture.get(CV_CAP_PROP_FRAME_COUNT);
-
-  int rect_width = (int) capture.get(CV_CAP_PROP_FRAME_WIDTH)/num_x;
-  int rect_height = (int) capture.get(CV_CAP_PROP_FRAME_HEIGHT)/num_y;
+  traceThreadName("worker");
 
   int start_frame = split_num * (max_frames / time_split);
+  src_opts.start_frame = start_frame;
+  src_opts.end_frame = start_frame + (max_frames / time_split) - 1;
+  unique_ptr<FrameSource> capture = FrameSource::open(fn, src_opts);
 
-  capture.set(CV_CAP_PROP_POS_FRAMES, start_frame);
-
-  int this_x = x*rect_width;
-  int this_y = y*rect_height;
-  int this_width = rect_width;
-  int this_height = rect_height;
-
-  //Determine whether to add overlap to the quadrant.
-  if (x > 0){
-    this_x -= overlap;
-    this_width += overlap;
-  }
-  if (y > 0) {
-    this_y -= overlap;
-    this_height += overlap;
-  }
-  if (x != num_x-1) {
-    this_width += overlap;
-  }
-  if (y != num_y-1) {
-    this_height += overlap;
-  }
-
-  Size sz = Size(this_width, this_height);
+  //The quadrant, with the overlap added towards its neighbours.
+  Rect rect = tileRect(capture->size(), x, y, num_x, num_y, overlap);
+  Size sz = rect.size();
 
   stringstream out_key;
   out_key << y << "-" << x << "-" << split_num;
-  VideoWriter writer;
   string out_fn = out_dir + "/" + out_key.str() + ".avi"; 
-  writer.open(out_fn, CV_FOURCC('m','p','4','v'), capture.get(CV_CAP_PROP_FPS), sz, true);
-
-  Mat src;
-  Rect rect = Rect( this_x, this_y, this_width, this_height );
+  unique_ptr<FrameSink> writer = FrameSink::open(out_fn, capture->fps(), sz, sink_opts);
 
   int k = 0;
-  while ( k < (max_frames / time_split)-1 )
+  while ( FramePtr src = capture->next() )
   {
-    capture >> src;
-    if ( src.data == NULL )
-      break;
-
-    writer << Mat(src, rect);
+    *writer << Mat(src->image, rect);
 
     int percent = int(100 * ((float)k/(max_frames/time_split)));
     if ( percent % 5 == 0 )
@@ -112,6 +89,7 @@ void split_img( int split_num, int x, int y, int num_x, int num_y, int time_spli
     }
     k++;
   }
+  writer->close();
 }
 
 int main( int argc, char **argv ) {
@@ -119,6 +97,9 @@ int main( int argc, char **argv ) {
   int num_x, num_y, time_split, kthreads, overlap;
   try
   {
+    FrameSourceOptions src_opts;
+    FrameSinkOptions sink_opts;
+    TraceOptions trace_opts;
     po::options_description desc("Options");
     desc.add_options()
       ("help,h", "Print help messages")
@@ -130,6 +111,10 @@ int main( int argc, char **argv ) {
       ("threads,s", po::value<int>(&kthreads)->default_value(4), "number of threads")
       ("overlap,l", po::value<int>(&overlap)->default_value(0), "number of pixels to overlap spatially between splits");
 
+    desc.add(frameSourceOptions(src_opts));
+    desc.add(frameSinkOptions(sink_opts));
+    desc.add(traceOptions(trace_opts));
+
     po::positional_options_description positionalOptions; 
     positionalOptions.add("footage", 1);
     positionalOptions.add("numx", 1);
@@ -151,6 +136,7 @@ int main( int argc, char **argv ) {
       }
       
       po::notify(vm);
+      traceStart(trace_opts);
     }
     catch ( po::error& e )
     {
@@ -159,6 +145,10 @@ int main( int argc, char **argv ) {
       return 1;
     }
 
+    // Every worker splits the same range, so count the frames only once.
+    int max_frames = FrameSource::probeFrameCount(fn, src_opts.exact_count, src_opts.backend);
+    src_opts.exact_count = false;
+
     vector <thread> workers;
     int kspawned = 0;
     for ( int time_num = 0; time_num < time_split; ++time_num )
@@ -172,7 +162,7 @@ int main( int argc, char **argv ) {
             workers.back().join();
             workers.pop_back();
           }
-          workers.push_back(thread(split_img, time_num, nx, ny, num_x, num_y, time_split, fn, out_dir, overlap));
+          workers.push_back(thread(split_img, time_num, nx, ny, num_x, num_y, time_split, fn, out_dir, overlap, max_frames, src_opts, sink_opts));
           kspawned++;
         }
       }
@@ -3,15 +3,30 @@
 
 // Boost includes
 #include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
 
 // General C++ includes
 #include <iostream>
 #include <string>
+#include <sstream>
 #include <vector>
 #include <cmath>
+#include <deque>
+#include <future>
+#include <memory>
 
 //relative files
 #include "ert.h"
+#include "grey.h"
+#include "lens.h"
+#include "motion.h"
+#include "stats_log.h"
+#include "tiles.h"
+#include "warp.h"
+#include "warp_kernel.h"
+#include "frame_source.h"
+#include "frame_sink.h"
+#include "trace.h"
 
 // namespaces
 using namespace std;
@@ -61,6 +76,28 @@ struct UserData
   float scale_factor;
 };
 
+// Estimator state of one tracking worker. The reference (grey pyramid,
+// corners) is shared read-only by all of them.
+struct Tracker
+{
+  Tracker() : fallbacks(0) {}
+  unique_ptr<PhaseCorrelator> phase;
+  unique_ptr<HierarchicalEstimator> hierarchical;
+  Mat curr_grey;
+  int fallbacks;
+};
+
+// A tracked frame: its frame to reference transform (empty when it could
+// not be estimated) and how the estimate went. With --analysis-stride the
+// transform may be interpolated instead.
+struct Tracked
+{
+  Tracked() : interpolated(false) {}
+  Mat T;
+  FrameStats stats;
+  bool interpolated;
+};
+
 void disp_progress(float progress, int bar_width)
 {
   cout << "[";
@@ -103,9 +140,17 @@ int main( int argc, char **argv ) {
   int box_size, horizon_crop;
   int start_frame;
   float scale_factor;
+  double analysis_scale;
   int end_frame;
   int ransac_max_iters;
   float ransac_good_ratio;
+  string calib_fn, cache_dir, stats_fn;
+  int warp_threads, track_threads;
+  int numx, numy, overlap, tile_threads;
+  FrameSourceOptions src_opts;
+  FrameSinkOptions sink_opts;
+  MotionOptions motion_opts;
+  TraceOptions trace_opts;
   try
   {
     po::options_description desc("Options");
@@ -116,11 +161,31 @@ int main( int argc, char **argv ) {
       ("manualframe,m", po::value<int>(&start_frame)->default_value(0), "Frame to do manual capturing on.")
       ("endframe,e", po::value<int>(&end_frame)->default_value(0), "Frame to stop stabilization at.")
       ("scalefactor,s", po::value<float>(&scale_factor)->default_value(0.25), "Scaling Factor for manual marking.")
+      ("analysis-scale", po::value<double>(&analysis_scale)->default_value(1.0), "Track the corners on frames scaled by this factor (0-1]. Tracking runs on the decoder's luma either way.")
       ("ransac_max_iters,i", po::value<int>(&ransac_max_iters)->default_value(500), "Maximum number of iterations for RANSAC.")
       ("ransac_good_ratio,g", po::value<float>(&ransac_good_ratio)->default_value(0.9), "Inlier Ratio used for RANSAC.")
       //A higher inlier ratio will force model to only estimate the affine transform using that percentage of inlier points.
+      ("calibfn,k", po::value<string>(&calib_fn)->default_value(""), "calibration file; undistort and stabilize in a single remap")
+      ("cachedir,d", po::value<string>(&cache_dir)->default_value(defaultMapCacheDir()), "directory for cached undistortion maps")
+      ("warp-threads", po::value<int>(&warp_threads)->default_value(0), "Threads for the striped warp engine; rendering then overlaps tracking. 0 leaves warping to OpenCV.")
+      ("track-threads", po::value<int>(&track_threads)->default_value(1), "Frames tracked against the reference in parallel (0 = one per core); the results are put back in order for rendering.")
+      ("stats-log", po::value<string>(&stats_fn)->default_value(""), "Write the per-frame RANSAC statistics to this binary log, see stats_report.")
       ("footage,f", po::value<string>(&fn)->required(), "footage file")
-      ("output,o", po::value<string>(&output_fn)->default_value("output.avi"), "output file");
+      ("output,o", po::value<string>(&output_fn)->default_value("output.avi"), "output file, or with tiles the directory they are written to (default: current directory)");
+
+    po::options_description tiling("Tiling");
+    tiling.add_options()
+      ("numx,x", po::value<int>(&numx)->default_value(1), "number of x splits; tiles are rendered straight from the raw frames, as split_vid would cut the output")
+      ("numy,y", po::value<int>(&numy)->default_value(1), "number of y splits")
+      ("overlap,l", po::value<int>(&overlap)->default_value(0), "number of pixels to overlap spatially between splits")
+      ("tile-threads", po::value<int>(&tile_threads)->default_value(0), "tiles rendered and encoded in parallel (0 = one per core)");
+
+    desc.add(tiling);
+    desc.add(motionOptions(motion_opts));
+
+    desc.add(frameSourceOptions(src_opts));
+    desc.add(frameSinkOptions(sink_opts));
+    desc.add(traceOptions(trace_opts));
 
     po::positional_options_description positionalOptions; 
     positionalOptions.add("footage", 1);
@@ -141,6 +206,7 @@ int main( int argc, char **argv ) {
       }
       
       po::notify(vm);
+      traceStart(trace_opts);
     }
     catch ( po::error& e )
     {
@@ -148,16 +214,51 @@ int main( int argc, char **argv ) {
       cerr << desc << endl;
       return 1;
     }
+    // The warp engine's threads take the cores; OpenCV's pool is process
+    // wide, so tracking and the other OpenCV calls run single-threaded from
+    // here on. Set before any thread uses OpenCV.
+    if ( warp_threads > 0 )
+    {
+      setNumThreads(1);
+    }
+    if ( analysis_scale <= 0 || analysis_scale > 1 )
+    {
+      throw invalid_argument( "analysis-scale must be in (0, 1]" );
+    }
+    if ( numx < 1 || numy < 1 || overlap < 0 )
+    {
+      throw invalid_argument( "numx and numy must be at least 1 and overlap not negative" );
+    }
+    const bool tiled = numx * numy > 1;
+    if ( tiled && vm["output"].defaulted() )
+    {
+      output_fn = ".";
+    }
+    if ( motion_opts.method == "phase" && !calib_fn.empty() )
+    {
+      throw invalid_argument( "--motion phase works on the frames and needs undistorted footage, use it without --calibfn" );
+    }
+    if ( motion_opts.method == "vectors" )
+    {
+      // frames are registered to the first one, the codec only knows their neighbours
+      throw invalid_argument( "--motion vectors gives frame to frame motion, use it with videostab" );
+    }
     if (end_frame > 0 && end_frame < start_frame)
     {
       throw invalid_argument( "selected end frame is before start frame");
     }
-    VideoCapture capturefirst(fn);
-    VideoWriter writer;
-    writer.open(output_fn, CV_FOURCC('m','p','4','v'), capturefirst.get(CV_CAP_PROP_FPS), Size((int) capturefirst.get(CV_CAP_PROP_FRAME_WIDTH), (int) capturefirst.get(CV_CAP_PROP_FRAME_HEIGHT)), true);
-    Mat curr, curr_grey;
+    FrameSourceOptions first_opts = src_opts;
+    first_opts.start_frame = start_frame;
+    first_opts.prefetch = 1;
+    first_opts.luma = true;
+    unique_ptr<FrameSource> capturefirst = FrameSource::open(fn, first_opts);
+    unique_ptr<FrameSink> writer;
+    if ( !tiled )
+    {
+      writer = FrameSink::open(output_fn, capturefirst->fps(), capturefirst->size(), sink_opts);
+    }
     Mat first, first_grey, first_grey_disp;
-    int max_frames = capturefirst.get(CV_CAP_PROP_FRAME_COUNT);
+    int max_frames = capturefirst->frameCount();
     printf("Number of frames in video: %d\n",max_frames);
     if ( start_frame > max_frames )
     {
@@ -167,15 +268,26 @@ int main( int argc, char **argv ) {
     {
       end_frame = max_frames;
     }
-    capturefirst.set(CV_CAP_PROP_POS_FRAMES, start_frame);
-    do
+    FramePtr first_frame = capturefirst->next();
+    if ( !first_frame )
     {
-      capturefirst >> first;
+      throw invalid_argument( "could not read the manual frame" );
     }
-    while ( first.data == NULL );
-    cvtColor(first, first_grey, COLOR_BGR2GRAY);
-    resize(first_grey, first_grey_disp, Size(), scale_factor, scale_factor);
-    vector <Point2f> first_corners, first_corners2;
+    // tracking compares luma with luma, so the reference frame's grey comes
+    // from the decoder as well
+    Size analysis_size = scaledSize(capturefirst->size(), analysis_scale);
+    first = first_frame->image.clone();
+    greyDownscale(first_frame->luma, first_grey, analysis_size);
+    resize(first_frame->luma, first_grey_disp, Size(), scale_factor, scale_factor);
+    // the phase and hierarchical estimators get the reference once the
+    // corners are selected
+    Mat first_luma;
+    if ( motion_opts.method != "features" )
+    {
+      first_luma = first_frame->luma.clone();
+    }
+    first_frame.reset();
+    vector <Point2f> first_corners, first_tracked;
     struct UserData ud(first_grey_disp, &first_corners, box_size, scale_factor);
 
     namedWindow("first", CV_WINDOW_AUTOSIZE);
@@ -184,66 +296,513 @@ int main( int argc, char **argv ) {
     waitKey(0);
     cout << first_corners.size() << " corners detected." << endl;
     destroyAllWindows();
-    writer << first;
+    for ( size_t i = 0; i < first_corners.size(); ++i )
+    {
+      first_tracked.push_back(first_corners[i] * analysis_scale);
+    }
+
+    // With --track-threads frames are tracked in parallel: every frame is
+    // registered to the reference on its own, so only the last_T fallback
+    // and the output need them in order. Trackers are used round robin by
+    // at most trackers.size() frames in flight, so none is used twice at once.
+    int track_workers = ThreadPool::resolveThreads(track_threads);
+    vector<Tracker> trackers(track_workers > 1 ? 2 * track_workers : 1);
+    auto setup_tracker = [&]( Tracker &t )
+    {
+      if ( motion_opts.method == "phase" )
+      {
+        t.phase.reset(new PhaseCorrelator(motion_opts));
+        t.phase->setReference(first_luma);
+      }
+      else if ( motion_opts.method == "hierarchical" )
+      {
+        // the selected corners are tracked at full resolution, on patches
+        // around where the coarse level predicts them
+        t.hierarchical.reset(new HierarchicalEstimator(motion_opts.hierarchy));
+        t.hierarchical->setReference(first_luma, first_corners);
+      }
+    };
+    for ( size_t i = 0; i < trackers.size(); ++i )
+    {
+      setup_tracker(trackers[i]);
+    }
+    // With --analysis-stride, tracks the frames of a stride whose motion was
+    // not steady after all, on this thread.
+    Tracker redo;
+    if ( motion_opts.stride > 1 )
+    {
+      setup_tracker(redo);
+    }
+    first_luma.release();
+    // the reference pyramid is built once instead of by every LK call
+    vector<Mat> first_pyr;
+    buildOpticalFlowPyramid(first_grey, first_pyr, Size(21, 21), 3);
+
+    // With a calibration, motion is estimated on undistorted point
+    // coordinates and every output frame is rendered from the raw frame with
+    // one remap composing the lens undistortion, the stabilizing affine and
+    // the border crop.
+    bool fused = !calib_fn.empty();
+    Mat intrinsic, distcoeffs, undist_map, composed_map;
+    int vert_border = horizon_crop * first.rows / first.cols;
+    Mat C = cropAffine(first.size(), horizon_crop, vert_border);
+    if ( fused )
+    {
+      if ( !readCalibration(calib_fn, intrinsic, distcoeffs) )
+      {
+        throw invalid_argument( "could not read calibration from " + calib_fn );
+      }
+      UndistortMaps maps = loadUndistortMaps(intrinsic, distcoeffs, first.size(), INTER_LINEAR, cache_dir);
+      undist_map = undistortFloatMap(maps);
+    }
+
+    // With tiles, every tile is warped on its own from the raw frame (the
+    // frame's affine shifted to the tile) and encoded by the thread that
+    // rendered it, so the stabilized full frame is never built, encoded or
+    // decoded again for splitting.
+    unique_ptr<TileRenderer> tiler;
+    vector<unique_ptr<FrameSink> > tile_writers;
+    if ( tiled )
+    {
+      boost::filesystem::create_directories(output_fn);
+      vector<Rect> rects;
+      for ( int y = 0; y < numy; ++y )
+      {
+        for ( int x = 0; x < numx; ++x )
+        {
+          rects.push_back(tileRect(first.size(), x, y, numx, numy, overlap));
+          stringstream out_key;
+          out_key << y << "-" << x << "-0";
+          string out_fn = (boost::filesystem::path(output_fn) / (out_key.str() + ".avi")).string();
+          tile_writers.push_back(FrameSink::open(out_fn, capturefirst->fps(), rects.back().size(), sink_opts));
+        }
+      }
+      tiler.reset(new TileRenderer(rects, undist_map, tile_threads));
+      cout << "Writing " << numx << "x" << numy << " tiles to " << output_fn << endl;
+    }
+
+    auto render_tiles = [&]( const Mat &frame, const Mat &T )
+    {
+      Mat T_inv;
+      invertAffineTransform(T, T_inv);
+      tiler->render(frame, composeAffine(T_inv, C), [&tile_writers]( int i, const Mat &tile ) {
+        *tile_writers[i] << tile;
+      });
+    };
+
+    if ( tiled )
+    {
+      render_tiles(first, Mat::eye(2, 3, CV_64F));
+    }
+    else if ( fused )
+    {
+      Mat first_out;
+      composeUndistortAffine(undist_map, C, first.size(), composed_map);
+      remap(first, first_out, composed_map, Mat(), INTER_LINEAR);
+      *writer << first_out;
+    }
+    else
+    {
+      *writer << first;
+    }
+
+    // With --warp-threads the output is rendered by the striped warp engine
+    // on a separate render stage, so tracking frame k+1 overlaps warping and
+    // encoding frame k. The crop is folded into the warp in that case.
+    unique_ptr<WarpEngine> engine;
+    if ( warp_threads > 0 )
+    {
+      engine.reset(new WarpEngine(warp_threads));
+    }
+
+    auto render = [&]( const Mat &frame, const Mat &T, Mat &out )
+    {
+      TRACE_SCOPE("render");
+      Mat T_inv;
+      invertAffineTransform(T, T_inv);
+      if ( engine && fused )
+      {
+        engine->warpUndistortAffine(frame, out, undist_map, composeAffine(T_inv, C), frame.size());
+      }
+      else if ( engine )
+      {
+        engine->warpAffine(frame, out, composeAffine(T_inv, C), frame.size(), INTER_LINEAR | WARP_INVERSE_MAP);
+      }
+      else if ( fused )
+      {
+        composeUndistortAffine(undist_map, composeAffine(T_inv, C), frame.size(), composed_map);
+        remap(frame, out, composed_map, Mat(), INTER_LINEAR);
+      }
+      else
+      {
+        warpAffine( frame, out, T, frame.size() );
+        //warpPerspective(frame, out, T, frame.size());
+
+        out = out( Range(vert_border, out.rows-vert_border), Range(horizon_crop, out.cols-horizon_crop) );
+        resize(out, out, frame.size());
+      }
+    };
+
+    auto output = [&]( const Mat &frame, const Mat &T )
+    {
+      if ( tiler )
+      {
+        render_tiles(frame, T);
+      }
+      else
+      {
+        Mat currT;
+        render(frame, T, currT);
+        *writer << currT;
+      }
+    };
+
+    // declared after render so queued renders finish before it goes away;
+    // tiles are rendered on this stage as well
+    unique_ptr<ThreadPool> render_stage;
+    future<void> rendering;
+    if ( engine || tiler )
+    {
+      render_stage.reset(new ThreadPool(1));
+      render_stage->submit([] { traceThreadName("render"); });
+    }
 
     Mat last_T;
-    capturefirst.release();
+    capturefirst.reset();
 
-    VideoCapture capture(fn);
-    cout << "Analyzing" << endl;
-    int k = 0;
-    while ( k < max_frames - 1 )
+    // Registers a frame to the reference; called on the tracking workers
+    // with --track-threads.
+    auto track = [&]( Tracker &t, const Frame &frame )
     {
-      capture >> curr;
-      
-      if ( curr.data == NULL )
+      TRACE_SCOPE("track");
+      int64 t0 = getTickCount();
+      Tracked r;
+      Mat &T = r.T;
+      r.stats.frame = frame.index;
+      // with --motion phase the frame is registered to the reference by
+      // phase correlation, and by the tracked corners when that is unsure
+      if ( t.phase )
       {
-        break;
+        GlobalMotion gm = t.phase->estimate(frame.luma);
+        if ( gm.confidence >= motion_opts.min_confidence )
+        {
+          invertAffineTransform(gm.T, T);
+          r.stats.flags |= FrameStats::PHASE;
+        }
+        else
+        {
+          t.fallbacks++;
+        }
       }
 
-      cvtColor(curr, curr_grey, COLOR_BGR2GRAY);
-      
-      vector <Point2f> curr_corners, curr_corners2;
-      vector <uchar> status;
-      vector <float> err;
+      if ( T.empty() )
+      {
+        vector <Point2f> first_corners2, curr_corners, curr_corners2;
+        vector <uchar> status;
+        vector <float> err;
+        double to_full = 1.0 / analysis_scale;
 
-      calcOpticalFlowPyrLK(first_grey, curr_grey, first_corners, curr_corners, status, err);
+        if ( t.hierarchical )
+        {
+          t.hierarchical->trackPoints(frame.luma, curr_corners, status);
+          to_full = 1.0;
+          r.stats.flags |= FrameStats::HIERARCHICAL;
+        }
+        else
+        {
+          greyDownscale(frame.luma, t.curr_grey, analysis_size);
+          TRACE_SCOPE("calcOpticalFlowPyrLK");
+          calcOpticalFlowPyrLK(first_pyr, t.curr_grey, first_tracked, curr_corners, status, err);
+        }
       
-      // weed out bad matches
-      first_corners2.clear();
-      for ( int i = 0; i < status.size(); ++i )
-      {
-        if ( status[i] )
+        // weed out bad matches
+        for ( int i = 0; i < status.size(); ++i )
+        {
+          if ( status[i] )
+          {
+            first_corners2.push_back(first_corners[i]);
+            curr_corners2.push_back(curr_corners[i] * to_full);
+          }
+        }
+
+        if ( fused )
         {
-          first_corners2.push_back(first_corners[i]);
-          curr_corners2.push_back(curr_corners[i]);
+          // only the points are undistorted, never the frames
+          vector <Point2f> first_u, curr_u;
+          undistortPixelPoints(first_corners2, first_u, intrinsic, distcoeffs);
+          undistortPixelPoints(curr_corners2, curr_u, intrinsic, distcoeffs);
+          first_corners2.swap(first_u);
+          curr_corners2.swap(curr_u);
         }
+
+        //Mat T = estimateRigidTransform(curr_corners2, first_corners2, true);
+        //Mat T = findHomography(curr_corners2, first_corners2, CV_RANSAC);
+        T = estimateRigidTransformRansac(curr_corners2, first_corners2, true, ransac_max_iters, ransac_good_ratio,
+                                         &r.stats.ransac);
+      }
+      r.stats.track_ms = (getTickCount() - t0) * 1000. / getTickFrequency();
+      return r;
+    };
+
+    unique_ptr<StatsLog> stats_log;
+    if ( !stats_fn.empty() )
+    {
+      stats_log.reset(new StatsLog(stats_fn, fn));
+    }
+
+    // Frame to frame motion between two frame to reference transforms.
+    auto relative = []( const Mat &A, const Mat &B )
+    {
+      if ( A.empty() || B.empty() )
+      {
+        return Mat();
       }
+      Mat A_inv;
+      invertAffineTransform(A, A_inv);
+      return composeAffine(A_inv, B);
+    };
 
-      //Mat T = estimateRigidTransform(curr_corners2, first_corners2, true);
-      //Mat T = findHomography(curr_corners2, first_corners2, CV_RANSAC);
-      Mat T = estimateRigidTransformRansac(curr_corners2, first_corners2, true, ransac_max_iters, ransac_good_ratio);
+    // With --analysis-stride only every stride.next()-th frame is tracked
+    // and the frames in between are interpolated, see resolve below.
+    // key_T is the transform of the last tracked frame that was finished.
+    AnalysisStride stride(motion_opts);
+    Mat key_T;
+    int key_index = -1, interpolated = 0;
+
+    // Takes the frames in order: the last_T fallback, the stats, then the
+    // output.
+    int done = 0, reused = 0;
+    auto finish = [&]( const FramePtr &frame, Tracked &r )
+    {
+      Mat &T = r.T;
+      if ( !r.interpolated && key_index >= 0 )
+      {
+        stride.update(stride.calm(relative(key_T, T), frame->index - key_index, r.stats.ransac));
+      }
       if ( T.data == NULL )
       {
         last_T.copyTo(T);
+        r.stats.flags |= FrameStats::REUSED;
+        reused++;
+      }
+      if ( stats_log && !r.interpolated )
+      {
+        stats_log->write(r.stats);
+      }
+      if ( r.interpolated )
+      {
+        interpolated++;
+      }
+      else
+      {
+        T.copyTo(key_T);
+        key_index = frame->index;
       }
 
       T.copyTo(last_T);
 
-      Mat currT;
-      warpAffine( curr, currT, T, curr.size() );
-      //warpPerspective(curr, currT, T, curr.size());
+      if ( render_stage )
+      {
+        if ( rendering.valid() )
+        {
+          TRACE_SCOPE("render_wait");
+          rendering.get();
+        }
+        Mat frame_T = T.clone();
+        // the FramePtr keeps the decoded buffer out of the pool until rendered
+        rendering = render_stage->submit([&output, frame, frame_T] {
+          output(frame->image, frame_T);
+        });
+      }
+      else
+      {
+        output(frame->image, T);
+      }
 
-      int vert_border = horizon_crop * first.rows / first.cols;
-      currT = currT( Range(vert_border, currT.rows-vert_border), Range(horizon_crop, currT.cols-horizon_crop) );
-      resize(currT, currT, curr.size());
-      writer << currT;
+      disp_progress((float)done/(max_frames-1), 50);
+      done++;
+    };
 
-      disp_progress((float)k/(max_frames-1), 50);
+    // Frames being tracked, or waiting for the next tracked frame to be
+    // interpolated, oldest first: the reorder buffer. Their pool buffers are
+    // held until they are finished, so the pool grows by as many.
+    struct Pending
+    {
+      Pending() : key(false), resolved(false) {}
+      FramePtr frame;
+      shared_ptr<Tracked> result;
+      future<void> tracked;  // while tracked on the pool
+      bool key;              // tracked rather than interpolated
+      bool resolved;         // interpolated or, after all, tracked
+    };
+    deque<Pending> pending;
+    int in_flight = 0, submitted = 0;
+    unique_ptr<ThreadPool> track_pool;
+    if ( trackers.size() > 1 )
+    {
+      track_pool.reset(new ThreadPool(track_workers));
+    }
+    if ( trackers.size() > 1 || motion_opts.stride > 1 )
+    {
+      src_opts.buffers = (src_opts.buffers > 0 ? src_opts.buffers : src_opts.prefetch + 4) +
+                         (int) trackers.size() * motion_opts.stride;
+    }
+    auto wait = [&]( Pending &p )
+    {
+      if ( p.tracked.valid() )
+      {
+        TRACE_SCOPE("track_wait");
+        p.tracked.get();
+        in_flight--;
+      }
+    };
+
+    // The frames before the next tracked one are interpolated between the
+    // last finished frame and that one when the motion between them is
+    // steady, and tracked one by one otherwise.
+    auto resolve = [&]()
+    {
+      size_t end = 1;
+      while ( !pending[end].key )
+      {
+        end++;
+      }
+      wait(pending[end]);
+      const Tracked &b = *pending[end].result;
+      int span = pending[end].frame->index - key_index;
+      bool calm = stride.calm(relative(key_T, b.T), span, b.stats.ransac);
+      if ( !calm )
+      {
+        stride.update(false);
+      }
+      for ( size_t i = 0; i < end; ++i )
+      {
+        Pending &p = pending[i];
+        if ( calm )
+        {
+          p.result->T = affineInterpolate(key_T, b.T, (double)(p.frame->index - key_index) / span);
+          p.result->stats.frame = p.frame->index;
+          p.result->interpolated = true;
+        }
+        else
+        {
+          *p.result = track(redo, *p.frame);
+        }
+        p.resolved = true;
+      }
+    };
+
+    auto finish_oldest = [&]()
+    {
+      if ( !pending.front().key && !pending.front().resolved )
+      {
+        resolve();
+      }
+      Pending p = move(pending.front());
+      pending.pop_front();
+      wait(p);
+      finish(p.frame, *p.result);
+    };
+
+    src_opts.luma = true;
+    unique_ptr<FrameSource> capture = FrameSource::open(fn, src_opts);
+    cout << "Analyzing" << endl;
+    int k = 0, last_key = -1;
+    while ( k < max_frames - 1 )
+    {
+      FramePtr frame = capture->next();
+      if ( !frame )
+      {
+        break;
+      }
+
+      Pending p;
+      p.frame = frame;
+      p.result = make_shared<Tracked>();
+      p.key = last_key < 0 || frame->index - last_key >= stride.next() || k == max_frames - 2;
+      if ( !p.key )
+      {
+        pending.push_back(move(p));
+        k++;
+        continue;
+      }
+      last_key = frame->index;
+
+      if ( track_pool )
+      {
+        while ( in_flight == (int) trackers.size() )
+        {
+          finish_oldest();
+        }
+        // trackers are used round robin and finished in order, so the last
+        // user of this one is done
+        Tracker &t = trackers[submitted++ % trackers.size()];
+        shared_ptr<Tracked> result = p.result;
+        p.tracked = track_pool->submit([&track, &t, frame, result] {
+          traceThreadName("track");
+          *result = track(t, *frame);
+        });
+        in_flight++;
+        pending.push_back(move(p));
+      }
+      else
+      {
+        *p.result = track(trackers[0], *frame);
+        pending.push_back(move(p));
+        while ( !pending.empty() )
+        {
+          finish_oldest();
+        }
+      }
       k++;
     }
+    // the video ended within a stride: its last frame ends it
+    if ( !pending.empty() && !pending.back().key )
+    {
+      *pending.back().result = track(redo, *pending.back().frame);
+      pending.back().key = true;
+    }
+    while ( !pending.empty() )
+    {
+      finish_oldest();
+    }
+    if ( rendering.valid() )
+    {
+      rendering.get();
+    }
+    if ( writer )
+    {
+      writer->close();
+    }
+    for ( size_t i = 0; i < tile_writers.size(); ++i )
+    {
+      tile_writers[i]->close();
+    }
     cout << endl;
-    capture.release();
+    capture.reset();
+    cout << reused << " frames reused the last transform" << endl;
+    if ( motion_opts.stride > 1 )
+    {
+      cout << interpolated << " frames interpolated" << endl;
+    }
+    if ( motion_opts.method == "phase" )
+    {
+      int fallbacks = 0;
+      for ( size_t i = 0; i < trackers.size(); ++i )
+      {
+        fallbacks += trackers[i].fallbacks;
+      }
+      fallbacks += redo.fallbacks;
+      cout << fallbacks << " frames fell back to the tracked corners" << endl;
+    }
+
+    if ( engine )
+    {
+      WarpStats ws = engine->stats();
+      cout << "Warp engine: " << engine->threads() << " threads, "
+           << (ws.calls ? ws.total_ms / ws.calls : 0.0) << " ms per frame, " << ws.kernel_calls
+           << " frames by the " << nearIdentityKernel() << " near-identity kernel" << endl;
+    }
 
   }
   catch ( exception& e )
@@ -9,9 +9,13 @@
 #include <string>
 #include <vector>
 #include <cmath>
+#include <memory>
 
 //relative files
 #include "ert.h"
+#include "frame_source.h"
+#include "frame_sink.h"
+#include "trace.h"
 
 // namespaces
 using namespace std;
@@ -107,6 +111,9 @@ int main( int argc, char **argv ) {
   int ransac_max_iters;
   float ransac_good_ratio;
   int reset_start;
+  FrameSourceOptions src_opts;
+  FrameSinkOptions sink_opts;
+  TraceOptions trace_opts;
   try
   {
     po::options_description desc("Options");
@@ -124,6 +131,10 @@ int main( int argc, char **argv ) {
       ("footage,f", po::value<string>(&fn)->required(), "footage file")
       ("output,o", po::value<string>(&output_fn)->default_value("output.avi"), "output file");
 
+    desc.add(frameSourceOptions(src_opts));
+    desc.add(frameSinkOptions(sink_opts));
+    desc.add(traceOptions(trace_opts));
+
     po::positional_options_description positionalOptions; 
     positionalOptions.add("footage", 1);
 
@@ -143,6 +154,7 @@ int main( int argc, char **argv ) {
       }
       
       po::notify(vm);
+      traceStart(trace_opts);
     }
     catch ( po::error& e )
     {
@@ -154,12 +166,14 @@ int main( int argc, char **argv ) {
     {
       throw invalid_argument( "selected end frame is before start frame");
     }
-    VideoCapture capturefirst(fn);
-    VideoWriter writer;
-    writer.open(output_fn, CV_FOURCC('m','p','4','v'), capturefirst.get(CV_CAP_PROP_FPS), Size((int) capturefirst.get(CV_CAP_PROP_FRAME_WIDTH), (int) capturefirst.get(CV_CAP_PROP_FRAME_HEIGHT)), true);
-    Mat curr, curr_grey;
+    FrameSourceOptions first_opts = src_opts;
+    first_opts.start_frame = start_frame;
+    first_opts.prefetch = 1;
+    unique_ptr<FrameSource> capturefirst = FrameSource::open(fn, first_opts);
+    unique_ptr<FrameSink> writer = FrameSink::open(output_fn, capturefirst->fps(), capturefirst->size(), sink_opts);
+    Mat curr_grey;
     Mat first, first_grey, first_grey_disp;
-    int max_frames = capturefirst.get(CV_CAP_PROP_FRAME_COUNT);
+    int max_frames = capturefirst->frameCount();
     printf("Number of frames in video: %d\n",max_frames);
     printf("Reset point selection after %d frames\n",reset_start);
     if ( start_frame > max_frames )
@@ -170,12 +184,13 @@ int main( int argc, char **argv ) {
     {
       end_frame = max_frames;
     }
-    capturefirst.set(CV_CAP_PROP_POS_FRAMES, start_frame);
-    do
+    FramePtr first_frame = capturefirst->next();
+    if ( !first_frame )
     {
-      capturefirst >> first;
+      throw invalid_argument( "could not read the manual frame" );
     }
-    while ( first.data == NULL );
+    first = first_frame->image.clone();
+    first_frame.reset();
     cvtColor(first, first_grey, COLOR_BGR2GRAY);
     resize(first_grey, first_grey_disp, Size(), scale_factor, scale_factor);
     vector <Point2f> first_corners, first_corners2;
@@ -187,28 +202,35 @@ int main( int argc, char **argv ) {
     waitKey(0);
     cout << first_corners.size() << " corners detected." << endl;
     destroyAllWindows();
-    writer << first;
+    *writer << first;
 
     Mat last_T;
-    capturefirst.release();
+    capturefirst.reset();
 
-    VideoCapture capture(fn);
+    unique_ptr<FrameSource> capture = FrameSource::open(fn, src_opts);
     cout << "Analyzing" << endl;
     int k = 0;
     while ( k < max_frames - 1 )
     {
-      capture >> curr; 
-      if ( curr.data == NULL )
+      FramePtr frame = capture->next();
+      if ( !frame )
       {
         break;
       }
+      const Mat &curr = frame->image;
 
-      cvtColor(curr, curr_grey, COLOR_BGR2GRAY);
+      {
+        TRACE_SCOPE("cvtColor");
+        cvtColor(curr, curr_grey, COLOR_BGR2GRAY);
+      }
       vector <Point2f> curr_corners, curr_corners2;
       vector <uchar> status;
       vector <float> err;
 
-      calcOpticalFlowPyrLK(first_grey, curr_grey, first_corners, curr_corners, status, err);
+      {
+        TRACE_SCOPE("calcOpticalFlowPyrLK");
+        calcOpticalFlowPyrLK(first_grey, curr_grey, first_corners, curr_corners, status, err);
+      }
       
       // weed out bad matches
       first_corners2.clear();
@@ -232,13 +254,19 @@ int main( int argc, char **argv ) {
       T.copyTo(last_T);
 
       Mat currT;
-      warpAffine( curr, currT, T, curr.size() );
-      //warpPerspective(curr, currT, T, curr.size());
+      {
+        TRACE_SCOPE("warpAffine");
+        warpAffine( curr, currT, T, curr.size() );
+        //warpPerspective(curr, currT, T, curr.size());
+      }
 
       int vert_border = horizon_crop * first.rows / first.cols;
       currT = currT( Range(vert_border, currT.rows-vert_border), Range(horizon_crop, currT.cols-horizon_crop) );
-      resize(currT, currT, curr.size());
-      writer << currT;
+      {
+        TRACE_SCOPE("resize");
+        resize(currT, currT, curr.size());
+      }
+      *writer << currT;
 
 
       if (k > 0 && k % reset_start == 0)
@@ -259,8 +287,9 @@ int main( int argc, char **argv ) {
       disp_progress((float)k/(max_frames-1), 50);
       k++;
     }
+    writer->close();
     cout << endl;
-    capture.release();
+    capture.reset();
 
   }
   catch ( exception& e )
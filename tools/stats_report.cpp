@@ -0,0 +1,200 @@
+// Boost includes
+#include <boost/program_options.hpp>
+
+// General C++ includes
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+//relative files
+#include "stats_log.h"
+
+// namespaces
+using namespace std;
+namespace po = boost::program_options;
+
+// A frame of one of the logs.
+struct LoggedFrame
+{
+  const string *source;
+  FrameStats stats;
+};
+
+// Consecutive badly tracked frames of one log.
+struct Segment
+{
+  const string *source;
+  int first, last;
+  int frames;
+  double ratio_sum;
+};
+
+// Inlier share of a frame's RANSAC; 1 for frames that did not use RANSAC.
+double inlier_ratio( const FrameStats &s )
+{
+  if ( s.flags & FrameStats::PHASE )
+  {
+    return 1;
+  }
+  return s.ransac.points > 0 ? (double) s.ransac.inliers / s.ransac.points : 0;
+}
+
+double percentile( vector<double> v, double p )
+{
+  if ( v.empty() )
+  {
+    return 0;
+  }
+  size_t i = min(v.size() - 1, (size_t)(p * (v.size() - 1) + 0.5));
+  nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+int main( int argc, char **argv )
+{
+  vector<string> logs;
+  int slowest, min_segment;
+  double min_ratio;
+  try
+  {
+    po::options_description desc("Options");
+    desc.add_options()
+      ("help,h", "Print help messages")
+      ("log,l", po::value<vector<string> >(&logs)->required(), "stats logs written with --stats-log")
+      ("slowest,n", po::value<int>(&slowest)->default_value(10), "number of slowest frames listed")
+      ("min-inlier-ratio,r", po::value<double>(&min_ratio)->default_value(0.5), "frames with fewer RANSAC inliers than this share of their points are badly tracked")
+      ("min-segment,s", po::value<int>(&min_segment)->default_value(5), "shortest run of badly tracked frames listed");
+
+    po::positional_options_description positionalOptions;
+    positionalOptions.add("log", -1);
+
+    po::variables_map vm;
+
+    // Parse command line arguments
+    try
+    {
+      po::store(po::command_line_parser(argc, argv).options(desc).positional(positionalOptions).run(), vm);
+
+      if ( vm.count( "help" ) )
+      {
+        cout << "Summarizes the motion estimation stats logs of stabilize and videostab. " << endl << endl;
+        cout << "Usage: " << argv[0] << " [options] <log>..." << endl  << endl << desc << endl;
+
+        return 0;
+      }
+
+      po::notify(vm);
+    }
+    catch ( po::error& e )
+    {
+      cerr << "ERROR: " << e.what() << endl << endl;
+      cerr << desc << endl;
+      return 1;
+    }
+
+    vector<string> sources(logs.size());
+    vector<LoggedFrame> all;
+    vector<Segment> segments;
+    cout << fixed << setprecision(2);
+    for ( size_t l = 0; l < logs.size(); ++l )
+    {
+      vector<FrameStats> frames = readStatsLog(logs[l], &sources[l]);
+      const string *source = &sources[l];
+
+      map<int, int> results;
+      vector<double> ms;
+      double residual = 0, ratio = 0;
+      int reused = 0, fitted = 0;
+      Segment run = { source, -1, -1, 0, 0 };
+      for ( size_t i = 0; i < frames.size(); ++i )
+      {
+        const FrameStats &s = frames[i];
+        LoggedFrame f = { source, s };
+        all.push_back(f);
+        ms.push_back(s.track_ms);
+        if ( s.flags & FrameStats::REUSED )
+        {
+          reused++;
+        }
+        if ( !(s.flags & FrameStats::PHASE) )
+        {
+          results[s.ransac.result]++;
+        }
+        if ( s.ransac.result == RANSAC_OK && s.ransac.points > 0 )
+        {
+          residual += s.ransac.residual;
+          ratio += inlier_ratio(s);
+          fitted++;
+        }
+
+        // a run ends at the first well tracked frame
+        double r = inlier_ratio(s);
+        bool bad = (s.flags & FrameStats::REUSED) || r < min_ratio;
+        if ( bad )
+        {
+          if ( run.frames == 0 )
+          {
+            run.first = s.frame;
+            run.ratio_sum = 0;
+          }
+          run.last = s.frame;
+          run.frames++;
+          run.ratio_sum += r;
+        }
+        if ( (!bad || i + 1 == frames.size()) && run.frames > 0 )
+        {
+          if ( run.frames >= min_segment )
+          {
+            segments.push_back(run);
+          }
+          run.frames = 0;
+        }
+      }
+
+      cout << logs[l] << " (" << *source << "): " << frames.size() << " frames, " << reused << " reused the last transform" << endl;
+      cout << "  RANSAC:";
+      for ( map<int, int>::const_iterator it = results.begin(); it != results.end(); ++it )
+      {
+        cout << " " << ransacResultName(it->first) << " " << it->second;
+      }
+      cout << endl;
+      cout << "  inlier ratio " << (fitted ? ratio / fitted : 0) << ", residual " << (fitted ? residual / fitted : 0) << " px" << endl;
+      cout << "  ms per frame: p50 " << percentile(ms, 0.5) << ", p90 " << percentile(ms, 0.9)
+           << ", p99 " << percentile(ms, 0.99) << ", max " << percentile(ms, 1) << endl;
+    }
+
+    sort(all.begin(), all.end(), []( const LoggedFrame &a, const LoggedFrame &b ) {
+      return a.stats.track_ms > b.stats.track_ms;
+    });
+    cout << endl << "Slowest frames:" << endl;
+    for ( int i = 0; i < slowest && i < (int) all.size(); ++i )
+    {
+      const FrameStats &s = all[i].stats;
+      cout << "  " << *all[i].source << " frame " << s.frame << ": " << s.track_ms << " ms, RANSAC "
+           << s.ransac.ms << " ms, " << s.ransac.iterations << " iterations, "
+           << s.ransac.inliers << "/" << s.ransac.points << " inliers" << endl;
+    }
+
+    sort(segments.begin(), segments.end(), []( const Segment &a, const Segment &b ) {
+      return a.frames > b.frames;
+    });
+    cout << endl << "Badly tracked segments (at least " << min_segment << " frames):" << endl;
+    for ( size_t i = 0; i < segments.size(); ++i )
+    {
+      const Segment &g = segments[i];
+      cout << "  " << *g.source << " frames " << g.first << "-" << g.last << ": " << g.frames
+           << " frames, mean inlier ratio " << g.ratio_sum / g.frames << endl;
+    }
+  }
+  catch ( exception& e )
+  {
+    cerr << "Unhandled Exception reached the top of main: " << e.what() << ", application will now exit." << endl;
+    return 2;
+  }
+
+  return 0;
+}
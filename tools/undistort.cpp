@@ -13,6 +13,13 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <memory>
+
+//relative files
+#include "lens.h"
+#include "warp.h"
+#include "frame_source.h"
+#include "trace.h"
 
 // Defines
 #define SCALE 0.4
@@ -24,8 +31,12 @@ namespace po = boost::program_options;
 
 int main( int argc, char **argv ) {
 
-  string footage, calib_fn;
+  string footage, calib_fn, cache_dir, interp;
+  bool no_cache;
+  int warp_threads;
   int key = 0;
+  FrameSourceOptions src_opts;
+  TraceOptions trace_opts;
 
   try
   {
@@ -34,7 +45,14 @@ int main( int argc, char **argv ) {
     desc.add_options()
       ("help,h", "Print help messages")
       ("calibfn,c", po::value<string>(&calib_fn)->required(), "calibration filename")
-      ("footage,f", po::value<string>(&footage)->required(), "footage file");
+      ("footage,f", po::value<string>(&footage)->required(), "footage file")
+      ("cachedir,d", po::value<string>(&cache_dir)->default_value(defaultMapCacheDir()), "directory for cached undistortion maps")
+      ("nocache", po::bool_switch(&no_cache), "always rebuild the undistortion maps")
+      ("interp", po::value<string>(&interp)->default_value("linear"), "interpolation: nearest, linear, cubic or lanczos")
+      ("warp-threads", po::value<int>(&warp_threads)->default_value(0), "threads for the striped remap, 0 leaves it to OpenCV");
+
+    desc.add(frameSourceOptions(src_opts));
+    desc.add(traceOptions(trace_opts));
 
     po::positional_options_description positionalOptions; 
     positionalOptions.add("calibfn", 1);
@@ -56,6 +74,7 @@ int main( int argc, char **argv ) {
       }
       
       po::notify(vm);
+      traceStart(trace_opts);
     }
     catch ( po::error& e )
     {
@@ -63,27 +82,58 @@ int main( int argc, char **argv ) {
       cerr << desc << endl;
       return 1;
     }
-
-    FileStorage fs(calib_fn, FileStorage::READ);
+    // the striped remap uses the cores itself, OpenCV (process wide) stays
+    // single-threaded from here on
+    if ( warp_threads > 0 )
+    {
+      setNumThreads(1);
+    }
 
     Mat intrinsic, distcoeffs;
+    if ( !readCalibration(calib_fn, intrinsic, distcoeffs) )
+    {
+      throw invalid_argument( "could not read calibration from " + calib_fn );
+    }
 
-    fs["intrinsic"] >> intrinsic;
-    fs["distcoeffs"] >> distcoeffs;
-
-    VideoCapture capture(footage);
-    Mat src, undistorted_img;
-
-    if ( !capture.isOpened() )
+    unique_ptr<FrameSource> capture = FrameSource::open(footage, src_opts);
+    Mat undistorted_img;
+
+    // The remap tables only depend on the calibration and the frame size,
+    // so build (or map from the cache) once instead of on every frame.
+    Size frame_size = capture->size();
+    int interpolation = parseInterpolation(interp);
+    int64 t0 = getTickCount();
+    UndistortMaps maps = loadUndistortMaps(intrinsic, distcoeffs, frame_size, interpolation,
+                                           no_cache ? string() : cache_dir);
+    cout << "Undistortion maps " << (maps.from_cache ? "mapped from cache" : "built")
+         << " in " << 1000.0 * (getTickCount() - t0) / getTickFrequency() << " ms" << endl;
+
+    unique_ptr<WarpEngine> engine;
+    if ( warp_threads > 0 )
     {
-      throw "Error when reading footage";
+      engine.reset(new WarpEngine(warp_threads));
     }
 
     namedWindow("footage", WINDOW_AUTOSIZE);
     while ( true )
     {
-      capture >> src;
-      undistort(src, undistorted_img, intrinsic, distcoeffs);
+      FramePtr frame = capture->next();
+      if ( !frame )
+      {
+        break;
+      }
+      const Mat &src = frame->image;
+      {
+        TRACE_SCOPE("remap");
+        if ( engine )
+        {
+          engine->remap(src, undistorted_img, maps.map1, maps.map2, interpolation);
+        }
+        else
+        {
+          remap(src, undistorted_img, maps.map1, maps.map2, interpolation);
+        }
+      }
       resize(undistorted_img, undistorted_img, Size(), SCALE, SCALE);
       imshow("footage", undistorted_img);
       key = waitKey(1);
@@ -92,8 +142,14 @@ int main( int argc, char **argv ) {
         break;
       }
     }
-    capture.release();
-  
+    capture.reset();
+
+    if ( engine )
+    {
+      WarpStats ws = engine->stats();
+      cout << "Remap: " << engine->threads() << " threads, "
+           << (ws.calls ? ws.total_ms / ws.calls : 0.0) << " ms per frame" << endl;
+    }
   }
   catch ( exception& e )
   {
@@ -1,20 +1,36 @@
 #include <opencv2/opencv.hpp>
+#include <boost/program_options.hpp>
 #include <iostream>
-#include <cassert>
+#include <algorithm>
 #include <cmath>
+#include <deque>
 #include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include "camera_path.h"
+#include "ert.h"
+#include "frame_sink.h"
+#include "frame_source.h"
+#include "grey.h"
+#include "motion.h"
+#include "stats_log.h"
+#include "trace.h"
+#include "warp.h"
 
 using namespace std;
 using namespace cv;
+namespace po = boost::program_options;
 
-// This video stablisation smooths the global trajectory using a sliding average window
+// This video stablisation smooths the global trajectory using a sliding average window,
+// or with --smoother l1 computes the L1-optimal camera path that keeps the crop filled
 
 const int SMOOTHING_RADIUS = 30; // In frames. The larger the more stable the video, but less reactive to sudden panning
-const int HORIZONTAL_BORDER_CROP = 20; // In pixels. Crops the border to reduce the black borders from stabilisation being too noticeable.
 
 // 1. Get previous to current frame transformation (dx, dy, da) for all frames
 // 2. Accumulate the transformations to get the image trajectory
-// 3. Smooth out the trajectory using an averaging window
+// 3. Smooth out the trajectory using an averaging window (or the L1 path smoother)
 // 4. Generate new set of previous to current transform, such that the trajectory ends up being the same as the smoothed trajectory
 // 5. Apply the new transformation to the video
 
@@ -46,67 +62,527 @@ struct Trajectory
     double a; // angle
 };
 
-int main(int argc, char **argv)
+// Previous to current frame motion of the analysed frames, by the --motion
+// method, from their luma at full resolution (and the codec's vectors).
+class MotionTracker
 {
-    if(argc < 2) {
-        cout << "./VideoStab [video.avi]" << endl;
+public:
+    MotionTracker(const MotionOptions &_opts, double _analysis_scale, Size frame_size)
+        : fallbacks(0), opts(_opts), analysis_scale(_analysis_scale), analysis_size(scaledSize(frame_size, _analysis_scale)),
+          vectors(_opts.method == "vectors") {
+        // With --motion hierarchical the frames are only looked at on a coarse
+        // level and on small full resolution patches, never as a whole.
+        if(opts.method == "hierarchical") {
+            hierarchical.reset(new HierarchicalEstimator(opts.hierarchy));
+        }
+        // With --motion phase, frames whose correlation peak is too weak (no
+        // texture, too much change) are estimated from features instead.
+        if(opts.method == "phase") {
+            phase.reset(new PhaseCorrelator(opts));
+        }
+    }
+
+    // The first frame, the previous frame of the next track().
+    void start(const FramePtr &frame) {
+        const Mat &luma = frame->luma;
+        if(hierarchical) {
+            hierarchical->track(luma, false, 500, 0.5);
+        }
+        else if(vectors) {
+            prev = frame;
+        }
+        else {
+            greyDownscale(luma, prev_grey, analysis_size);
+        }
+        if(phase) {
+            phase->track(luma);
+        }
+    }
+
+    // Motion from the previous frame to frame, which then becomes the
+    // previous frame; empty when none was found. span is the number of
+    // frames since the previous one. How the motion was found goes to stats
+    // and, for the progress output, to report.
+    Mat track(const FramePtr &frame, FrameStats &stats, string &report, int span = 1) {
+        const Mat &luma = frame->luma;
+        Mat T;
+        double confidence = 0;
+        // the codec's vectors reach one frame back only; over a longer span
+        // (frames --live skipped) the features are tracked instead
+        if(vectors && span == 1) {
+            const MotionVectors &mv = frame->vectors;
+            {
+                TRACE_SCOPE("motion_vectors");
+                T = estimateRigidTransformRansac(mv.from, mv.to, false, 500, 0.5, &stats.ransac);
+            }
+            if(!T.empty() && stats.ransac.inliers >= opts.min_vector_inliers * stats.ransac.points) {
+                stats.flags |= FrameStats::VECTORS;
+            }
+            else {
+                // intra frames, or vectors that follow the scene rather than the camera
+                T = Mat();
+                fallbacks++;
+            }
+        }
+        bool by_vectors = !T.empty();
+        if(hierarchical) {
+            // no fallback: an empty estimate keeps the last transform
+            T = hierarchical->track(luma, false, 500, 0.5, &stats.ransac);
+            stats.flags |= FrameStats::HIERARCHICAL;
+        }
+        else if(!vectors) {
+            greyDownscale(luma, cur_grey, analysis_size);
+        }
+        if(phase) {
+            GlobalMotion gm = phase->track(luma);
+            confidence = gm.confidence;
+            if(confidence >= opts.min_confidence) {
+                T = gm.T;
+                stats.flags |= FrameStats::PHASE;
+            }
+            else {
+                fallbacks++;
+            }
+        }
+        bool by_phase = !T.empty();
+
+        // vector from prev to cur
+        vector <Point2f> prev_corner, cur_corner;
+        vector <Point2f> prev_corner2, cur_corner2;
+        vector <uchar> status;
+        vector <float> err;
+
+        if(T.empty() && !hierarchical) {
+            if(vectors) {
+                // only the fallbacks need the proxies
+                greyDownscale(prev->luma, prev_grey, analysis_size);
+                greyDownscale(luma, cur_grey, analysis_size);
+            }
+            {
+                TRACE_SCOPE("goodFeaturesToTrack");
+                goodFeaturesToTrack(prev_grey, prev_corner, 200, 0.01, 30);
+            }
+            {
+                TRACE_SCOPE("calcOpticalFlowPyrLK");
+                calcOpticalFlowPyrLK(prev_grey, cur_grey, prev_corner, cur_corner, status, err);
+            }
+
+            // weed out bad matches, back in full resolution pixels
+            for(size_t i=0; i < status.size(); i++) {
+                if(status[i]) {
+                    prev_corner2.push_back(prev_corner[i] * (1.0 / analysis_scale));
+                    cur_corner2.push_back(cur_corner[i] * (1.0 / analysis_scale));
+                }
+            }
+
+            // translation + rotation only; Ert's RANSAC with OpenCV's
+            // estimateRigidTransform settings, which also reports how it went
+            T = estimateRigidTransformRansac(prev_corner2, cur_corner2, false, 500, 0.5, &stats.ransac); // false = rigid transform, no scaling/shearing
+        }
+        swap(prev_grey, cur_grey);
+        if(vectors) {
+            prev = frame;
+        }
+
+        ostringstream out;
+        if(hierarchical) {
+            out << "refined patches: " << stats.ransac.inliers << "/" << stats.ransac.points;
+        }
+        else if(by_vectors) {
+            out << "motion vectors: " << stats.ransac.inliers << "/" << stats.ransac.points;
+        }
+        else if(by_phase) {
+            out << "phase correlation: " << confidence;
+        }
+        else {
+            out << "good optical flow: " << prev_corner2.size();
+        }
+        report = out.str();
+        return T;
+    }
+
+    int fallbacks; // phase correlations or motion vectors that fell back to features
+
+private:
+    MotionOptions opts;
+    double analysis_scale;
+    Size analysis_size;
+    bool vectors;
+    unique_ptr<HierarchicalEstimator> hierarchical;
+    unique_ptr<PhaseCorrelator> phase;
+    Mat prev_grey, cur_grey;
+    FramePtr prev; // with vectors, whose proxy is only made for a fallback
+};
+
+// Least squares line through the poses of the frames, evaluated at frame
+// index. Unlike their mean it follows a steady pan without lagging behind,
+// so a window that mostly lies in the past still smooths without delay.
+Trajectory fit_line(const deque<pair<int, Trajectory> > &path, int index)
+{
+    double n = 0, st = 0, stt = 0;
+    double sx = 0, sy = 0, sa = 0, stx = 0, sty = 0, sta = 0;
+    for(size_t i=0; i < path.size(); i++) {
+        double t = path[i].first - index;
+        const Trajectory &p = path[i].second;
+        n++;
+        st += t;
+        stt += t*t;
+        sx += p.x;
+        sy += p.y;
+        sa += p.a;
+        stx += t*p.x;
+        sty += t*p.y;
+        sta += t*p.a;
+    }
+    double det = n*stt - st*st;
+    if(fabs(det) < 1e-9) {
+        return Trajectory(sx/n, sy/n, sa/n);
+    }
+    // intercept at t = 0
+    return Trajectory((stt*sx - st*stx) / det, (stt*sy - st*sty) / det, (stt*sa - st*sta) / det);
+}
+
+double percentile(vector<double> v, double p)
+{
+    if(v.empty()) {
         return 0;
     }
+    size_t i = min(v.size() - 1, (size_t)(p * (v.size() - 1) + 0.5));
+    nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
 
-    // For further analysis
-    ofstream out_transform("prev_to_cur_transformation.txt");
-    ofstream out_trajectory("trajectory.txt");
-    ofstream out_smoothed_trajectory("smoothed_trajectory.txt");
-    ofstream out_new_transform("new_prev_to_cur_transformation.txt");
+// Renders cur moved by T (2x3, frame to stabilized) with the border crop
+// resized away. The warp engine folds the crop into a single warp, which
+// its near-identity kernel renders; otherwise OpenCV warps, crops and
+// resizes.
+void render_stabilized(const Mat &cur, const Mat &T, int hcrop, WarpEngine *engine, Mat &out)
+{
+    int vert_border = verticalCrop(cur.size(), hcrop); // get the aspect ratio correct
+    if(engine) {
+        TRACE_SCOPE("warp_engine");
+        Mat T_inv;
+        invertAffineTransform(T, T_inv);
+        Mat C = cropAffine(cur.size(), hcrop, vert_border);
+        engine->warpAffine(cur, out, composeAffine(T_inv, C), cur.size(), INTER_LINEAR | WARP_INVERSE_MAP);
+        return;
+    }
+    Mat cur2;
+    {
+        TRACE_SCOPE("warpAffine");
+        warpAffine(cur, cur2, T, cur.size());
+    }
+    cur2 = cur2(Range(vert_border, cur2.rows-vert_border), Range(hcrop, cur2.cols-hcrop));
+    {
+        TRACE_SCOPE("resize");
+        resize(cur2, out, cur.size());
+    }
+}
 
-    VideoCapture cap(argv[1]);
-    assert(cap.isOpened());
+// --live: stabilizes a stream while it arrives. Each frame's pose is
+// smoothed by a line fitted to the poses of the last SMOOTHING_RADIUS frames
+// and of the next lookahead frames, so it is rendered as soon as those
+// arrived. Frames taken from the source later than latency_ms after they
+// arrived are not analysed: their motion is extrapolated from the last
+// estimate, and the next analysed frame is tracked against the last analysed
+// one. The source itself drops frames when even that is too slow.
+int stabilize_live(const string &fn, FrameSourceOptions src_opts, const MotionOptions &motion_opts,
+                   double analysis_scale, double latency_ms, int lookahead,
+                   const string &out_fn, const FrameSinkOptions &sink_opts, bool preview,
+                   int hcrop, WarpEngine *engine, StatsLog *stats_log)
+{
+    src_opts.live = true;
+    src_opts.color = true;
+    src_opts.luma = true;
+    src_opts.motion_vectors = motion_opts.method == "vectors";
+    // a deep queue in front of a slow consumer only adds latency
+    src_opts.prefetch = min(src_opts.prefetch, 2);
+    src_opts.buffers = src_opts.prefetch + lookahead + 4;
+    unique_ptr<FrameSource> cap = FrameSource::open(fn, src_opts);
+    Size size = cap->size();
+
+    FramePtr first = cap->next();
+    if(!first) {
+        cerr << "No frames in " << fn << endl;
+        return 1;
+    }
 
-    Mat cur, cur_grey;
-    Mat prev, prev_grey;
+    unique_ptr<FrameSink> sink;
+    if(!out_fn.empty()) {
+        sink = FrameSink::open(out_fn, cap->fps() > 0 ? cap->fps() : 30, size, sink_opts);
+    }
 
-    cap >> prev;
-    cvtColor(prev, prev_grey, COLOR_BGR2GRAY);
+    MotionTracker motion(motion_opts, analysis_scale, size);
+    motion.start(first);
 
-    // Step 1 - Get previous to current frame transformation (dx, dy, da) for all frames
-    vector <TransformParam> prev_to_cur_transform; // previous to current
+    // poses of the rendered frames still in the smoothing window and of the
+    // frames waiting for their lookahead, by frame index
+    deque<pair<int, Trajectory> > path;
+    deque<FramePtr> pending;
+    path.push_back(make_pair(first->index, Trajectory(0, 0, 0)));
+    pending.push_back(first);
 
-    int k=1;
-    int max_frames = cap.get(CV_CAP_PROP_FRAME_COUNT);
-    Mat last_T;
+    // pose of the last analysed frame, and the motion per frame since
+    int anchor_index = first->index;
+    Trajectory anchor(0, 0, 0), velocity(0, 0, 0);
+
+    double tick_ms = 1000. / getTickFrequency();
+    vector<double> latencies;
+    int analysed = 0, late = 0, failed = 0;
+    Mat T(2,3,CV_64F);
+
+    // renders the oldest pending frame
+    auto render = [&]() {
+        FramePtr frame = pending.front();
+        size_t i = path.size() - pending.size();
+        Trajectory smoothed = fit_line(path, frame->index);
+        double dx = smoothed.x - path[i].second.x;
+        double dy = smoothed.y - path[i].second.y;
+        double da = smoothed.a - path[i].second.a;
+
+        T.at<double>(0,0) = cos(da);
+        T.at<double>(0,1) = -sin(da);
+        T.at<double>(1,0) = sin(da);
+        T.at<double>(1,1) = cos(da);
+        T.at<double>(0,2) = dx;
+        T.at<double>(1,2) = dy;
+
+        Mat cur2;
+        render_stabilized(frame->image, T, hcrop, engine, cur2);
+        if(sink) {
+            sink->write(cur2);
+        }
+        if(preview) {
+            imshow("stabilized", cur2);
+            waitKey(1);
+        }
+        latencies.push_back((getTickCount() - frame->arrival) * tick_ms);
+
+        pending.pop_front();
+        while(path.size() > pending.size() + SMOOTHING_RADIUS) {
+            path.pop_front();
+        }
+    };
 
     while(true) {
-        cap >> cur;
+        FramePtr cur = cap->next();
 
-        if(cur.data == NULL) {
+        if(!cur) {
             break;
         }
 
-        cvtColor(cur, cur_grey, COLOR_BGR2GRAY);
+        int span = cur->index - anchor_index;
+        Trajectory pose(anchor.x + velocity.x * span, anchor.y + velocity.y * span, anchor.a + velocity.a * span);
+        double lag = (getTickCount() - cur->arrival) * tick_ms;
+        if(lag <= latency_ms) {
+            int64 t0 = getTickCount();
+            FrameStats stats;
+            stats.frame = cur->index;
+            string report;
+            Mat M = motion.track(cur, stats, report, span);
+            stats.track_ms = (getTickCount() - t0) * tick_ms;
+            if(M.data != NULL) {
+                // relative to the last analysed frame
+                double dx = M.at<double>(0,2);
+                double dy = M.at<double>(1,2);
+                double da = atan2(M.at<double>(1,0), M.at<double>(0,0));
+                pose = Trajectory(anchor.x + dx, anchor.y + dy, anchor.a + da);
+                velocity = Trajectory(dx / span, dy / span, da / span);
+            }
+            else {
+                // keep the extrapolated pose, as the file mode keeps the last transform
+                stats.flags |= FrameStats::REUSED;
+                failed++;
+            }
+            if(stats_log) {
+                stats_log->write(stats);
+            }
+            anchor = pose;
+            anchor_index = cur->index;
+            analysed++;
+        }
+        else {
+            late++;
+        }
+
+        path.push_back(make_pair(cur->index, pose));
+        pending.push_back(cur);
+        if((int) pending.size() > lookahead) {
+            render();
+        }
+    }
+    while(!pending.empty()) {
+        render();
+    }
+    if(sink) {
+        sink->close();
+    }
 
-        // vector from prev to cur
-        vector <Point2f> prev_corner, cur_corner;
-        vector <Point2f> prev_corner2, cur_corner2;
-        vector <uchar> status;
-        vector <float> err;
+    cout << latencies.size() << " frames stabilized, " << cap->dropped() << " dropped by the source, "
+         << late << " not analysed (late), " << failed << " without a motion estimate" << endl;
+    cout << "end-to-end latency (ms): p50 " << percentile(latencies, 0.5) << ", p90 " << percentile(latencies, 0.9)
+         << ", p99 " << percentile(latencies, 0.99) << ", max " << percentile(latencies, 1) << endl;
+    if(motion_opts.method == "phase" || motion_opts.method == "vectors") {
+        cout << motion.fallbacks << " frames fell back to features" << endl;
+    }
+    return 0;
+}
 
-        goodFeaturesToTrack(prev_grey, prev_corner, 200, 0.01, 30);
-        calcOpticalFlowPyrLK(prev_grey, cur_grey, prev_corner, cur_corner, status, err);
+int main(int argc, char **argv)
+{
+    string fn, stats_fn, out_fn;
+    double analysis_scale, latency_ms;
+    int lookahead, warp_threads;
+    bool live = false, preview = false;
+    FrameSourceOptions src_opts;
+    FrameSinkOptions sink_opts;
+    MotionOptions motion_opts;
+    PathOptions path_opts;
+    TraceOptions trace_opts;
+
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help,h", "Print help messages")
+        ("footage,f", po::value<string>(&fn)->required(), "footage file")
+        ("analysis-scale", po::value<double>(&analysis_scale)->default_value(1.0), "track motion on frames scaled by this factor (0-1]; the transforms stay in full resolution pixels")
+        ("stats-log", po::value<string>(&stats_fn)->default_value(""), "write the per-frame RANSAC statistics to this binary log, see stats_report")
+        ("warp-threads", po::value<int>(&warp_threads)->default_value(0), "threads of the warp engine, which renders with its near-identity kernel and folds the crop into the warp; 0 leaves warping to OpenCV");
+    desc.add(motionOptions(motion_opts));
+    desc.add(pathOptions(path_opts));
+
+    po::options_description live_desc("Live");
+    live_desc.add_options()
+        ("live", po::bool_switch(&live), "stabilize a stream (URL, named pipe, or - with --decoder raw) while it arrives")
+        ("output,o", po::value<string>(&out_fn)->default_value(""), "with --live, encode the stabilized stream to this file")
+        ("preview", po::bool_switch(&preview), "with --live, show the stabilized stream in a window")
+        ("latency", po::value<double>(&latency_ms)->default_value(100), "with --live, frames taken later than this many ms after they arrived are not analysed")
+        ("lookahead", po::value<int>(&lookahead)->default_value(0), "with --live, frames after a frame that its smoothing waits for");
+    desc.add(live_desc);
+    desc.add(frameSourceOptions(src_opts));
+    desc.add(frameSinkOptions(sink_opts));
+    desc.add(traceOptions(trace_opts));
+
+    po::positional_options_description positionalOptions;
+    positionalOptions.add("footage", 1);
+
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(positionalOptions).run(), vm);
+
+        if(vm.count("help")) {
+            cout << "Usage: " << argv[0] << " [options] <video.avi>" << endl << endl << desc << endl;
+            return 0;
+        }
 
-        // weed out bad matches
-        for(size_t i=0; i < status.size(); i++) {
-            if(status[i]) {
-                prev_corner2.push_back(prev_corner[i]);
-                cur_corner2.push_back(cur_corner[i]);
-            }
+        po::notify(vm);
+        if(analysis_scale <= 0 || analysis_scale > 1) {
+            throw po::error("--analysis-scale must be in (0, 1]");
+        }
+        if(lookahead < 0) {
+            throw po::error("--lookahead must not be negative");
+        }
+        if(live && motion_opts.stride > 1) {
+            throw po::error("--live skips analysing late frames by itself, use it without --analysis-stride");
         }
+        if(motion_opts.method == "vectors" && motion_opts.stride > 1) {
+            // the codec's vectors reach one frame back, a stride would only extrapolate them
+            throw po::error("--motion vectors gives frame to frame motion, use it without --analysis-stride");
+        }
+        if(path_opts.crop < 0) {
+            throw po::error("--crop must not be negative");
+        }
+        if(live && path_opts.smoother != "box") {
+            throw po::error("--live smooths with a line fit over its window, use it without --smoother l1");
+        }
+        traceStart(trace_opts);
+    }
+    catch(po::error& e) {
+        cerr << "ERROR: " << e.what() << endl << endl;
+        cerr << desc << endl;
+        return 1;
+    }
+    // OpenCV's pool is process wide: with the warp engine on the cores the
+    // tracking runs single-threaded, set once before any thread uses OpenCV
+    if(warp_threads > 0) {
+        setNumThreads(1);
+    }
+
+    unique_ptr<StatsLog> stats_log;
+    if(!stats_fn.empty()) {
+        stats_log.reset(new StatsLog(stats_fn, fn));
+    }
+
+    unique_ptr<WarpEngine> engine;
+    if(warp_threads > 0) {
+        engine.reset(new WarpEngine(warp_threads));
+    }
 
-        // translation + rotation only
-        Mat T = estimateRigidTransform(prev_corner2, cur_corner2, false); // false = rigid transform, no scaling/shearing
+    if(live) {
+        return stabilize_live(fn, src_opts, motion_opts, analysis_scale, latency_ms, lookahead,
+                              out_fn, sink_opts, preview, path_opts.crop, engine.get(), stats_log.get());
+    }
+
+    // For further analysis
+    ofstream out_transform("prev_to_cur_transformation.txt");
+    ofstream out_trajectory("trajectory.txt");
+    ofstream out_smoothed_trajectory("smoothed_trajectory.txt");
+    ofstream out_new_transform("new_prev_to_cur_transformation.txt");
 
+    // The analysis pass only needs grey: the decoder hands out luma and never
+    // converts to BGR, which is left to the rendering pass. With a frame
+    // cache it decodes BGR as well, so the rendering pass reads every frame
+    // from the cache instead of decoding the video a second time. That only
+    // pays when all of the video fits in the cache: otherwise the pass evicts
+    // every frame before the rendering pass gets to it, least recently used
+    // first, and the BGR would be converted and cached for nothing.
+    FrameSourceOptions analysis_opts = src_opts;
+    analysis_opts.color = false;
+    analysis_opts.luma = true;
+    analysis_opts.motion_vectors = motion_opts.method == "vectors";
+    // the frames of a stride are held until its end is analysed
+    analysis_opts.buffers = analysis_opts.prefetch + 4 + motion_opts.stride;
+    if(!src_opts.cache_dir.empty()) {
+        // a BGR and a luma slot per frame
+        int frames;
+        Size frame_size;
+        FrameSource::probe(fn, analysis_opts, frames, frame_size);
+        double video_mb = frames * (frame_size.area() * 4.0) / (1 << 20);
+        if(frames > 0 && video_mb <= src_opts.cache_mb) {
+            analysis_opts.color = true;
+        }
+        else {
+            cout << "The video needs " << (long) video_mb << " MB of frame cache, more than --frame-cache-size; "
+                 << "only the analysis pass's luma is cached" << endl;
+        }
+    }
+    unique_ptr<FrameSource> cap = FrameSource::open(fn, analysis_opts);
+
+    FramePtr prev = cap->next();
+    if(!prev) {
+        throw runtime_error("no frames to analyse in " + fn);
+    }
+
+    MotionTracker motion(motion_opts, analysis_scale, cap->size());
+    motion.start(prev);
+
+    // Step 1 - Get previous to current frame transformation (dx, dy, da) for all frames
+    vector <TransformParam> prev_to_cur_transform; // previous to current
+
+    int k=1;
+    int max_frames = cap->frameCount();
+    Mat last_T;
+
+    // Appends the motion of the next frame; T is empty when none was found.
+    auto add = [&](Mat T, FrameStats *stats, const string &report) {
         // in rare cases no transform is found. We'll just use the last known good transform.
         if(T.data == NULL) {
             last_T.copyTo(T);
+            if(stats) {
+                stats->flags |= FrameStats::REUSED;
+            }
+        }
+        if(stats && stats_log) {
+            stats_log->write(*stats);
         }
 
         T.copyTo(last_T);
@@ -120,11 +596,76 @@ int main(int argc, char **argv)
 
         out_transform << k << " " << dx << " " << dy << " " << da << endl;
 
-        cur.copyTo(prev);
-        cur_grey.copyTo(prev_grey);
-
-        cout << "Frame: " << k << "/" << max_frames << " - good optical flow: " << prev_corner2.size() << endl;
+        cout << "Frame: " << k << "/" << max_frames << " - " << report << endl;
         k++;
+    };
+
+    // Motion from the last analysed frame, span frames back, to frame.
+    auto analyse = [&](const FramePtr &frame, int span, FrameStats &stats, string &report) {
+        int64 t0 = getTickCount();
+        stats.frame = frame->index;
+        Mat T = motion.track(frame, stats, report, span);
+        stats.track_ms = (getTickCount() - t0) * 1000. / getTickFrequency();
+        return T;
+    };
+
+    // With --analysis-stride only every stride.next()-th frame is analysed
+    // and the motion of the frames in between is interpolated. When the
+    // motion over the stride is not calm, the skipped frames are analysed
+    // after all, one by one from prev.
+    AnalysisStride stride(motion_opts);
+    vector <FramePtr> skipped;
+
+    while(true) {
+        FramePtr cur = cap->next();
+
+        if(cur && (int) skipped.size() + 1 < stride.next()) {
+            skipped.push_back(cur);
+            continue;
+        }
+        if(!cur) {
+            if(skipped.empty()) {
+                break;
+            }
+            // the video ends within a stride
+            cur = skipped.back();
+            skipped.pop_back();
+        }
+
+        int span = cur->index - prev->index;
+        FrameStats stats;
+        string report;
+        Mat T = analyse(cur, span, stats, report);
+        bool calm = stride.calm(T, span, stats.ransac);
+        if(span == 1) {
+            stride.update(calm);
+            add(T, &stats, report);
+        }
+        else if(calm) {
+            stride.update(calm);
+            Mat step = affinePower(T, 1.0 / span);
+            for(size_t i=0; i < skipped.size(); i++) {
+                add(step, NULL, "interpolated");
+            }
+            add(step, &stats, report);
+        }
+        else {
+            stride.update(false);
+            motion.start(prev);
+            skipped.push_back(cur);
+            for(size_t i=0; i < skipped.size(); i++) {
+                FrameStats frame_stats;
+                Mat frame_T = analyse(skipped[i], 1, frame_stats, report);
+                stride.update(stride.calm(frame_T, 1, frame_stats.ransac));
+                add(frame_T, &frame_stats, report);
+            }
+        }
+        skipped.clear();
+
+        prev = cur;
+    }
+    if(motion_opts.method == "phase" || motion_opts.method == "vectors") {
+        cout << motion.fallbacks << " frames fell back to features" << endl;
     }
 
     // Step 2 - Accumulate the transformations to get the image trajectory
@@ -149,29 +690,57 @@ int main(int argc, char **argv)
     // Step 3 - Smooth out the trajectory using an averaging window
     vector <Trajectory> smoothed_trajectory; // trajectory at all frames
 
-    for(size_t i=0; i < trajectory.size(); i++) {
-        double sum_x = 0;
-        double sum_y = 0;
-        double sum_a = 0;
-        int count = 0;
-
-        for(int j=-SMOOTHING_RADIUS; j <= SMOOTHING_RADIUS; j++) {
-            if(i+j >= 0 && i+j < trajectory.size()) {
-                sum_x += trajectory[i+j].x;
-                sum_y += trajectory[i+j].y;
-                sum_a += trajectory[i+j].a;
-
-                count++;
+    if(path_opts.smoother == "l1") {
+        // Step 4 moves frame i by smoothed_trajectory[i] minus the pose
+        // before its own motion, trajectory[i-1], so that is the path the
+        // crop constraint has to hold for.
+        L1PathSmoother smoother(cap->size(), path_opts);
+        Vec3d smoothed;
+        auto pop = [&]() {
+            while(smoother.pop(smoothed)) {
+                size_t i = smoothed_trajectory.size();
+                smoothed_trajectory.push_back(Trajectory(smoothed[0], smoothed[1], smoothed[2]));
+                out_smoothed_trajectory << (i+1) << " " << smoothed[0] << " " << smoothed[1] << " " << smoothed[2] << endl;
+            }
+        };
+        for(size_t i=0; i < trajectory.size(); i++) {
+            if(i == 0) {
+                smoother.push(Vec3d(0, 0, 0));
             }
+            else {
+                smoother.push(Vec3d(trajectory[i-1].x, trajectory[i-1].y, trajectory[i-1].a));
+            }
+            pop();
         }
+        smoother.finish();
+        pop();
+        cout << "L1 path: " << smoother.windows() << " windows, " << smoother.iterations() << " iterations" << endl;
+    }
+    else {
+        for(size_t i=0; i < trajectory.size(); i++) {
+            double sum_x = 0;
+            double sum_y = 0;
+            double sum_a = 0;
+            int count = 0;
+
+            for(int j=-SMOOTHING_RADIUS; j <= SMOOTHING_RADIUS; j++) {
+                if(i+j >= 0 && i+j < trajectory.size()) {
+                    sum_x += trajectory[i+j].x;
+                    sum_y += trajectory[i+j].y;
+                    sum_a += trajectory[i+j].a;
+
+                    count++;
+                }
+            }
 
-        double avg_a = sum_a / count;
-        double avg_x = sum_x / count;
-        double avg_y = sum_y / count;
+            double avg_a = sum_a / count;
+            double avg_x = sum_x / count;
+            double avg_y = sum_y / count;
 
-        smoothed_trajectory.push_back(Trajectory(avg_x, avg_y, avg_a));
+            smoothed_trajectory.push_back(Trajectory(avg_x, avg_y, avg_a));
 
-        out_smoothed_trajectory << (i+1) << " " << avg_x << " " << avg_y << " " << avg_a << endl;
+            out_smoothed_trajectory << (i+1) << " " << avg_x << " " << avg_y << " " << avg_a << endl;
+        }
     }
 
     // Step 4 - Generate new set of previous to current transform, such that the trajectory ends up being the same as the smoothed trajectory
@@ -202,18 +771,20 @@ int main(int argc, char **argv)
     }
 
     // Step 5 - Apply the new transformation to the video
-    cap.set(CV_CAP_PROP_POS_FRAMES, 0);
+    prev.reset();
+    max_frames = cap->frameCount(); // exact now that the first pass hit the end
+    cap.reset();
+    cap = FrameSource::open(fn, src_opts);
     Mat T(2,3,CV_64F);
 
-    int vert_border = HORIZONTAL_BORDER_CROP * prev.rows / prev.cols; // get the aspect ratio correct
-
     k=0;
     while(k < max_frames-1) { // don't process the very last frame, no valid transform
-        cap >> cur;
+        FramePtr frame = cap->next();
 
-        if(cur.data == NULL) {
+        if(!frame) {
             break;
         }
+        const Mat &cur = frame->image;
 
         T.at<double>(0,0) = cos(new_prev_to_cur_transform[k].da);
         T.at<double>(0,1) = -sin(new_prev_to_cur_transform[k].da);
@@ -223,14 +794,9 @@ int main(int argc, char **argv)
         T.at<double>(0,2) = new_prev_to_cur_transform[k].dx;
         T.at<double>(1,2) = new_prev_to_cur_transform[k].dy;
 
+        // Resized back to cur size, for better side by side comparison
         Mat cur2;
-
-        warpAffine(cur, cur2, T, cur.size());
-
-        cur2 = cur2(Range(vert_border, cur2.rows-vert_border), Range(HORIZONTAL_BORDER_CROP, cur2.cols-HORIZONTAL_BORDER_CROP));
-
-        // Resize cur2 back to cur size, for better side by side comparison
-        resize(cur2, cur2, cur.size());
+        render_stabilized(cur, T, path_opts.crop, engine.get(), cur2);
 
         // Now draw the original and stablised side by side for coolness
         // Mat canvas = Mat::zeros(cur.rows, cur.cols*2+10, cur.type());
@@ -246,7 +812,10 @@ int main(int argc, char **argv)
 
         char str[256];
         sprintf(str, "images/%08d.jpg", k);
-        imwrite(str, cur2);
+        {
+            TRACE_SCOPE("imwrite");
+            imwrite(str, cur2);
+        }
 
         waitKey(20);
 